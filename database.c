@@ -9,11 +9,37 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <wchar.h>
 #include <unistd.h>
-#include <spawn.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+#include "simpledb.h"
+
+// Build with -DENABLE_SPANS=0 to compile the span probes out entirely
+#ifndef ENABLE_SPANS
+#if defined(__GNUC__) || defined(__clang__)
+#define ENABLE_SPANS 1
+#else
+#define ENABLE_SPANS 0
+#endif
+#endif
+#if ENABLE_SPANS && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SPAN_USDT 1
+#endif
+#endif
 
 // GLOBAL VARIABLES
 #ifdef _WIN32
@@ -43,14 +69,37 @@ typedef SSIZE_T ssize_t;
 #define EMAIL_OFFSET (USERNAME_OFFSET + USERNAME_SIZE)
 #define ROW_SIZE (ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
 
-#define PAGE_SIZE 4096
-#define TABLE_MAX_PAGES 100
-#define ROWS_PER_PAGE (PAGE_SIZE / ROW_SIZE)
-#define TABLE_MAX_ROWS (ROWS_PER_PAGE * TABLE_MAX_PAGES)
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+#define TABLE_MAX_PAGES (1 << 24)
+#define PAGER_INITIAL_CAPACITY 256
+#define PAGER_DIRECT_IO 0x1
+#define PAGER_HUGE_PAGES 0x2
+// Other processes may open the same file, see pagerLock
+#define PAGER_SHARED 0x4
+// Implies PAGER_SHARED, with the processes sharing one mapping of the file as their page cache
+#define PAGER_SHARED_CACHE 0x8
+// A byte of the db file past any page that every open locks for as long as it is open, see pagerOpenLock
+#define PAGER_OPEN_LOCK_OFFSET ((off_t)TABLE_MAX_PAGES * MAX_PAGE_SIZE)
+// Opening this name gives a database with no file behind it, see 'save' and 'load'
+#define MEMORY_DATABASE_NAME ":memory:"
+// Page frames come from chunks this size, which keeps them aligned for O_DIRECT
+#define FRAME_CHUNK_SIZE (64 << 20)
+#define FRAME_ALIGNMENT 4096
+// A cached internal node's child slot can hold this tag and a frame index in place of the page
+// number, so lookups skip the page table. Page numbers stay below TABLE_MAX_PAGES and never carry it
+#define PAGE_SWIZZLED 0x80000000u
+#define isSwizzled(slot) (((slot) & PAGE_SWIZZLED) != 0 && (slot) != INVALID_PAGE_NUM)
 
 #define MAX_INSERT_ARGS 3
 #define SELECT_ARGS
 
+#define INPUT_BUFFER_SIZE (1 << 20)
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define OUTPUT_MAX_ROW_SIZE (16 + 6 * (MAX_USERNAME_SIZE + MAX_EMAIL_SIZE) + 64)
+#define ALIGNED_ID_WIDTH 10
+
 /*
 * Common Node Header Layout
 */
@@ -60,7 +109,9 @@ typedef SSIZE_T ssize_t;
 #define IS_ROOT_OFFSET NODE_TYPE_SIZE
 #define PARENT_POINTER_SIZE sizeof(uint32_t)
 #define PARENT_POINTER_OFFSET (IS_ROOT_OFFSET + IS_ROOT_SIZE)
-#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE)
+#define NODE_CHECKSUM_SIZE sizeof(uint32_t)
+#define NODE_CHECKSUM_OFFSET (PARENT_POINTER_OFFSET + PARENT_POINTER_SIZE)
+#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE + NODE_CHECKSUM_SIZE)
 
 /*
 * Leaf Node Header Layout
@@ -69,21 +120,24 @@ typedef SSIZE_T ssize_t;
 #define LEAF_NODE_NUM_CELLS_OFFSET COMMON_NODE_HEADER_SIZE
 #define LEAF_NODE_NEXT_LEAF_SIZE sizeof(uint32_t)
 #define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
-#define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE)
+#define LEAF_NODE_KEY_SIZE_SIZE sizeof(uint32_t)
+#define LEAF_NODE_KEY_SIZE_OFFSET (LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE)
+#define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + \
+    LEAF_NODE_KEY_SIZE_SIZE)
 
 /*
 * Leaf Node Body Layout
 */
-#define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
+// Keys are encoded byte strings of the size given in the node header, see Key Encoding
 #define LEAF_NODE_KEY_OFFSET 0
 #define LEAF_NODE_VALUE_SIZE ROW_SIZE
-#define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
-#define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
-#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
+#define LEAF_NODE_CELL_SIZE(keySize) ((keySize) + LEAF_NODE_VALUE_SIZE)
+#define LEAF_NODE_SPACE_FOR_CELLS(pageSize) ((pageSize) - LEAF_NODE_HEADER_SIZE)
+#define LEAF_NODE_MAX_CELLS(pageSize, keySize) (LEAF_NODE_SPACE_FOR_CELLS(pageSize) / LEAF_NODE_CELL_SIZE(keySize))
 
-#define LEAF_NODE_RIGHT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) / 2)
-#define LEAF_NODE_LEFT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT)
+#define LEAF_NODE_RIGHT_SPLIT_COUNT(pageSize, keySize) ((LEAF_NODE_MAX_CELLS(pageSize, keySize) + 1) / 2)
+#define LEAF_NODE_LEFT_SPLIT_COUNT(pageSize, keySize) \
+    ((LEAF_NODE_MAX_CELLS(pageSize, keySize) + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT(pageSize, keySize))
 
 /*
 * Internal Node Header Layout
@@ -92,145 +146,1039 @@ typedef SSIZE_T ssize_t;
 #define INTERNAL_NODE_NUM_KEYS_OFFSET COMMON_NODE_HEADER_SIZE
 #define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
-#define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
-#define INTERNAL_NODE_MAX_CELLS 3
+// Same place as in a leaf, so nodeKeySize reads either
+#define INTERNAL_NODE_KEY_SIZE_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_KEY_SIZE_OFFSET (INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE)
+#define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + \
+    INTERNAL_NODE_RIGHT_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE_SIZE)
 
 /*
 * Internal Node Body Layout
 */
-#define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
+#define INTERNAL_NODE_CELL_SIZE(keySize) (INTERNAL_NODE_CHILD_SIZE + (keySize))
+#define INTERNAL_NODE_MAX_CELLS(pageSize, keySize) \
+    (((pageSize) - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE(keySize))
+
+/*
+* Key Encoding
+*/
+// B-tree keys are byte strings that sort with memcmp in the order of the values they encode. An id is
+// 8 bytes big-endian, a string column its fixed width NUL padded, and a composite key the concatenation
+// of its columns.
+#define KEY_MAX_COLUMNS 3
+#define KEY_MAX_SIZE (ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
+
+/*
+* Catalog (page 0) Layout
+*/
+#define CATALOG_PAGE_NUM 0
+#define CATALOG_NUM_TABLES_SIZE sizeof(uint32_t)
+#define CATALOG_NUM_TABLES_OFFSET COMMON_NODE_HEADER_SIZE
+#define CATALOG_FREE_PAGE_SIZE sizeof(uint32_t)
+#define CATALOG_FREE_PAGE_OFFSET (CATALOG_NUM_TABLES_OFFSET + CATALOG_NUM_TABLES_SIZE)
+#define CATALOG_PAGE_SIZE_SIZE sizeof(uint32_t)
+#define CATALOG_PAGE_SIZE_OFFSET (CATALOG_FREE_PAGE_OFFSET + CATALOG_FREE_PAGE_SIZE)
+#define CATALOG_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + CATALOG_NUM_TABLES_SIZE + CATALOG_FREE_PAGE_SIZE + \
+    CATALOG_PAGE_SIZE_SIZE)
+#define CATALOG_TABLE_NAME_SIZE 32
+#define CATALOG_TABLE_NAME_OFFSET 0
+#define CATALOG_TABLE_ROOT_SIZE sizeof(uint32_t)
+#define CATALOG_TABLE_ROOT_OFFSET (CATALOG_TABLE_NAME_OFFSET + CATALOG_TABLE_NAME_SIZE)
+#define CATALOG_TABLE_SCHEMA_SIZE 96
+#define CATALOG_TABLE_SCHEMA_OFFSET (CATALOG_TABLE_ROOT_OFFSET + CATALOG_TABLE_ROOT_SIZE)
+#define CATALOG_ENTRY_SIZE (CATALOG_TABLE_NAME_SIZE + CATALOG_TABLE_ROOT_SIZE + CATALOG_TABLE_SCHEMA_SIZE)
+#define CATALOG_MAX_TABLES(pageSize) (((pageSize) - CATALOG_HEADER_SIZE) / CATALOG_ENTRY_SIZE)
+#define MAX_TABLE_NAME_SIZE (CATALOG_TABLE_NAME_SIZE - 1)
+#define DEFAULT_TABLE_NAME "main"
+#define ROW_SCHEMA "id uint64, username char(32), email char(255)"
+#define KEY_SCHEMA ", key "
+#define LSM_SCHEMA ROW_SCHEMA ", engine lsm"
+#define HASH_SCHEMA ROW_SCHEMA ", engine hash"
+
+/*
+* Free Page Layout
+*/
+#define FREE_NODE_NEXT_OFFSET COMMON_NODE_HEADER_SIZE
+
+/*
+* Hash Table Layout
+*/
+// Linear hashing. The header page is the table's root, bucket b is split into b and b + 2^level when the
+// split pointer reaches it, so the table doubles one bucket at a time.
+#define HASH_HEADER_LEVEL_OFFSET COMMON_NODE_HEADER_SIZE
+#define HASH_HEADER_SPLIT_OFFSET (HASH_HEADER_LEVEL_OFFSET + sizeof(uint32_t))
+#define HASH_HEADER_NUM_ROWS_OFFSET (HASH_HEADER_SPLIT_OFFSET + sizeof(uint32_t))
+#define HASH_HEADER_NUM_DIRECTORY_PAGES_OFFSET (HASH_HEADER_NUM_ROWS_OFFSET + sizeof(uint32_t))
+#define HASH_HEADER_SIZE (HASH_HEADER_NUM_DIRECTORY_PAGES_OFFSET + sizeof(uint32_t))
+#define HASH_HEADER_MAX_DIRECTORY_PAGES(pageSize) (((pageSize) - HASH_HEADER_SIZE) / sizeof(uint32_t))
+// Directory pages hold the first page of every bucket
+#define HASH_DIRECTORY_HEADER_SIZE COMMON_NODE_HEADER_SIZE
+#define HASH_DIRECTORY_MAX_BUCKETS(pageSize) (((pageSize) - HASH_DIRECTORY_HEADER_SIZE) / sizeof(uint32_t))
+// Bucket pages keep their unordered ids together ahead of the rows, so a lookup scans a cache line or two
+// rather than touching every row. The overflow pointer chains further pages of the bucket.
+#define HASH_BUCKET_NUM_CELLS_OFFSET COMMON_NODE_HEADER_SIZE
+#define HASH_BUCKET_OVERFLOW_OFFSET (HASH_BUCKET_NUM_CELLS_OFFSET + sizeof(uint32_t))
+#define HASH_BUCKET_HEADER_SIZE (HASH_BUCKET_OVERFLOW_OFFSET + sizeof(uint32_t))
+#define HASH_CELL_SIZE (sizeof(uint64_t) + ROW_SIZE)
+#define HASH_BUCKET_MAX_CELLS(pageSize) (((pageSize) - HASH_BUCKET_HEADER_SIZE) / HASH_CELL_SIZE)
+// The next bucket is split once the rows fill this percentage of one page per bucket
+#define HASH_MAX_LOAD 75
+
+/*
+* Hot Pages File Layout
+*/
+#define HOT_PAGES_SUFFIX ".hot"
+#define HOT_PAGES_MAGIC 0x50544f48
+#define HOT_PAGES_MAGIC_OFFSET 0
+#define HOT_PAGES_PAGE_SIZE_OFFSET (HOT_PAGES_MAGIC_OFFSET + sizeof(uint32_t))
+#define HOT_PAGES_NUM_PAGES_OFFSET (HOT_PAGES_PAGE_SIZE_OFFSET + sizeof(uint32_t))
+#define HOT_PAGES_HEADER_SIZE (HOT_PAGES_NUM_PAGES_OFFSET + sizeof(uint32_t))
+#define HOT_PAGES_MAX 65536
+
+/*
+* Shared Lock File Layout
+*/
+#define SHARED_SUFFIX ".shm"
+#define SHARED_CHANGE_COUNTER_OFFSET 0
+#define SHARED_CHANGE_COUNTER_SIZE sizeof(uint64_t)
+#define SHARED_FILE_SIZE 4096
+
+/*
+* Replication Log Layout
+*/
+#define REPLICATION_LOG_SUFFIX ".log"
+#define REPLICATION_LOG_MAGIC 0x474f4c52
+#define REPLICATION_LOG_MAGIC_OFFSET 0
+#define REPLICATION_LOG_PAGE_SIZE_OFFSET (REPLICATION_LOG_MAGIC_OFFSET + sizeof(uint32_t))
+#define REPLICATION_LOG_GENERATION_OFFSET (REPLICATION_LOG_PAGE_SIZE_OFFSET + sizeof(uint32_t))
+#define REPLICATION_LOG_HEADER_SIZE (REPLICATION_LOG_GENERATION_OFFSET + sizeof(uint64_t))
+#define REPLICATION_RECORD_MAGIC 0x44524352
+#define REPLICATION_RECORD_MAGIC_OFFSET 0
+#define REPLICATION_RECORD_NUM_PAGES_OFFSET (REPLICATION_RECORD_MAGIC_OFFSET + sizeof(uint32_t))
+#define REPLICATION_RECORD_LSN_OFFSET (REPLICATION_RECORD_NUM_PAGES_OFFSET + sizeof(uint32_t))
+#define REPLICATION_RECORD_TIMESTAMP_OFFSET (REPLICATION_RECORD_LSN_OFFSET + sizeof(uint64_t))
+#define REPLICATION_RECORD_HEADER_SIZE (REPLICATION_RECORD_TIMESTAMP_OFFSET + sizeof(uint64_t))
+#define REPLICATION_PAGE_NUM_SIZE sizeof(uint32_t)
+
+#define REPLICATION_INTERVAL_MS 50
+#define REPLICATION_POLL_MS 5
+#define REPLICATION_BASE_BATCH 256
+#define REPLICATION_MAX_IOV 1024
+#define REPLICATION_TEST_LEADER_FILE_NAME "replication_leader.db"
+#define REPLICATION_TEST_FOLLOWER_FILE_NAME "replication_follower.db"
+#define REPLICATION_TEST_BATCH 1000
+
+/*
+* Workload Trace Layout
+*/
+#define TRACE_MAGIC 0x52544244
+#define TRACE_VERSION 1
+#define TRACE_MAGIC_OFFSET 0
+#define TRACE_VERSION_OFFSET (TRACE_MAGIC_OFFSET + sizeof(uint32_t))
+#define TRACE_HEADER_SIZE (TRACE_VERSION_OFFSET + sizeof(uint32_t))
+#define TRACE_RECORD_TIMESTAMP_OFFSET 0
+#define TRACE_RECORD_LATENCY_OFFSET (TRACE_RECORD_TIMESTAMP_OFFSET + sizeof(uint64_t))
+#define TRACE_RECORD_LENGTH_OFFSET (TRACE_RECORD_LATENCY_OFFSET + sizeof(uint64_t))
+#define TRACE_RECORD_HEADER_SIZE (TRACE_RECORD_LENGTH_OFFSET + sizeof(uint32_t))
+
+#define REPLAY_COPY_SUFFIX ".replay"
+#define REPLAY_MAX_SESSIONS 64
+#define REPLAY_MAX_COMMAND_TYPES 16
+#define REPLAY_COMMAND_TYPE_SIZE 16
+
+// Must be a power of two
+#define SPAN_RING_SIZE 65536
+#define SPAN_DETAIL_SIZE 16
+// Longest name written to a trace, and its room once every character is escaped, quoted and terminated
+#define SPAN_JSON_MAX_LENGTH 64
+#define SPAN_JSON_SIZE (SPAN_JSON_MAX_LENGTH * 6 + 3)
+
+#define BACKUP_TEMP_SUFFIX ".tmp"
+#define BACKUP_BATCH 64
+
+#define WARM_START_MAX_RUN 64
+#define WARM_START_THREADS 8
+
+/*
+* LSM Run File Layout
+*/
+#define LSM_RUN_SUFFIX ".run"
+#define LSM_RUN_MAGIC 0x4e55524c
+#define LSM_RUN_MAGIC_OFFSET 0
+#define LSM_RUN_NUM_ENTRIES_OFFSET (LSM_RUN_MAGIC_OFFSET + sizeof(uint32_t))
+#define LSM_RUN_NUM_BLOCKS_OFFSET (LSM_RUN_NUM_ENTRIES_OFFSET + sizeof(uint32_t))
+#define LSM_RUN_MAX_KEY_OFFSET (LSM_RUN_NUM_BLOCKS_OFFSET + sizeof(uint32_t))
+#define LSM_RUN_BLOOM_BITS_OFFSET (LSM_RUN_MAX_KEY_OFFSET + sizeof(uint64_t))
+#define LSM_RUN_HEADER_SIZE (LSM_RUN_BLOOM_BITS_OFFSET + sizeof(uint32_t))
+// The header is followed by the entries in key order, the first key of every block and the Bloom filter
+#define LSM_ENTRY_KEY_OFFSET 0
+#define LSM_ENTRY_FLAGS_OFFSET (LSM_ENTRY_KEY_OFFSET + sizeof(uint64_t))
+#define LSM_ENTRY_ROW_OFFSET (LSM_ENTRY_FLAGS_OFFSET + sizeof(uint32_t))
+#define LSM_ENTRY_SIZE (LSM_ENTRY_ROW_OFFSET + ROW_SIZE)
+#define LSM_ENTRY_TOMBSTONE 0x1
+#define LSM_BLOCK_ENTRIES (16384 / LSM_ENTRY_SIZE)
+#define LSM_BLOCK_SIZE (LSM_BLOCK_ENTRIES * LSM_ENTRY_SIZE)
+
+/*
+* LSM Manifest Layout
+*/
+#define LSM_MANIFEST_SUFFIX ".lsm"
+#define LSM_MANIFEST_MAGIC 0x4e414d4c
+#define LSM_MANIFEST_MAGIC_OFFSET 0
+#define LSM_MANIFEST_NUM_RUNS_OFFSET (LSM_MANIFEST_MAGIC_OFFSET + sizeof(uint32_t))
+#define LSM_MANIFEST_NEXT_RUN_OFFSET (LSM_MANIFEST_NUM_RUNS_OFFSET + sizeof(uint32_t))
+#define LSM_MANIFEST_HEADER_SIZE (LSM_MANIFEST_NEXT_RUN_OFFSET + sizeof(uint64_t))
+#define LSM_MANIFEST_RUN_ID_OFFSET 0
+#define LSM_MANIFEST_RUN_LEVEL_OFFSET (LSM_MANIFEST_RUN_ID_OFFSET + sizeof(uint64_t))
+#define LSM_MANIFEST_RUN_SIZE (LSM_MANIFEST_RUN_LEVEL_OFFSET + sizeof(uint32_t))
+
+#define LSM_MEMTABLE_SIZE (8 << 20)
+#define LSM_MAX_HEIGHT 16
+// A level is merged into one run of the next level once it has this many runs
+#define LSM_LEVEL_RUNS 4
+// Inserts wait for compaction when level 0 grows past this
+#define LSM_MAX_LEVEL0_RUNS 12
+#define LSM_BLOOM_BITS_PER_KEY 10
+#define LSM_BLOOM_HASHES 7
+// Rows a library cursor copies out of an lsm table each time it takes the lock
+#define LSM_SCAN_BATCH_ROWS 256
+
+// Rows held in memory by an order by before sorted runs are spilled to a temporary file
+#define SORT_MEMORY_BUDGET (64 << 20)
+#define SORT_MIN_RUN_BUFFER_ROWS 64
+#define SORT_TEMP_NAME "simpledb-sortXXXXXX"
+
+// Rows a filtered select takes from the table at a time, a multiple of 64 for the selection bitmap
+#define FILTER_BATCH_ROWS 1024
+#define FILTER_MAX_PREDICATES 8
+#define FILTER_MAX_SEGMENTS 8
+// Gathered values are NUL padded to a multiple of 32 bytes with at least one NUL after each
+#define FILTER_STRIDE(size) (((size) + 1 + 31) & ~31u)
+#define FILTER_MAX_STRIDE FILTER_STRIDE(EMAIL_SIZE)
+
+#define BENCHMARK_FILE_NAME "benchmark.db"
+#define BENCHMARK_MULTI_GET_BATCH 1024
+#define BENCHMARK_TABLE_NAME "bench"
+
+#define INTEGRITY_MAX_THREADS 16
+#define INTEGRITY_MAX_REPORTED_ERRORS 20
+
+// Leaves a defragment step walks past before giving the lock back
+#define DEFRAGMENT_SCAN_LEAVES 256
+// The background defragmenter's pause between steps, and between passes once there is nothing to do
+#define DEFRAGMENT_STEP_US 100
+#define DEFRAGMENT_IDLE_MS 200
 
 // TYPEDEFS
 typedef struct {
     char *input;
     size_t bufferLength;
     size_t length;
+    int fileDescriptor;
+    char *buffer;
+    size_t start;
+    size_t end;
+    bool endOfInput;
 } InputBuffer;
 
+typedef enum { OUTPUT_TEXT, OUTPUT_ALIGNED, OUTPUT_CSV, OUTPUT_JSON, OUTPUT_BINARY } OutputFormat;
+
+typedef struct {
+    int fileDescriptor;
+    OutputFormat format;
+    char *buffer;
+    size_t length;
+} OutputBuffer;
+
 typedef struct {
-    uint32_t id;
+    uint64_t id;
     char userName[MAX_USERNAME_SIZE + 1];
     char email[MAX_EMAIL_SIZE + 1];
 } Row;
 
+typedef struct {
+    uint32_t pageNum;
+    bool swizzledChildren;
+} FrameInfo;
+
+// Kept by each process with a shared database open. The lock file is mapped so the change counter can
+// be read under the lock without a syscall.
+typedef struct {
+    int fileDescriptor;
+    uint8_t *lockFile;
+    // The change counter as of the last time this process held the lock
+    uint64_t changeCounter;
+    // The shared page cache, a mapping of the whole db file, or NULL for a private cache
+    uint8_t *pages;
+    size_t mapLength;
+    // Pages handed out under the write lock, the only ones a write can have changed. May repeat.
+    bool writing;
+    uint32_t *written;
+    uint32_t numWritten;
+    uint32_t writtenCapacity;
+} SharedState;
+
 typedef struct {
     int fileDescriptor;
-    uint32_t fileLength;
+    char *fileName;
+    off_t fileLength;
+    uint32_t pageSize;
     uint32_t numPages;
-    void *pages[TABLE_MAX_PAGES];
+    uint32_t pagesCapacity;
+    void **pages;
+    bool directIo;
+    bool hugePages;
+    // No file, the frames are the only copy of every page
+    bool inMemory;
+    SharedState *shared;
+    uint8_t **frameChunks;
+    uint32_t numFrameChunks;
+    uint32_t nextFrame;
+    void *freeFrames;
+    uint32_t frameShift;
+    FrameInfo *frames;
+    uint32_t framesCapacity;
+    uint32_t *swizzledFrames;
+    uint32_t numSwizzledFrames;
+    uint32_t swizzledFramesCapacity;
 } Pager;
 
+typedef enum { ENGINE_BTREE, ENGINE_LSM, ENGINE_HASH } TableEngine;
+typedef enum { KEY_ID, KEY_USERNAME, KEY_EMAIL } KeyColumn;
+
+// Memtable skip list node. The serialised row follows the links, keeping the key and links of a node
+// in one cache line while searching.
+typedef struct LsmNode {
+    uint64_t key;
+    bool tombstone;
+    uint8_t height;
+    struct LsmNode *next[];
+} LsmNode;
+
+typedef struct {
+    LsmNode *head;
+    uint32_t height;
+    uint32_t numEntries;
+    size_t size;
+    uint64_t random;
+} LsmMemtable;
+
+// An immutable sorted run file. Only the sparse index and the Bloom filter live in memory.
+typedef struct {
+    uint64_t id;
+    uint32_t level;
+    int fileDescriptor;
+    uint32_t numEntries;
+    uint32_t numBlocks;
+    uint64_t maxKey;
+    uint64_t *blockKeys;
+    uint8_t *bloom;
+    uint32_t bloomBits;
+} LsmRun;
+
+typedef struct {
+    char *prefix;
+    LsmMemtable *memtable;
+    // Full memtable being written out by the worker
+    LsmMemtable *immutable;
+    // Newest data first: lower levels first, then newer runs first within a level
+    LsmRun **runs;
+    uint32_t numRuns;
+    uint32_t runsCapacity;
+    uint64_t nextRunId;
+    uint8_t *block;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool stop;
+} Lsm;
+
+// One input of a merge, either a memtable or a run read a block at a time
+typedef struct {
+    LsmNode *node;
+    LsmRun *run;
+    uint8_t *buffer;
+    uint32_t nextBlock;
+    uint32_t numBuffered;
+    uint32_t position;
+} LsmSource;
+
+// Walks its sources in key order. Where several hold a key the earliest source wins.
+typedef struct {
+    LsmSource *sources;
+    uint32_t numSources;
+    bool started;
+    uint64_t key;
+    bool tombstone;
+    uint8_t *row;
+} LsmMerge;
+
 typedef struct {
     uint32_t rootPageNum;
     Pager *pager;
+    char name[CATALOG_TABLE_NAME_SIZE];
+    uint32_t rightmostLeafPageNum;
+    TableEngine engine;
+    Lsm *lsm;
+    // B-tree key, the id alone unless the schema names other columns
+    uint32_t keySize;
+    uint32_t numKeyColumns;
+    KeyColumn keyColumns[KEY_MAX_COLUMNS];
+    // Hash tables: the header's level and split and the first page of every bucket, so a lookup only
+    // reads its bucket. Changed only by a split, the table is opened again when pages change under it.
+    uint32_t hashLevel;
+    uint32_t hashSplit;
+    uint32_t *hashBuckets;
 } Table;
 
+typedef struct {
+    int fileDescriptor;
+    bool isLeader;
+    uint64_t generation;
+    // Leader: last record written. Follower: last record applied.
+    uint64_t lsn;
+    // Follower: bytes of the log applied so far
+    off_t offset;
+    bool pending;
+    struct timespec lastShip;
+    pthread_t thread;
+    bool stop;
+    pthread_mutex_t lock;
+} Replication;
+
+typedef enum { DEFRAGMENT_START, DEFRAGMENT_REPACK, DEFRAGMENT_MOVE } DefragmentPhase;
+
+// A pass first fills leaves from their right siblings, then swaps leaves until key order is page order
+typedef struct {
+    DefragmentPhase phase;
+    uint32_t rootPageNum;
+    // Repack: the leaf to fill next
+    uint32_t pageNum;
+    // Leaves in key order, the pages they end up on, and each planned page's index in leaves
+    uint32_t *leaves;
+    uint32_t *targets;
+    uint32_t *positions;
+    uint32_t numLeaves;
+    uint32_t leavesCapacity;
+    uint32_t nextLeaf;
+    uint32_t numRepacked;
+    uint32_t numFreed;
+    uint32_t numMoved;
+    // Background only
+    pthread_t thread;
+    bool stop;
+} Defragment;
+
+typedef struct {
+    Pager *pager;
+    Table *currentTable;
+    char *hotPagesFileName;
+    Replication *replication;
+    pid_t backupPid;
+    char *backupPath;
+    OutputBuffer *capture;
+    struct timespec captureStart;
+    // Held while a command runs, background tasks take it for each step
+    pthread_mutex_t lock;
+    Defragment *defragment;
+} Database;
+
+typedef struct {
+    uint64_t timestamp;
+    uint64_t latency;
+    uint64_t replayLatency;
+    // Points into the loaded trace and is not terminated
+    char *command;
+    uint32_t length;
+} TraceCommand;
+
+typedef struct {
+    Database *database;
+    pthread_mutex_t *lock;
+    TraceCommand *commands;
+    uint32_t numCommands;
+    uint32_t sessionNum;
+    uint32_t numSessions;
+    bool fullSpeed;
+    struct timespec start;
+    int outputFileDescriptor;
+} ReplaySession;
+
 typedef struct {
     Table *table;
     uint32_t pageNum;
     uint32_t cellNum;
     bool endOfTable;
+    // Hash tables only, the bucket whose chain pageNum is in
+    uint32_t bucketNum;
+    // Lsm tables only, a batch of rows copied out of the merge that cellNum indexes, and where the next
+    // batch starts. Only these cursors are allocated with room for the rows.
+    Lsm *lsm;
+    uint32_t numRows;
+    uint64_t nextKey;
+    bool exhausted;
+    uint8_t rows[];
 } Cursor;
 
+// The bounds are offsets into IntegrityCheck.bounds
+typedef struct {
+    uint32_t pageNum;
+    uint32_t parentPageNum;
+    uint32_t nextLeafPageNum;
+    uint32_t keySize;
+    bool hasLowerBound;
+    size_t lowerBound;
+    bool hasUpperBound;
+    size_t upperBound;
+} LeafCheck;
+
+// Sorted keys keys[firstKey, firstKey + numKeys) that all fall under pageNum
+typedef struct {
+    uint32_t pageNum;
+    uint32_t firstKey;
+    uint32_t numKeys;
+} LookupGroup;
+
+// Pages pageNums[firstPage, firstPage + numPages) are consecutive in the file
+typedef struct {
+    uint32_t firstPage;
+    uint32_t numPages;
+} WarmStartRun;
+
+typedef struct {
+    Pager *pager;
+    uint32_t *pageNums;
+    void **frames;
+    WarmStartRun *runs;
+    uint32_t numRuns;
+    uint32_t nextRun;
+} WarmStart;
+
+typedef struct {
+    Pager *pager;
+    LeafCheck *leaves;
+    uint32_t numLeaves;
+    uint32_t nextLeaf;
+    uint8_t *bounds;
+    size_t boundsLength;
+    size_t boundsCapacity;
+    uint32_t numErrors;
+    uint64_t numRows;
+    // Depth of the first leaf of the table being walked, every other leaf must be as deep
+    uint32_t leafDepth;
+    pthread_mutex_t lock;
+} IntegrityCheck;
+
+// A span covers one call of a traced function and is recorded when it goes out of scope
+typedef struct {
+    const char *name;
+    const char *argName;
+    uint64_t arg;
+    uint64_t start;
+    char detail[SPAN_DETAIL_SIZE];
+} Span;
+
+typedef struct {
+    uint64_t sequence;
+    const char *name;
+    const char *argName;
+    uint64_t arg;
+    uint32_t threadId;
+    uint64_t start;
+    uint64_t duration;
+    char detail[SPAN_DETAIL_SIZE];
+} SpanRecord;
+
+#if ENABLE_SPANS
+#define SPAN(spanName, spanArgName, spanArg) \
+    Span span __attribute__((cleanup(spanEnd))) = spanBegin(#spanName, spanArgName, spanArg)
+#define SPAN_DETAIL(text) spanDetail(&span, text)
+#else
+#define SPAN(spanName, spanArgName, spanArg)
+#define SPAN_DETAIL(text)
+#endif
+
 // ENUM DEFINITIONS
-typedef enum { INTERNAL_NODE, LEAF_NODE } NodeType;
+typedef enum { INTERNAL_NODE, LEAF_NODE, CATALOG_NODE, FREE_NODE, HASH_HEADER_NODE, HASH_DIRECTORY_NODE,
+    HASH_BUCKET_NODE } NodeType;
+typedef enum { SORT_BY_ID, SORT_BY_USERNAME, SORT_BY_EMAIL } SortColumn;
+
+typedef struct {
+    SortColumn column;
+    bool descending;
+} SortOrder;
+
+// A sorted run spilled to the temporary file, read back a buffer at a time while merging
+typedef struct {
+    int fileDescriptor;
+    off_t offset;
+    off_t end;
+    uint8_t *buffer;
+    uint32_t capacity;
+    uint32_t numBuffered;
+    uint32_t position;
+} SortRun;
+
+// A like or contains on a string column. The pattern is split on % into segments, the first is pinned
+// to the start of the value unless the pattern opens with %, the last to the end unless it closes with one.
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    bool anchoredStart;
+    bool anchoredEnd;
+    uint32_t numSegments;
+    char *segments[FILTER_MAX_SEGMENTS];
+    uint32_t segmentLengths[FILTER_MAX_SEGMENTS];
+} FilterPredicate;
 
 // Function Prototypes
 void printCommands();
 void printPrompt();
-InputBuffer *NewInputBuffer();
-void readInput(InputBuffer *inputBuffer);
+InputBuffer *NewInputBuffer(int fileDescriptor);
+bool readInput(InputBuffer *inputBuffer);
 void closeInput(InputBuffer *InputBuffer);
-ssize_t getLine(char **linePtr, size_t *n, FILE *stream);
-void readAndDoCommand(InputBuffer *inputBuffer, Table **tablePtr, char *fileName);
+bool fillInput(InputBuffer *inputBuffer);
+OutputBuffer *NewOutputBuffer(int fileDescriptor);
+void closeOutput(OutputBuffer *outputBuffer);
+void outputFlush(OutputBuffer *outputBuffer);
+void outputWrite(OutputBuffer *outputBuffer, const void *data, size_t length);
+size_t formatUint(uint64_t value, char *destination);
+void outputHeader(OutputBuffer *outputBuffer);
+void doFormat(OutputBuffer *outputBuffer);
+bool readAndDoCommand(InputBuffer *inputBuffer, OutputBuffer *outputBuffer, Database *database);
+bool doCommand(InputBuffer *inputBuffer, OutputBuffer *outputBuffer, Database *database);
+Span spanBegin(const char *name, const char *argName, uint64_t arg);
+void spanEnd(Span *span);
+void spanDetail(Span *span, const char *text);
+void spansEnable(bool enabled);
+bool spansExport(char *path);
+void doSpans(void);
+void captureStart(Database *database, char *traceFileName);
+void captureCommand(Database *database, char *command, uint32_t length, struct timespec *start, struct timespec *end);
+void runReplay(char *traceFileName, char *fileName, uint32_t pageSize, int ioFlags, uint32_t numSessions,
+    bool fullSpeed);
 void doInsert(InputBuffer *inputBuffer, Table *table);
-void leafNodeInsert(Cursor *cursor, uint32_t key, Row *value);
-void doSelect(InputBuffer *inputBuffer, Table *table);
+void leafNodeInsert(Cursor *cursor, const uint8_t *key, Row *value);
+void doSelect(InputBuffer *inputBuffer, OutputBuffer *outputBuffer, Table *table);
 bool isNumber(char *number);
 bool isUserName(char *userName);
 bool isEmail(char *email);
-void printRow(Row *row);
+void printRow(OutputBuffer *outputBuffer, Row *row);
+void copyPadded(uint8_t *destination, const char *source, size_t size);
 void serialiseRow(Row *source, void *destination);
 void deserialiseRow(void *source, Row *destination);
 void *cursorValue(Cursor *cursor);
-Table *databaseOpen(char *fileName);
-void databaseClose(Table* table);
-Pager *pagerOpen(char *filename);
+Database *databaseOpen(char *fileName, uint32_t pageSize, int ioFlags);
+Database *databaseTryOpen(char *fileName, uint32_t pageSize, int ioFlags, const char **error);
+void databaseClose(Database *database);
+Pager *pagerOpen(char *filename, uint32_t pageSize, int ioFlags, const char **error);
+void *pagerAllocFrame(Pager *pager);
+void pagerFreeFrame(Pager *pager, void *frame);
+uint32_t pagerFrameIndex(Pager *pager, void *frame);
+void pagerUnswizzle(Pager *pager);
+void *pageBufferAlloc(size_t size);
 void pagerFlush(Pager* pager, uint32_t pageNum);
+void pagerReserve(Pager *pager, uint32_t pageNum);
+void pagerMapPage(Pager *pager, uint32_t pageNum);
+void saveHotPages(Pager *pager, char *fileName);
+SharedState *sharedOpen(char *fileName, const char **error);
+void sharedClose(SharedState *shared);
+void sharedNoteWritten(SharedState *shared, uint32_t pageNum);
+bool pagerLock(Pager *pager, bool write);
+void pagerUnlock(Pager *pager, bool write);
+bool pagerCommit(Pager *pager);
+void pagerDropCache(Pager *pager);
+void sharedBegin(Database *database, bool write);
+void sharedEnd(Database *database, bool write);
+void reopenCurrentTable(Database *database);
+bool commandWrites(char *input);
+void warmStart(Pager *pager, char *fileName);
+void replicationLeaderStart(Database *database, char *logFileName);
+void replicationFollowerStart(Database *database, char *logFileName);
+void replicationShip(Database *database);
+void replicationCommit(Database *database);
+void replicationIdle(Database *database);
+void replicationClose(Database *database);
+void printReplicationStatus(Database *database);
+void doBackup(Database *database);
+bool backupWrite(Pager *pager, char *path);
+void doSave(Database *database);
+void doLoad(Database *database);
+bool pagerLoad(Pager *pager, char *path);
+void backupPoll(Database *database, bool wait);
+bool isWriteCommand(char *command);
+bool inputHasLine(InputBuffer *inputBuffer);
+void runReplicationTest(uint32_t numRows);
 bool insertArgsCheck(char *arg, int len);
-void printTable(Table *table, uint32_t pageNum);
+void printTable(Table *table, OutputBuffer *outputBuffer, uint32_t pageNum);
 void *getPage(Pager *pager, uint32_t pageNum);
 void *cursorValue(Cursor *cursor);
 void cursorAdvance(Cursor *cursor);
 Cursor *tableStart(Table *table);
-Cursor *tableFind(Table *table, uint32_t key);
-Cursor *leafNodeFind(Table *table, uint32_t pageNum, uint32_t key);
+Cursor *tableFind(Table *table, const uint8_t *key);
+Cursor *leafNodeFind(Table *table, uint32_t pageNum, const uint8_t *key);
 uint32_t *leafNodenumCells(void *node);
+uint32_t *nodeKeySize(void *node);
 void *leafNodeCell(void *node, uint32_t cellNum);
-uint32_t *leafNodeKey(void *node, uint32_t cellNum);
+uint8_t *leafNodeKey(void *node, uint32_t cellNum);
 void *leafNodeValue(void *node, uint32_t cellNum);
-void initialiseLeafNode(void *node);
-void printConstants();
+void initialiseLeafNode(void *node, uint32_t keySize);
+void printConstants(Table *table);
 NodeType getNodeType(void *node);
 void setNodeType(void *node, NodeType type);
 uint32_t getUnusedPageNum(Pager *pager);
 void createNewRoot(Table *table, uint32_t rightChildPageNum);
-void initialiseInternalNode(void *node);
+void initialiseInternalNode(void *node, uint32_t keySize);
 uint32_t *internalNodeNumKeys(void *node);
 uint32_t *internalNodeRightChild(void *node);
 uint32_t *internalNodeCell(void *node, uint32_t cellNum);
 uint32_t *internalNodeChild(void *node, uint32_t childNum);
-uint32_t *internalNodeKey(void *node, uint32_t keyNum);
-uint32_t getNodeMaxKey(Pager *pager, void *node);
+uint32_t *internalNodeChildSlot(void *node, uint32_t childPageNum);
+void *internalNodeDescend(Pager *pager, void *node, uint32_t childNum, uint32_t *childPageNum);
+uint8_t *internalNodeKey(void *node, uint32_t keyNum);
+uint8_t *getNodeMaxKey(Pager *pager, void *node);
 bool isNodeRoot(void *node);
 void setNodeRoot(void *node, bool isRoot);
 void indent(uint32_t level);
 void printTree(Pager *pager, uint32_t pageNum, uint32_t indentationLevel);
-void leafNodeSplitAndInsert(Cursor *cursor, uint32_t key, Row *value);
-Cursor *internalNodeFind(Table *table, uint32_t pageNum, uint32_t key);
+void leafNodeSplitAndInsert(Cursor *cursor, const uint8_t *key, Row *value);
+Cursor *internalNodeFind(Table *table, uint32_t pageNum, const uint8_t *key);
 uint32_t *leafNodeNextLeaf(void *node);
 uint32_t *nodeParent(void *node);
-void updateInternalNodeKey(void *node, uint32_t oldKey, uint32_t newKey);
-uint32_t internalNodeFindChild(void *node, uint32_t key);
+void updateInternalNodeKey(void *node, const uint8_t *oldKey, const uint8_t *newKey);
+uint32_t internalNodeFindChild(void *node, const uint8_t *key);
 void internalNodeInsert(Table *table, uint32_t parentPagenum, uint32_t childPageNum);
 void internalNodeSplitAndInsert(Table *table, uint32_t parentPageNum, uint32_t childPageNum);
-void printNodes(Cursor *cursor);
-Table *deleteNode(Table *table, uint32_t id, char *fileName);
-void copyFile(Table *table, Table *tempTable, uint32_t id, uint32_t pageNum, bool *visited);
-Table *doDelete( InputBuffer *input, Table *table, char *fileName);
-void deleteFile(char *path);
+void printNodes(OutputBuffer *outputBuffer, Cursor *cursor);
+uint32_t deleteNode(Table *table, uint64_t lowerId, uint64_t upperId);
+uint32_t tableDeleteRange(Table *table, uint64_t lowerId, uint64_t upperId);
+bool pruneEmptyChildren(Table *table, uint32_t pageNum, uint64_t lowerId, uint64_t upperId,
+    uint32_t **freedPages, uint32_t *numFreed, uint32_t *freedCapacity);
+void doDeleteRange(Table *table);
+uint32_t copyFile(Table *table, Table *tempTable, uint64_t lowerId, uint64_t upperId, uint32_t pageNum,
+    bool *visited);
+void doDelete(InputBuffer *input, Table *table);
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+uint32_t pageChecksum(void *page, uint32_t pageSize);
+void doDefragment(Database *database);
+bool defragmentStep(Defragment *defragment, Table *table);
+void defragmentReset(Defragment *defragment);
+void defragmentClose(Database *database);
+void doIntegrityCheck(Database *database);
+bool integrityReadPage(IntegrityCheck *check, uint32_t pageNum, void *buffer);
+void integrityError(IntegrityCheck *check, const char *format, ...);
+void integrityCheckInternal(IntegrityCheck *check, uint32_t pageNum, uint32_t parentPageNum, uint32_t depth,
+    uint32_t keySize, const uint8_t *lowerBound, const uint8_t *upperBound, uint32_t *leavesCapacity, bool *visited);
+void *integrityCheckLeaves(void *arg);
+void initialiseCatalog(void *node, uint32_t pageSize);
+uint32_t *catalogPageSize(void *node);
+uint32_t *catalogNumTables(void *node);
+uint32_t *catalogFreePage(void *node);
+char *catalogTableName(void *node, uint32_t tableNum);
+uint32_t *catalogTableRoot(void *node, uint32_t tableNum);
+char *catalogTableSchema(void *node, uint32_t tableNum);
+int32_t catalogFindTable(Pager *pager, char *name);
+bool catalogHasLsmTables(Pager *pager);
+Table *tableOpen(Pager *pager, char *name);
+void tableClose(Table *table);
+bool createTable(Pager *pager, char *name, TableEngine engine, KeyColumn *keyColumns, uint32_t numKeyColumns);
+void freePage(Pager *pager, uint32_t pageNum);
+void freeTree(Pager *pager, uint32_t pageNum);
+void doCreateTable(Database *database);
+void doDropTable(Database *database);
+void doUseTable(Database *database);
+void printTables(Pager *pager);
+bool isTableName(char *name);
+const char *tableEngineName(TableEngine engine);
+void initialiseHashTable(Pager *pager, uint32_t headerPageNum);
+uint32_t *hashHeaderLevel(void *node);
+uint32_t *hashHeaderSplit(void *node);
+uint32_t *hashHeaderNumRows(void *node);
+uint32_t *hashHeaderNumDirectoryPages(void *node);
+uint32_t *hashHeaderDirectoryPage(void *node, uint32_t index);
+uint32_t *hashDirectoryBucket(void *node, uint32_t index);
+void initialiseHashBucket(void *node);
+uint32_t *hashBucketNumCells(void *node);
+uint32_t *hashBucketOverflow(void *node);
+uint64_t *hashBucketKey(void *node, uint32_t cellNum);
+void *hashBucketValue(void *node, uint32_t pageSize, uint32_t cellNum);
+uint32_t hashNumBuckets(void *header);
+uint32_t hashBucketNum(uint32_t level, uint32_t split, uint64_t key);
+uint32_t *hashBucketPage(Pager *pager, void *header, uint32_t bucketNum);
+void hashTableLoad(Table *table);
+bool hashInsert(Table *table, Row *row);
+bool hashDelete(Table *table, uint64_t key);
+bool hashFind(Table *table, uint64_t key, uint32_t *bucketPageNum, uint32_t *pageNum, uint32_t *cellNum);
+uint32_t hashDeleteRange(Table *table, uint64_t lowerId, uint64_t upperId);
+uint32_t hashMultiGet(Table *table, uint64_t *keys, uint32_t numKeys, Row *rows);
+Cursor *hashTableStart(Table *table);
+void hashCursorSettle(Cursor *cursor);
+void printHashTable(Pager *pager, void *header, uint32_t indentationLevel);
+void integrityCheckHash(IntegrityCheck *check, uint32_t pageNum, void *header, bool *visited);
+bool tableInsert(Table *table, Row *row);
+bool tableDelete(Table *table, uint64_t id);
+void *tableGet(Table *table, uint64_t id, uint8_t *buffer);
+Cursor *tableFindAppend(Table *table, const uint8_t *key);
+uint32_t tableMultiGet(Table *table, uint64_t *keys, uint32_t numKeys, Row *rows);
+uint32_t sortKeys(uint64_t *keys, uint32_t numKeys);
+int compareKeys(const void *a, const void *b);
+void pagerPrefetch(Pager *pager, LookupGroup *groups, uint32_t numGroups);
+void doSelectIn(char *text, OutputBuffer *outputBuffer, Table *table);
+void doSelectOrdered(char *text, OutputBuffer *outputBuffer, Table *table);
+void doSelectWhere(char *text, OutputBuffer *outputBuffer, Table *table);
+bool filterCompile(FilterPredicate *predicate, char *pattern, bool contains);
+uint32_t filterGather(Cursor *cursor, uint8_t **rows);
+void filterEvaluate(FilterPredicate *predicate, uint8_t *column, uint32_t stride, uint32_t numRows,
+    uint16_t *lengths, uint64_t *selection);
+int compareSortCells(SortOrder *order, uint8_t *a, uint8_t *b);
+void sortCells(SortOrder *order, uint8_t **cells, uint32_t numCells);
+bool sortRunFill(SortRun *run);
+void sortRunsMerge(SortOrder *order, SortRun *runs, uint32_t numRuns, uint64_t limit, OutputBuffer *outputBuffer);
+Lsm *lsmOpen(char *prefix);
+char **lsmFileNames(char *prefix, uint32_t *numFileNames);
+void lsmClose(Lsm *lsm, bool discard);
+bool lsmInsert(Lsm *lsm, Row *row);
+bool lsmDelete(Lsm *lsm, uint64_t key);
+uint32_t lsmDeleteRange(Lsm *lsm, uint64_t lowerKey, uint64_t upperKey);
+uint32_t lsmMultiGet(Lsm *lsm, uint64_t *keys, uint32_t numKeys, Row *rows);
+bool lsmGet(Lsm *lsm, uint64_t key, uint8_t *row);
+uint32_t lsmScan(Lsm *lsm, uint64_t lowerKey, uint8_t *rows, uint32_t maxRows);
+Cursor *lsmTableStart(Table *table);
+void lsmCursorFill(Cursor *cursor);
+void lsmPrint(Lsm *lsm, OutputBuffer *outputBuffer);
+void lsmPrintLevels(Lsm *lsm);
+LsmMemtable *lsmMemtableNew(void);
+void lsmMemtableFree(LsmMemtable *memtable);
+void lsmMemtablePut(LsmMemtable *memtable, uint64_t key, bool tombstone, uint8_t *row);
+LsmNode *lsmMemtableSeek(LsmMemtable *memtable, uint64_t key);
+LsmRun *lsmRunOpen(Lsm *lsm, uint64_t id, uint32_t level);
+LsmRun *lsmRunWrite(Lsm *lsm, LsmMerge *merge, uint64_t id, uint32_t level, uint32_t maxEntries,
+    bool dropTombstones);
+bool lsmRunFind(Lsm *lsm, LsmRun *run, uint64_t key, uint8_t *entry);
+void lsmRunFree(Lsm *lsm, LsmRun *run, bool unlinkFile);
+void lsmManifestWrite(Lsm *lsm);
+void lsmMergeInit(LsmMerge *merge, uint32_t maxSources);
+void lsmMergeAddMemtable(LsmMerge *merge, LsmMemtable *memtable, uint64_t lowerKey);
+void lsmMergeAddRun(LsmMerge *merge, LsmRun *run, uint64_t lowerKey);
+bool lsmMergeNext(LsmMerge *merge);
+void lsmMergeFree(LsmMerge *merge);
+void runBenchmark(uint32_t numRows);
+bool parseId(char *text, uint64_t *id);
+void keyEncodeUint64(uint64_t value, uint8_t *destination);
+uint64_t keyDecodeUint64(const uint8_t *source);
+void keyEncodeString(const char *value, uint32_t size, uint8_t *destination);
+void tableKey(Table *table, Row *row, uint8_t *key);
+int keyCompare(const uint8_t *a, const uint8_t *b, uint32_t keySize);
+bool tableKeyedById(Table *table);
+bool parseKeyColumns(const char *text, KeyColumn *keyColumns, uint32_t *numKeyColumns);
+uint32_t keyColumnsSize(KeyColumn *keyColumns, uint32_t numKeyColumns);
+bool parseSchema(char *schema, TableEngine *engine, KeyColumn *keyColumns, uint32_t *numKeyColumns);
+bool tableCatalogUnchanged(Table *table);
 
 //Program
+// The library build leaves the REPL out, see simpledb.h
+#ifndef SIMPLEDB_LIBRARY
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Please provide a database file or only 1 database file\n");
+    bool batch = false;
+    char *batchFileName = NULL;
+    char *fileName = NULL;
+    char *followLogFileName = NULL;
+    char *captureFileName = NULL;
+    char *replayFileName = NULL;
+    char *spansFileName = NULL;
+    uint32_t numSessions = 1;
+    bool fullSpeed = false;
+    bool leader = false;
+    int ioFlags = 0;
+    uint32_t pageSize = DEFAULT_PAGE_SIZE;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0) {
+            batch = true;
+            // Options never name the command file, and without another path it was the database
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                batchFileName = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            pageSize = atoi(argv[++i]);
+            if (pageSize < MIN_PAGE_SIZE || pageSize > MAX_PAGE_SIZE || (pageSize & (pageSize - 1)) != 0) {
+                printf("Page size must be a power of two from %d to %d\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            runBenchmark(i + 1 < argc ? atoi(argv[i + 1]) : 100000);
+            return 0;
+        } else if (strcmp(argv[i], "--replication-test") == 0) {
+            runReplicationTest(i + 1 < argc ? atoi(argv[i + 1]) : 100000);
+            return 0;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            ioFlags |= PAGER_DIRECT_IO;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            ioFlags |= PAGER_HUGE_PAGES;
+        } else if (strcmp(argv[i], "--shared") == 0) {
+            ioFlags |= PAGER_SHARED;
+        } else if (strcmp(argv[i], "--shared-cache") == 0) {
+            ioFlags |= PAGER_SHARED | PAGER_SHARED_CACHE;
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            captureFileName = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayFileName = argv[++i];
+        } else if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            numSessions = atoi(argv[++i]);
+            if (numSessions < 1 || numSessions > REPLAY_MAX_SESSIONS) {
+                printf("Sessions must be from 1 to %d\n", REPLAY_MAX_SESSIONS);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--spans") == 0 && i + 1 < argc) {
+            spansFileName = argv[++i];
+        } else if (strcmp(argv[i], "--full-speed") == 0) {
+            fullSpeed = true;
+        } else if (strcmp(argv[i], "--leader") == 0) {
+            leader = true;
+        } else if (strcmp(argv[i], "--follow") == 0 && i + 1 < argc) {
+            followLogFileName = argv[++i];
+        } else if (fileName == NULL) {
+            fileName = argv[i];
+        } else {
+            fileName = NULL;
+            batchFileName = NULL;
+            break;
+        }
+    }
+    if (fileName == NULL && batchFileName != NULL && strcmp(batchFileName, "-") != 0) {
+        fileName = batchFileName;
+        batchFileName = NULL;
+    }
+
+    // Replication ships pages by their checksums, which a shared database rewrites after every command
+    bool replicating = leader || followLogFileName != NULL;
+    if (fileName == NULL || (leader && followLogFileName != NULL) || ((ioFlags & PAGER_SHARED) && replicating)) {
+        printf("Usage: %s [--batch [commandfile]] [--page-size <bytes>] [--direct] [--huge-pages] "
+            "[--leader | --follow <log file>] <database file | :memory:>\n", argv[0]);
+        printf("       %s --benchmark [rows]\n", argv[0]);
+        printf("       %s --replication-test [rows]\n", argv[0]);
+        printf("       %s --replay <trace file> [--sessions <n>] [--full-speed] <database file>\n", argv[0]);
+        printf("Add --capture <trace file> to record every command with its timing\n");
+        printf("Add --spans <json file> to record function timings and write them out at exit\n");
+        printf("Add --shared to let other processes open the file at the same time, or --shared-cache to also "
+            "share their page cache. Neither works with replication\n");
+        exit(1);
+    }
+
+    if (spansFileName != NULL) {
+        spansEnable(true);
+    }
+    if (replayFileName != NULL) {
+        runReplay(replayFileName, fileName, pageSize, ioFlags, numSessions, fullSpeed);
+        if (spansFileName != NULL && !spansExport(spansFileName)) {
+            printf("Unable to write spans to %s\n", spansFileName);
+        }
+        return 0;
+    }
+
+    int inputFd = STDIN_FILENO;
+    if (batchFileName != NULL && strcmp(batchFileName, "-") != 0) {
+        inputFd = open(batchFileName, O_RDONLY);
+        if (inputFd == -1) {
+            printf("Unable to open command file %s\n", batchFileName);
+            exit(1);
+        }
+    }
+
+    Database *database = databaseOpen(fileName, pageSize, ioFlags);
+    if (replicating && catalogHasLsmTables(database->pager)) {
+        printf("Lsm tables keep their rows outside the db file, so cannot be replicated\n");
         exit(1);
     }
-    char *fileName = argv[1];
-    Table *table = databaseOpen(fileName);
-    printConstants();
-    printCommands();
-    InputBuffer *inputBuffer = NewInputBuffer();
+    if (leader) {
+        char *logFileName = malloc(strlen(fileName) + strlen(REPLICATION_LOG_SUFFIX) + 1);
+        strcpy(logFileName, fileName);
+        strcat(logFileName, REPLICATION_LOG_SUFFIX);
+        replicationLeaderStart(database, logFileName);
+        free(logFileName);
+    } else if (followLogFileName != NULL) {
+        replicationFollowerStart(database, followLogFileName);
+    }
+    if (captureFileName != NULL) {
+        captureStart(database, captureFileName);
+    }
+
+    if (!batch) {
+        printConstants(database->currentTable);
+        printCommands();
+    }
+    InputBuffer *inputBuffer = NewInputBuffer(inputFd);
+    OutputBuffer *outputBuffer = NewOutputBuffer(STDOUT_FILENO);
     while (true) {
-        printPrompt();
-        readInput(inputBuffer);
-        readAndDoCommand(inputBuffer, &table, fileName);
+        if (!batch) {
+            printPrompt();
+        }
+        if (!inputHasLine(inputBuffer)) {
+            // About to wait for input, so nothing should be left unshipped
+            pthread_mutex_lock(&database->lock);
+            replicationIdle(database);
+            pthread_mutex_unlock(&database->lock);
+        }
+        if (!readInput(inputBuffer)) {
+            break;
+        }
+
+        pthread_mutex_lock(&database->lock);
+        if (database->replication != NULL) {
+            pthread_mutex_lock(&database->replication->lock);
+        }
+        bool keepGoing = readAndDoCommand(inputBuffer, outputBuffer, database);
+        if (database->replication != NULL) {
+            pthread_mutex_unlock(&database->replication->lock);
+        }
+        pthread_mutex_unlock(&database->lock);
+        if (!keepGoing) {
+            break;
+        }
+    }
+
+    if (!batch) {
+        printf("Closing...\n");
+    }
+    closeOutput(outputBuffer);
+    closeInput(inputBuffer);
+    databaseClose(database);
+    if (!batch) {
+        printf("Successfully closed\n");
+    }
+    if (spansFileName != NULL && !spansExport(spansFileName)) {
+        printf("Unable to write spans to %s\n", spansFileName);
     }
 
     return 0;
 }
+#endif
 
 // Prints all commands
 void printCommands() {
     printf("Commands are\n");
     printf("help: prints all commands\n");
     printf("insert: To insert data input as 'insert <username> <email>'\n");
-    printf("delete: To delete data 'delete id/username/email'\n");
+    printf("delete: To delete data 'delete id/username/email' or 'delete where id between <id> and <id>'\n");
     printf("modify: To modify data 'modify username/email <username/email> <newusername/newemail>'\n");
-    printf("select: To select data 'select'\n");
+    printf("select: To select data 'select', 'select id in (<id>, <id>, ...)' or "
+        "'select order by id/username/email [asc/desc] [limit <n>]' or "
+        "'select where username/email like/contains <pattern> [and ...]'\n");
+    printf("format: Sets select output 'format text/aligned/csv/json/binary'\n");
+    printf("create table: Creates a table 'create table <name> [using btree/lsm/hash] [key (<column>, ...)]'\n");
+    printf("drop table: Drops a table and frees its pages 'drop table <name>'\n");
+    printf("use: Makes a table current for the other commands 'use <name>'\n");
+    printf("tables: Lists all tables\n");
     printf("tree: prints the bst\n");
+    printf("integrity_check: Verifies checksums and the structure of the tree\n");
+    printf("defragment: Packs leaves and puts them in key order on disk, 'defragment background' keeps "
+        "the table in use defragmented\n");
+    printf("replication: Shows the replication position and lag\n");
+    printf("backup: Writes a consistent copy of the database in the background 'backup <path>'\n");
+    printf("save: Writes the database to a file now 'save <path>'\n");
+    printf("load: Replaces a :memory: database with a saved one 'load <path>'\n");
+    printf("spans: Records function timings 'spans on/off' or 'spans export <path>' for chrome://tracing\n");
     printf("print: Prints all data\n");
     printf("exit: Exits program\n");
     printf("\n");
@@ -239,95 +1187,237 @@ void printCommands() {
 // Prints command prompt insert buffer
 void printPrompt() {
     printf("db > ");
+    // Input is read straight from the fd, so stdio will not flush the prompt for us
+    fflush(stdout);
 }
 
-// Creates new input buffer
-InputBuffer *NewInputBuffer() {
+// Creates new input buffer reading from fileDescriptor
+InputBuffer *NewInputBuffer(int fileDescriptor) {
     InputBuffer *newInputBuffer = malloc(sizeof(InputBuffer));
     newInputBuffer->input = NULL;
-    newInputBuffer->bufferLength = 0;
+    newInputBuffer->bufferLength = INPUT_BUFFER_SIZE;
     newInputBuffer->length = 0;
+    newInputBuffer->fileDescriptor = fileDescriptor;
+    newInputBuffer->buffer = malloc(INPUT_BUFFER_SIZE + 1);
+    newInputBuffer->start = 0;
+    newInputBuffer->end = 0;
+    newInputBuffer->endOfInput = false;
+
+    if (newInputBuffer->buffer == NULL) {
+        printf("Error allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
 
     return newInputBuffer;
 }
 
-// Reads user input
-void readInput(InputBuffer *inputBuffer) {
-    ssize_t bytesRead = getLine(&(inputBuffer->input), &(inputBuffer->bufferLength), stdin);
+// Points input at the next line inside the read buffer, returns false at end of input
+bool readInput(InputBuffer *inputBuffer) {
+    while (true) {
+        char *start = inputBuffer->buffer + inputBuffer->start;
+        size_t available = inputBuffer->end - inputBuffer->start;
+        char *newline = memchr(start, '\n', available);
+
+        if (newline == NULL && inputBuffer->endOfInput) {
+            if (available == 0) {
+                return false;
+            }
+            // Last line without a trailing newline, the buffer has room for its terminator
+            newline = start + available;
+        }
 
-    if (bytesRead <= 0) {
-        printf("Error Reading Input");
-        exit(1);
+        if (newline != NULL) {
+            size_t length = newline - start;
+            if (length > 0 && start[length - 1] == '\r') {
+                length--;
+            }
+            start[length] = '\0';
+            inputBuffer->input = start;
+            inputBuffer->length = length;
+            inputBuffer->start += (newline - start) + (newline < inputBuffer->buffer + inputBuffer->end);
+            return true;
+        }
+
+        if (!fillInput(inputBuffer)) {
+            inputBuffer->endOfInput = true;
+        }
     }
 }
 
-ssize_t getLine(char **linePtr, size_t *n, FILE *stream) {
-    size_t chunk = 128;
-    size_t pos = 0;
-    int c;
+// True when the next readInput can return without reading from the fd
+bool inputHasLine(InputBuffer *inputBuffer) {
+    size_t available = inputBuffer->end - inputBuffer->start;
+    return (available > 0 && inputBuffer->endOfInput) ||
+        memchr(inputBuffer->buffer + inputBuffer->start, '\n', available) != NULL;
+}
+
+// Reads more input after the unconsumed bytes, returns false on end of file
+bool fillInput(InputBuffer *inputBuffer) {
+    size_t remaining = inputBuffer->end - inputBuffer->start;
 
-    if (*linePtr == NULL || *n == 0) {
-        *n = chunk;
-        *linePtr = malloc(*n * sizeof(char));
-        if (*linePtr == NULL) return -1;
+    if (inputBuffer->start > 0) {
+        memmove(inputBuffer->buffer, inputBuffer->buffer + inputBuffer->start, remaining);
+        inputBuffer->start = 0;
+        inputBuffer->end = remaining;
     }
 
-    while ((c = fgetc(stream)) != EOF) {
-        if (pos + 1 >= *n) {
-            *n += chunk;
-            char *newPtr = realloc(*linePtr, *n * sizeof(char));
-            if (!newPtr) return -1;
-            *linePtr = newPtr;
+    if (inputBuffer->end == inputBuffer->bufferLength) {
+        // A single line longer than the buffer
+        size_t newLength = inputBuffer->bufferLength * 2;
+        char *newBuffer = realloc(inputBuffer->buffer, newLength + 1);
+        if (newBuffer == NULL) {
+            printf("Error allocating memory\n");
+            exit(EXIT_FAILURE);
         }
-
-        (*linePtr)[pos++] = c;
-        if (c == '\n') break;
+        inputBuffer->buffer = newBuffer;
+        inputBuffer->bufferLength = newLength;
     }
 
-    if (pos == 0 && c == EOF) return -1;
+    ssize_t bytesRead;
+    do {
+        bytesRead = read(inputBuffer->fileDescriptor, inputBuffer->buffer + inputBuffer->end,
+            inputBuffer->bufferLength - inputBuffer->end);
+    } while (bytesRead == -1 && errno == EINTR);
 
-    // ignore newline
-    (*linePtr)[pos - 1] = '\0';
-    return pos - 1;
-}
+    if (bytesRead == -1) {
+        printf("Error Reading Input: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
 
+    inputBuffer->end += bytesRead;
+    return bytesRead > 0;
+}
 
 void closeInput(InputBuffer *inputBuffer) {
-    free(inputBuffer->input);
+    if (inputBuffer->fileDescriptor != STDIN_FILENO) {
+        close(inputBuffer->fileDescriptor);
+    }
+    free(inputBuffer->buffer);
     free(inputBuffer);
 }
 
-void readAndDoCommand(InputBuffer *inputBuffer, Table **tablePtr, char *fileName) {   
-    if (strcmp(inputBuffer->input, "exit") == 0) {
-        printf("Closing...\n");
-        closeInput(inputBuffer);
-        databaseClose(*tablePtr);
-        printf("Successfully closed\n");
-        exit(EXIT_SUCCESS);
-    } else if (strcmp(inputBuffer->input, "help") == 0) {
+// Runs one command, recording it to the capture trace when one is open. Returns false when the
+// program should exit.
+bool readAndDoCommand(InputBuffer *inputBuffer, OutputBuffer *outputBuffer, Database *database) {
+    SPAN(command, "length", inputBuffer->length);
+    SPAN_DETAIL(inputBuffer->input);
+    if (database->capture == NULL || inputBuffer->length == 0) {
+        return doCommand(inputBuffer, outputBuffer, database);
+    }
+
+    // Commands are tokenised in place, keep the original text for the trace
+    char *command = malloc(inputBuffer->length);
+    uint32_t length = inputBuffer->length;
+    memcpy(command, inputBuffer->input, length);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool keepGoing = doCommand(inputBuffer, outputBuffer, database);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    captureCommand(database, command, length, &start, &end);
+    free(command);
+    return keepGoing;
+}
+
+bool doCommand(InputBuffer *inputBuffer, OutputBuffer *outputBuffer, Database *database) {   
+    backupPoll(database, false);
+
+    if (inputBuffer->length == 0) {
+        return true;
+    } else if (strcmp(inputBuffer->input, "exit") == 0) {
+        return false;
+    }
+
+    bool write = database->pager->shared != NULL && commandWrites(inputBuffer->input);
+    sharedBegin(database, write);
+    Table *table = database->currentTable;
+    if (strcmp(inputBuffer->input, "help") == 0) {
         printCommands();
-    }  else if (strcmp(inputBuffer->input, "tree") == 0) {
-        printTree((*tablePtr)->pager, 0, 0);
-    }  else if (strcmp(inputBuffer->input, "print") == 0) {
-        printTable(*tablePtr, (*tablePtr)->rootPageNum);
+    }  else if (strcmp(inputBuffer->input, "tables") == 0) {
+        printTables(database->pager);
+    }  else if (strcmp(inputBuffer->input, "integrity_check") == 0) {
+        doIntegrityCheck(database);
+    }  else if (strcmp(inputBuffer->input, "replication") == 0) {
+        printReplicationStatus(database);
     } else { 
         char *command = strtok(inputBuffer->input, " ");
-        if (strcmp(command, "insert") == 0) {
-            doInsert(inputBuffer, *tablePtr);
+        if (command == NULL) {
+            sharedEnd(database, write);
+            return true;
+        } else if (isWriteCommand(command) && database->replication != NULL && !database->replication->isLeader) {
+            printf("Read-only replica\n");
+        } else if (strcmp(command, "create") == 0) {
+            doCreateTable(database);
+        } else if (strcmp(command, "drop") == 0) {
+            doDropTable(database);
+        } else if (strcmp(command, "use") == 0) {
+            doUseTable(database);
+        } else if (strcmp(command, "format") == 0) {
+            doFormat(outputBuffer);
+        } else if (strcmp(command, "backup") == 0) {
+            doBackup(database);
+        } else if (strcmp(command, "save") == 0) {
+            doSave(database);
+        } else if (strcmp(command, "load") == 0) {
+            doLoad(database);
+        } else if (strcmp(command, "spans") == 0) {
+            doSpans();
+        } else if (table == NULL) {
+            printf("No table selected\n");
+        } else if (strcmp(command, "tree") == 0 && table->lsm != NULL) {
+            lsmPrintLevels(table->lsm);
+        } else if (strcmp(command, "tree") == 0) {
+            printTree(table->pager, table->rootPageNum, 0);
+        } else if (strcmp(command, "print") == 0 && table->lsm != NULL) {
+            fflush(stdout);
+            outputHeader(outputBuffer);
+            lsmPrint(table->lsm, outputBuffer);
+            outputFlush(outputBuffer);
+        } else if (strcmp(command, "print") == 0) {
+            fflush(stdout);
+            outputHeader(outputBuffer);
+            printTable(table, outputBuffer, table->rootPageNum);
+            outputFlush(outputBuffer);
+        } else if (strcmp(command, "insert") == 0) {
+            doInsert(inputBuffer, table);
         } else if (strcmp(command, "select") == 0) {
-            doSelect(inputBuffer, *tablePtr);
+            doSelect(inputBuffer, outputBuffer, table);
         } else if (strcmp(command, "delete") == 0) { 
-            *tablePtr = doDelete(inputBuffer, *tablePtr, fileName);
+            doDelete(inputBuffer, table);
+        } else if (strcmp(command, "defragment") == 0) {
+            doDefragment(database);
         } else {
             printf("Unrecognised Command %s\n", command);
         } 
+
+        if (isWriteCommand(command)) {
+            replicationCommit(database);
+        }
     } 
+    sharedEnd(database, write);
+
+    return true;
 }
 
-void doInsert(InputBuffer *inputBuffer, Table *table) {
-    void *node = getPage(table->pager, table->rootPageNum);
-    uint32_t numCells = (*leafNodenumCells(node));
+// isWriteCommand for a line not yet split into words
+bool commandWrites(char *input) {
+    char command[16];
+    size_t length = strcspn(input, " ");
+    if (length >= sizeof(command)) {
+        return false;
+    }
+    memcpy(command, input, length);
+    command[length] = '\0';
+    return isWriteCommand(command);
+}
+
+bool isWriteCommand(char *command) {
+    return strcmp(command, "insert") == 0 || strcmp(command, "delete") == 0 || strcmp(command, "create") == 0 ||
+        strcmp(command, "drop") == 0 || strcmp(command, "defragment") == 0 || strcmp(command, "load") == 0;
+}
 
+void doInsert(InputBuffer *inputBuffer, Table *table) {
     char *insert_args[MAX_INSERT_ARGS + 1] = { NULL };
 
     int len = 0;
@@ -343,26 +1433,49 @@ void doInsert(InputBuffer *inputBuffer, Table *table) {
         printf("Not enough arguments\n");
         return;
     }
-    Row *rowToInsert = malloc(sizeof(Row));
-    rowToInsert->id = atoi(insert_args[0]);
-    strncpy(rowToInsert->userName, insert_args[1], MAX_USERNAME_SIZE);
-    strncpy(rowToInsert->email, insert_args[2], MAX_EMAIL_SIZE);
+    Row rowToInsert;
+    memset(&rowToInsert, 0, sizeof(Row));
+    if (!parseId(insert_args[0], &rowToInsert.id)) {
+        return;
+    }
+    strncpy(rowToInsert.userName, insert_args[1], MAX_USERNAME_SIZE);
+    strncpy(rowToInsert.email, insert_args[2], MAX_EMAIL_SIZE);
 
-    uint32_t keyToInsert = rowToInsert->id;
-    Cursor *cursor = tableFind(table, keyToInsert);
-    
-    if (cursor->cellNum < numCells) {
-        uint32_t keyAtIndex = *leafNodeKey(node, cursor->cellNum);
-        if (keyAtIndex == keyToInsert) {
-            printf("Duplicate Record Found\n");
-            return;
-        }
+    if (!tableInsert(table, &rowToInsert)) {
+        printf("Duplicate Record Found\n");
+        return;
+    }
+    printf("Inserted Successfully\n");
+}
+
+// Inserts row under its key, returns false if the key is already present
+bool tableInsert(Table *table, Row *row) {
+    if (table->lsm != NULL) {
+        return lsmInsert(table->lsm, row);
+    } else if (table->engine == ENGINE_HASH) {
+        return hashInsert(table, row);
+    }
+    uint8_t key[KEY_MAX_SIZE];
+    tableKey(table, row, key);
+    Cursor *cursor = tableFindAppend(table, key);
+    if (cursor == NULL) {
+        cursor = tableFind(table, key);
+    }
+    void *node = getPage(table->pager, cursor->pageNum);
+
+    if (*leafNodeNextLeaf(node) == 0) {
+        table->rightmostLeafPageNum = cursor->pageNum;
+    }
+
+    if (cursor->cellNum < *leafNodenumCells(node) &&
+        keyCompare(leafNodeKey(node, cursor->cellNum), key, table->keySize) == 0) {
+        free(cursor);
+        return false;
     }
 
-    leafNodeInsert(cursor, keyToInsert, rowToInsert);
-    free(rowToInsert);
+    leafNodeInsert(cursor, key, row);
     free(cursor);
-    printf("Inserted Successfully\n");
+    return true;
 }
 
 bool insertArgsCheck(char *arg, int len) {
@@ -386,107 +1499,153 @@ bool insertArgsCheck(char *arg, int len) {
     return true;
 }
 
-void leafNodeInsert(Cursor *cursor, uint32_t key, Row *value) {
+// Reads a decimal id, rejecting ones that do not fit in 64 bits rather than wrapping them
+bool parseId(char *text, uint64_t *id) {
+    if (!isNumber(text)) {
+        printf("Invalid id\n");
+        return false;
+    }
+    errno = 0;
+    *id = strtoull(text, NULL, 10);
+    if (errno == ERANGE) {
+        printf("Id out of range\n");
+        return false;
+    }
+    return true;
+}
+
+void leafNodeInsert(Cursor *cursor, const uint8_t *key, Row *value) {
     void *node = getPage(cursor->table->pager, cursor->pageNum);
+    uint32_t keySize = *nodeKeySize(node);
 
     uint32_t numCells = *leafNodenumCells(node);
-    if (numCells >= LEAF_NODE_MAX_CELLS) {
-        printf("I got here\n");
+    if (numCells >= LEAF_NODE_MAX_CELLS(cursor->table->pager->pageSize, keySize)) {
         leafNodeSplitAndInsert(cursor, key, value);
         return;
     }
 
     if (cursor->cellNum < numCells) {
-        for (uint32_t i = numCells; i > cursor->cellNum; i--) {
-            memcpy(leafNodeCell(node, i), leafNodeCell(node, i - 1), LEAF_NODE_CELL_SIZE);
-        }
+        memmove(leafNodeCell(node, cursor->cellNum + 1), leafNodeCell(node, cursor->cellNum),
+            (numCells - cursor->cellNum) * LEAF_NODE_CELL_SIZE(keySize));
     }
 
     *leafNodenumCells(node) += 1;
-    *((uint32_t *)leafNodeKey(node, cursor->cellNum)) = key;
+    memcpy(leafNodeKey(node, cursor->cellNum), key, keySize);
     serialiseRow(value, leafNodeValue(node, cursor->cellNum));
 }
 
-void leafNodeSplitAndInsert(Cursor *cursor, uint32_t key, Row *value) {
+void leafNodeSplitAndInsert(Cursor *cursor, const uint8_t *key, Row *value) {
+    SPAN(leafNodeSplitAndInsert, "page", cursor->pageNum);
+    uint32_t pageSize = cursor->table->pager->pageSize;
     void *prevNode = getPage(cursor->table->pager, cursor->pageNum);
-    uint32_t prevMax = getNodeMaxKey(cursor->table->pager, prevNode);
+    uint32_t keySize = *nodeKeySize(prevNode);
+    uint32_t maxCells = LEAF_NODE_MAX_CELLS(pageSize, keySize);
+    uint32_t cellSize = LEAF_NODE_CELL_SIZE(keySize);
+    // Copied out, the split overwrites the cell it points at
+    uint8_t prevMax[KEY_MAX_SIZE];
+    memcpy(prevMax, getNodeMaxKey(cursor->table->pager, prevNode), keySize);
+    bool isRightmost = (*leafNodeNextLeaf(prevNode) == 0);
     uint32_t newPageNum = getUnusedPageNum(cursor->table->pager);
     void *newNode = getPage(cursor->table->pager, newPageNum);
-    initialiseLeafNode(newNode);
+    initialiseLeafNode(newNode, keySize);
     *nodeParent(newNode) = *nodeParent(prevNode);
     *leafNodeNextLeaf(newNode) = *leafNodeNextLeaf(prevNode);
     *leafNodeNextLeaf(prevNode) = newPageNum;
 
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
+    // Appending past the end of the table leaves the full node alone and starts a new one
+    uint32_t leftSplitCount = LEAF_NODE_LEFT_SPLIT_COUNT(pageSize, keySize);
+    if (isRightmost && cursor->cellNum == maxCells) {
+        leftSplitCount = maxCells;
+    }
+
+    for (int32_t i = maxCells; i >= 0; i--) {
         void *destNode;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+        uint32_t indexWithinNode;
+        if (i >= leftSplitCount) {
             destNode = newNode;
+            indexWithinNode = i - leftSplitCount;
         } else {
             destNode = prevNode;
+            indexWithinNode = i;
         }
-        uint32_t indexWithinNode = i % LEAF_NODE_LEFT_SPLIT_COUNT;
         void *destination = leafNodeCell(destNode, indexWithinNode);
 
         if (i == cursor->cellNum) {
+            memcpy(leafNodeKey(destNode, indexWithinNode), key, keySize);
             serialiseRow(value, leafNodeValue(destNode, indexWithinNode));
         } else if (i > cursor->cellNum) {
-            memcpy(destination, leafNodeCell(prevNode, i - 1), LEAF_NODE_CELL_SIZE);
+            memcpy(destination, leafNodeCell(prevNode, i - 1), cellSize);
         } else {
-            memcpy(destination, leafNodeCell(prevNode, i), LEAF_NODE_CELL_SIZE);
+            memcpy(destination, leafNodeCell(prevNode, i), cellSize);
         }
     }
 
-    *(leafNodenumCells(prevNode)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leafNodenumCells(newNode)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    *(leafNodenumCells(prevNode)) = leftSplitCount;
+    *(leafNodenumCells(newNode)) = maxCells + 1 - leftSplitCount;
+
+    if (isRightmost) {
+        cursor->table->rightmostLeafPageNum = newPageNum;
+    }
 
     if (isNodeRoot(prevNode)) {
         createNewRoot(cursor->table, newPageNum);
     } else {
         uint32_t parentPageNum = *nodeParent(prevNode);
-        uint32_t newMax = getNodeMaxKey(cursor->table->pager, prevNode);
         void *parent = getPage(cursor->table->pager, parentPageNum);
 
-        updateInternalNodeKey(parent, prevMax, newMax);
+        updateInternalNodeKey(parent, prevMax, getNodeMaxKey(cursor->table->pager, prevNode));
         internalNodeInsert(cursor->table, parentPageNum, newPageNum);
         return;
     }
 }
 
 uint32_t *nodeParent(void *node) {
-    return ((uint32_t *)node + PARENT_POINTER_OFFSET);
+    return (uint32_t *)((uint8_t *)node + PARENT_POINTER_OFFSET);
 }
 
-void updateInternalNodeKey(void *node, uint32_t oldKey, uint32_t newKey) {
+void updateInternalNodeKey(void *node, const uint8_t *oldKey, const uint8_t *newKey) {
     uint32_t oldChildIndex = internalNodeFindChild(node, oldKey);
-    *internalNodeKey(node, oldChildIndex) = newKey;
+    // The right child has no key of its own
+    if (oldChildIndex < *internalNodeNumKeys(node)) {
+        memmove(internalNodeKey(node, oldChildIndex), newKey, *nodeKeySize(node));
+    }
 }
 
-Cursor *internalNodeFind(Table *table, uint32_t pageNum, uint32_t key) {
+Cursor *internalNodeFind(Table *table, uint32_t pageNum, const uint8_t *key) {
     void *node = getPage(table->pager, pageNum);
 
-    uint32_t childIndex = internalNodeFindChild(node, key);
-    uint32_t childNum = *internalNodeChild(node, childIndex);
-    void *child = getPage(table->pager, childNum);
-    NodeType type = getNodeType(child);
-
-    if (type == LEAF_NODE) {
-        return leafNodeFind(table, childNum, key);
-    } else {
-        return internalNodeFind(table, childNum, key);
+    while (getNodeType(node) == INTERNAL_NODE) {
+        uint32_t childIndex = internalNodeFindChild(node, key);
+        node = internalNodeDescend(table->pager, node, childIndex, &pageNum);
     }
+
+    return leafNodeFind(table, pageNum, key);
 }
 
-uint32_t internalNodeFindChild(void *node, uint32_t key) {
+uint32_t internalNodeFindChild(void *node, const uint8_t *key) {
     uint32_t numKeys = *internalNodeNumKeys(node);
+    uint32_t keySize = *nodeKeySize(node);
 
     uint32_t minIndex = 0;
     uint32_t maxIndex = numKeys;
 
+    // Tables keyed by id compare their keys as integers, anything else with memcmp
+    if (keySize == ID_SIZE) {
+        uint64_t value = keyDecodeUint64(key);
+        while (minIndex != maxIndex) {
+            uint32_t index = (minIndex + maxIndex) / 2;
+            if (keyDecodeUint64(internalNodeKey(node, index)) >= value) {
+                maxIndex = index;
+            } else {
+                minIndex = index + 1;
+            }
+        }
+        return minIndex;
+    }
+
     while (minIndex != maxIndex) {
         uint32_t index = (minIndex + maxIndex) / 2;
-        uint32_t keyToRight = *internalNodeKey(node, index);
-
-        if (keyToRight >= key) {
+        if (memcmp(internalNodeKey(node, index), key, keySize) >= 0) {
             maxIndex = index;
         } else {
             minIndex = index + 1;
@@ -497,14 +1656,17 @@ uint32_t internalNodeFindChild(void *node, uint32_t key) {
 }
 
 void internalNodeInsert(Table *table, uint32_t parentPagenum, uint32_t childPageNum) {
+    pagerUnswizzle(table->pager);
     void *parent = getPage(table->pager, parentPagenum);
     void *child = getPage(table->pager, childPageNum);
-    uint32_t childMaxKey = getNodeMaxKey(table->pager, child);
+    uint32_t keySize = *nodeKeySize(parent);
+    uint8_t childMaxKey[KEY_MAX_SIZE];
+    memcpy(childMaxKey, getNodeMaxKey(table->pager, child), keySize);
     uint32_t index = internalNodeFindChild(parent, childMaxKey);
 
     uint32_t originalNumKeys = *internalNodeNumKeys(parent);
 
-    if (originalNumKeys >= INTERNAL_NODE_MAX_CELLS) {
+    if (originalNumKeys >= INTERNAL_NODE_MAX_CELLS(table->pager->pageSize, keySize)) {
         internalNodeSplitAndInsert(table, parentPagenum, childPageNum);
         return;
     }
@@ -519,29 +1681,31 @@ void internalNodeInsert(Table *table, uint32_t parentPagenum, uint32_t childPage
         void *rightChild = getPage(table->pager, rightChildPageNum);
     *internalNodeNumKeys(parent) = originalNumKeys + 1;
 
-    if (childMaxKey > getNodeMaxKey(table->pager, rightChild)) {
+    uint8_t *rightChildMaxKey = getNodeMaxKey(table->pager, rightChild);
+    if (keyCompare(childMaxKey, rightChildMaxKey, keySize) > 0) {
         *internalNodeChild(parent, originalNumKeys) = rightChildPageNum;
-        *internalNodeKey(parent, originalNumKeys) = getNodeMaxKey(table->pager, rightChild);
+        memcpy(internalNodeKey(parent, originalNumKeys), rightChildMaxKey, keySize);
         *internalNodeRightChild(parent) = childPageNum;
     } else {
-        for (uint32_t i = originalNumKeys; i > index; i--) {
-            void *destination = internalNodeCell(parent, i);
-            void *source = internalNodeCell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-        }
+        memmove(internalNodeCell(parent, index + 1), internalNodeCell(parent, index),
+            (originalNumKeys - index) * INTERNAL_NODE_CELL_SIZE(keySize));
 
         *internalNodeChild(parent, index) = childPageNum;
-        *internalNodeKey(parent, index) = childMaxKey;
+        memcpy(internalNodeKey(parent, index), childMaxKey, keySize);
     }
 }
 
 void internalNodeSplitAndInsert(Table *table, uint32_t parentPageNum, uint32_t childPageNum) {
+    SPAN(internalNodeSplitAndInsert, "page", parentPageNum);
     uint32_t prevPageNum = parentPageNum;
     void *prevNode = getPage(table->pager, parentPageNum);
-    uint32_t prevMax = getNodeMaxKey(table->pager, prevNode);
+    uint32_t keySize = *nodeKeySize(prevNode);
+    uint8_t prevMax[KEY_MAX_SIZE];
+    memcpy(prevMax, getNodeMaxKey(table->pager, prevNode), keySize);
 
     void *child = getPage(table->pager, childPageNum);
-    uint32_t childMax = getNodeMaxKey(table->pager, child);
+    uint8_t childMax[KEY_MAX_SIZE];
+    memcpy(childMax, getNodeMaxKey(table->pager, child), keySize);
 
     uint32_t newPageNum = getUnusedPageNum(table->pager);
     uint32_t splittingRoot = isNodeRoot(prevNode);
@@ -555,11 +1719,11 @@ void internalNodeSplitAndInsert(Table *table, uint32_t parentPageNum, uint32_t c
 
         prevPageNum = *internalNodeChild(parent, 0);
         prevNode = getPage(table->pager, prevPageNum);
-        initialiseInternalNode(newNode);
+        newNode = getPage(table->pager, newPageNum);
     } else {
         parent = getPage(table->pager, *nodeParent(prevNode));
         newNode = getPage(table->pager, newPageNum);
-        initialiseInternalNode(newNode);
+        initialiseInternalNode(newNode, keySize);
     }
 
     uint32_t *prevNumKeys = internalNodeNumKeys(prevNode);
@@ -571,7 +1735,8 @@ void internalNodeSplitAndInsert(Table *table, uint32_t parentPageNum, uint32_t c
     *nodeParent(currPage) = newPageNum;
     *internalNodeRightChild(prevNode) = INVALID_PAGE_NUM;
 
-    for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2; i--) {
+    uint32_t maxCells = INTERNAL_NODE_MAX_CELLS(table->pager->pageSize, keySize);
+    for (int i = maxCells - 1; i > maxCells / 2; i--) {
         currPageNum = *internalNodeCell(prevNode, i);
         currPage = getPage(table->pager, currPageNum);
 
@@ -584,8 +1749,8 @@ void internalNodeSplitAndInsert(Table *table, uint32_t parentPageNum, uint32_t c
     *internalNodeRightChild(prevNode) = *internalNodeChild(prevNode, *(uint32_t *)prevNumKeys - 1);
     (*(uint32_t *)prevNumKeys)--;
 
-    uint32_t maxAfterSplit = getNodeMaxKey(table->pager, prevNode);
-    uint32_t destPageNum = childMax < maxAfterSplit ? prevPageNum : newPageNum;
+    uint8_t *maxAfterSplit = getNodeMaxKey(table->pager, prevNode);
+    uint32_t destPageNum = keyCompare(childMax, maxAfterSplit, keySize) < 0 ? prevPageNum : newPageNum;
 
     internalNodeInsert(table, destPageNum, childPageNum);
     *nodeParent(child) = destPageNum;
@@ -593,635 +1758,7029 @@ void internalNodeSplitAndInsert(Table *table, uint32_t parentPageNum, uint32_t c
     updateInternalNodeKey(parent, prevMax, getNodeMaxKey(table->pager, prevNode));
 
     if (!splittingRoot) {
-        internalNodeInsert(table, *nodeParent(prevNode), newPageNum);
+        // Set before inserting, a split of the grandparent may move newNode again
         *nodeParent(newNode) = *nodeParent(prevNode);
+        internalNodeInsert(table, *nodeParent(prevNode), newPageNum);
     }
 }
 
-void doSelect(InputBuffer *inputBuffer, Table *table) {
-    Cursor *cursor = tableStart(table);
+void doSelect(InputBuffer *inputBuffer, OutputBuffer *outputBuffer, Table *table) {
+    char *where = strtok(NULL, "");
+    if (where != NULL) {
+        while (*where == ' ') where++;
+        if (strncmp(where, "where ", 6) == 0) {
+            doSelectWhere(where, outputBuffer, table);
+        } else if (strncmp(where, "order ", 6) == 0 || strncmp(where, "limit ", 6) == 0) {
+            doSelectOrdered(where, outputBuffer, table);
+        } else {
+            doSelectIn(where, outputBuffer, table);
+        }
+        return;
+    }
 
-    Row row;
-    while (!(cursor->endOfTable)) {
-        deserialiseRow(cursorValue(cursor), &row);
-        printRow(&row);
-        cursorAdvance(cursor);
+    // Anything printf'd so far (e.g. the prompt) must reach the fd before our rows do
+    fflush(stdout);
+    outputHeader(outputBuffer);
+    if (table->lsm != NULL) {
+        lsmPrint(table->lsm, outputBuffer);
+        outputFlush(outputBuffer);
+        return;
     }
 
+    Cursor *cursor = tableStart(table);
+    printNodes(outputBuffer, cursor);
+    outputFlush(outputBuffer);
+
     free(cursor);
 }
 
+// Handles 'id in (k1, k2, ...)' by looking up every key in one batched pass
+void doSelectIn(char *text, OutputBuffer *outputBuffer, Table *table) {
+    char *p = text;
+    while (*p == ' ') p++;
+    if (strncmp(p, "id", 2) != 0) {
+        printf("Usage: select id in (<id>, <id>, ...)\n");
+        return;
+    }
+    p += 2;
+    while (*p == ' ') p++;
+    if (strncmp(p, "in", 2) != 0) {
+        printf("Usage: select id in (<id>, <id>, ...)\n");
+        return;
+    }
+    p += 2;
+    while (*p == ' ') p++;
+    if (*p != '(') {
+        printf("Usage: select id in (<id>, <id>, ...)\n");
+        return;
+    }
+    p++;
 
-bool isNumber(char *number) {
-    if (number == NULL || *number == '\0') return false;
-    for (int i = 0; number[i]; i++) {
-        if (number[i] < '0' || number[i] > '9') {
-            printf("invalid number\n");
-            return false;
+    uint32_t capacity = 64;
+    uint32_t numKeys = 0;
+    uint64_t *keys = malloc(capacity * sizeof(uint64_t));
+    while (true) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == ')') {
+            break;
+        }
+        if (*p < '0' || *p > '9') {
+            printf("Invalid id list\n");
+            free(keys);
+            return;
         }
-    }
 
-    return true;
-}
+        char *end;
+        errno = 0;
+        unsigned long long key = strtoull(p, &end, 10);
+        if (errno == ERANGE) {
+            printf("Invalid id list\n");
+            free(keys);
+            return;
+        }
+        p = end;
 
-bool isUserName(char *userName) {
-    if ((strlen(userName) <= 5) || (strlen(userName) > MAX_USERNAME_SIZE)) {
-        return false;
+        if (numKeys == capacity) {
+            capacity *= 2;
+            keys = realloc(keys, capacity * sizeof(uint64_t));
+        }
+        keys[numKeys++] = key;
     }
 
-    return true;
-}
+    numKeys = sortKeys(keys, numKeys);
+    if (!tableKeyedById(table)) {
+        // The ids are not the key here, so every row with one of them is printed as the scan finds it
+        fflush(stdout);
+        outputHeader(outputBuffer);
+        Cursor *cursor = tableStart(table);
+        Row row;
+        while (!cursor->endOfTable) {
+            deserialiseRow(cursorValue(cursor), &row);
+            if (numKeys > 0 && bsearch(&row.id, keys, numKeys, sizeof(uint64_t), compareKeys) != NULL) {
+                printRow(outputBuffer, &row);
+            }
+            cursorAdvance(cursor);
+        }
+        outputFlush(outputBuffer);
+        free(cursor);
+        free(keys);
+        return;
+    }
+    Row *rows = malloc((numKeys > 0 ? numKeys : 1) * sizeof(Row));
+    uint32_t numFound = tableMultiGet(table, keys, numKeys, rows);
 
-bool isEmail(char *email) {
-    if ((strstr(email, "@") == NULL) || (strlen(email) > MAX_EMAIL_SIZE)) {
-        return false;
+    fflush(stdout);
+    outputHeader(outputBuffer);
+    for (uint32_t i = 0; i < numFound; i++) {
+        printRow(outputBuffer, &rows[i]);
     }
+    outputFlush(outputBuffer);
 
-    return true;
+    free(rows);
+    free(keys);
 }
 
-void printRow(Row *row) {
-    printf("id: %d, username: %s, email: %s\n", row->id, row->userName, row->email);
+// Whether the table already yields its rows in this order. A key of the column alone or of the column and
+// then the id breaks ties the same way compareSortCells does.
+static bool tableKeyOrder(Table *table, SortOrder *order) {
+    if (order->descending || table->engine == ENGINE_HASH) {
+        return false;
+    }
+    KeyColumn column = order->column == SORT_BY_USERNAME ? KEY_USERNAME :
+        order->column == SORT_BY_EMAIL ? KEY_EMAIL : KEY_ID;
+    return table->keyColumns[0] == column && (table->numKeyColumns == 1 || table->keyColumns[1] == KEY_ID);
 }
 
-void serialiseRow(Row *source, void *destination) {
-    memcpy((uint8_t *)destination + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy((uint8_t *)destination + USERNAME_OFFSET, source->userName, USERNAME_SIZE);
-    strncpy((uint8_t *)destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+// Orders rows by column, breaking ties on id so every order is total
+int compareSortCells(SortOrder *order, uint8_t *a, uint8_t *b) {
+    int result = 0;
+    if (order->column == SORT_BY_USERNAME) {
+        result = strncmp((char *)a + USERNAME_OFFSET, (char *)b + USERNAME_OFFSET, USERNAME_SIZE);
+    } else if (order->column == SORT_BY_EMAIL) {
+        result = strncmp((char *)a + EMAIL_OFFSET, (char *)b + EMAIL_OFFSET, EMAIL_SIZE);
+    }
+    if (result == 0) {
+        uint64_t left, right;
+        memcpy(&left, a + ID_OFFSET, ID_SIZE);
+        memcpy(&right, b + ID_OFFSET, ID_SIZE);
+        result = (left > right) - (left < right);
+    }
+    return order->descending ? -result : result;
 }
 
-void deserialiseRow(void *source, Row *destination) {
-    memcpy(&(destination->id), (uint8_t *)source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->userName), (uint8_t *)source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), (uint8_t *)source + EMAIL_OFFSET, EMAIL_SIZE);
+// Restores the heap below index, largest row at the top
+static void sortSiftDown(SortOrder *order, uint8_t **cells, uint32_t numCells, uint32_t index) {
+    uint8_t *cell = cells[index];
+    while (true) {
+        uint32_t child = 2 * index + 1;
+        if (child >= numCells) {
+            break;
+        }
+        if (child + 1 < numCells && compareSortCells(order, cells[child + 1], cells[child]) > 0) {
+            child++;
+        }
+        if (compareSortCells(order, cells[child], cell) <= 0) {
+            break;
+        }
+        cells[index] = cells[child];
+        index = child;
+    }
+    cells[index] = cell;
 }
 
-void *getPage(Pager *pager, uint32_t pageNum) {
-    if (pageNum > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", pageNum,
-            TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+// Heap sorts the row pointers, the rows themselves never move
+void sortCells(SortOrder *order, uint8_t **cells, uint32_t numCells) {
+    for (uint32_t i = numCells / 2; i > 0; i--) {
+        sortSiftDown(order, cells, numCells, i - 1);
+    }
+    for (uint32_t end = numCells; end > 1; end--) {
+        uint8_t *largest = cells[0];
+        cells[0] = cells[end - 1];
+        cells[end - 1] = largest;
+        sortSiftDown(order, cells, end - 1, 0);
     }
+}
 
-    if (pager->pages[pageNum] == NULL) {
-        // Cache miss. Allocate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
+// Reads the next buffer of a run, returns false once the run is used up
+bool sortRunFill(SortRun *run) {
+    run->position = 0;
+    run->numBuffered = 0;
+    if (run->offset >= run->end) {
+        return false;
+    }
 
-        if (page == NULL) {
-            printf("Error allocating memory\n");
+    size_t length = (size_t)run->capacity * ROW_SIZE;
+    if ((off_t)length > run->end - run->offset) {
+        length = run->end - run->offset;
+    }
+    size_t done = 0;
+    while (done < length) {
+        ssize_t bytesRead = pread(run->fileDescriptor, run->buffer + done, length - done, run->offset + done);
+        if (bytesRead <= 0) {
+            if (bytesRead == -1 && errno == EINTR) continue;
+            printf("Error reading sort run: %d\n", errno);
             exit(EXIT_FAILURE);
         }
-
-        uint32_t numPagesInFile = pager->fileLength / PAGE_SIZE;
-        if (pageNum < numPagesInFile) {
-            lseek(pager->fileDescriptor, pageNum * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->fileDescriptor, page, PAGE_SIZE);
-
-            if (bytes_read == -1) {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
-            }
-        } else {
-            memset(page, 0, PAGE_SIZE);
-        }
-
-        pager->pages[pageNum] = page;
-
-        if (pageNum >= pager->numPages) {
-            pager->numPages = pageNum + 1;
-        }
+        done += bytesRead;
     }
+    run->offset += length;
+    run->numBuffered = length / ROW_SIZE;
+    return true;
+}
 
-    return pager->pages[pageNum];    
+static bool sortRunBeats(SortOrder *order, SortRun *runs, uint32_t a, uint32_t b) {
+    if (runs[b].position == runs[b].numBuffered) {
+        return true;
+    }
+    if (runs[a].position == runs[a].numBuffered) {
+        return false;
+    }
+    return compareSortCells(order, runs[a].buffer + runs[a].position * ROW_SIZE,
+        runs[b].buffer + runs[b].position * ROW_SIZE) < 0;
 }
 
+// Plays the matches below node, leaving each loser in the tree and returning the winner
+static uint32_t sortTreeBuild(SortOrder *order, SortRun *runs, uint32_t numRuns, uint32_t *tree, uint32_t node) {
+    if (node >= numRuns) {
+        return node - numRuns;
+    }
+    uint32_t left = sortTreeBuild(order, runs, numRuns, tree, 2 * node);
+    uint32_t right = sortTreeBuild(order, runs, numRuns, tree, 2 * node + 1);
+    if (sortRunBeats(order, runs, left, right)) {
+        tree[node] = right;
+        return left;
+    }
+    tree[node] = left;
+    return right;
+}
 
-Table *databaseOpen(char *fileName) {
-    Pager *pager = pagerOpen(fileName);
+// Merges the runs with a tournament tree of losers, so each row costs one comparison per level
+void sortRunsMerge(SortOrder *order, SortRun *runs, uint32_t numRuns, uint64_t limit, OutputBuffer *outputBuffer) {
+    uint32_t *tree = malloc(numRuns * sizeof(uint32_t));
+    uint32_t winner = sortTreeBuild(order, runs, numRuns, tree, 1);
+    Row row;
 
-    Table *table = malloc(sizeof(Table));
-    table->rootPageNum = 0;
-    table->pager = pager;
+    for (uint64_t printed = 0; printed < limit; printed++) {
+        SortRun *run = &runs[winner];
+        if (run->position == run->numBuffered) {
+            break;
+        }
+        deserialiseRow(run->buffer + run->position * ROW_SIZE, &row);
+        printRow(outputBuffer, &row);
+        if (++run->position == run->numBuffered) {
+            sortRunFill(run);
+        }
 
-    if (pager->numPages == 0) {
-        void *rootNode = getPage(pager, 0);
-        initialiseLeafNode(rootNode);
-        setNodeRoot(rootNode, true);
+        // Only the winner's path to the root needs replaying
+        for (uint32_t node = (winner + numRuns) / 2; node > 0; node /= 2) {
+            if (sortRunBeats(order, runs, tree[node], winner)) {
+                uint32_t loser = winner;
+                winner = tree[node];
+                tree[node] = loser;
+            }
+        }
     }
 
-    return table;
+    free(tree);
 }
 
-void databaseClose(Table* table) {
-    Pager* pager = table->pager;
-
-    for (uint32_t i = 0; i < pager->numPages; i++) {
-        if (pager->pages[i] == NULL) {
-        continue;
+// Handles 'order by <column> [asc/desc] [limit <n>]' and 'limit <n>'. A limit that fits in memory
+// keeps the best rows in a bounded heap, anything else is sorted in runs that fit the memory budget
+// and spilled to a temporary file, then merged.
+void doSelectOrdered(char *text, OutputBuffer *outputBuffer, Table *table) {
+    SortOrder order = { SORT_BY_ID, false };
+    uint64_t limit = UINT64_MAX;
+    bool valid = true;
+
+    char *token = strtok(text, " ");
+    if (token != NULL && strcmp(token, "order") == 0) {
+        token = strtok(NULL, " ");
+        char *column = strtok(NULL, " ");
+        if (token == NULL || strcmp(token, "by") != 0 || column == NULL) {
+            valid = false;
+        } else if (strcmp(column, "username") == 0) {
+            order.column = SORT_BY_USERNAME;
+        } else if (strcmp(column, "email") == 0) {
+            order.column = SORT_BY_EMAIL;
+        } else if (strcmp(column, "id") != 0) {
+            valid = false;
         }
-        pagerFlush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
-    }
 
-    int result = close(pager->fileDescriptor);
-    if (result == -1) {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+        token = strtok(NULL, " ");
+        if (token != NULL && (strcmp(token, "asc") == 0 || strcmp(token, "desc") == 0)) {
+            order.descending = strcmp(token, "desc") == 0;
+            token = strtok(NULL, " ");
+        }
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager->pages[i];
-        if (page) {
-        free(page);
-        pager->pages[i] = NULL;
+    if (valid && token != NULL && strcmp(token, "limit") == 0) {
+        char *count = strtok(NULL, " ");
+        if (count == NULL || !isNumber(count)) {
+            valid = false;
+        } else {
+            limit = strtoull(count, NULL, 10);
+            token = strtok(NULL, " ");
         }
     }
-    free(pager);
-    free(table);
-}
-
-Pager *pagerOpen(char *filename) {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-
-    if (fd == -1) {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
+    if (!valid || token != NULL) {
+        printf("Usage: select [order by id/username/email [asc/desc]] [limit <n>]\n");
+        return;
     }
 
-    off_t fileLength = lseek(fd, 0, SEEK_END);
-
-    Pager *pager = malloc(sizeof(Pager));
-    pager->fileDescriptor = fd;
-    pager->fileLength = fileLength;
-    pager->numPages = (fileLength / PAGE_SIZE);
+    fflush(stdout);
+    outputHeader(outputBuffer);
+    Cursor *cursor = tableStart(table);
+    Row row;
 
-    if (fileLength % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupt file\n");
-        exit(EXIT_FAILURE);
+    if (tableKeyOrder(table, &order)) {
+        // Already the order of the leaf chain
+        for (uint64_t printed = 0; printed < limit && !cursor->endOfTable; printed++) {
+            deserialiseRow(cursorValue(cursor), &row);
+            printRow(outputBuffer, &row);
+            cursorAdvance(cursor);
+        }
+        outputFlush(outputBuffer);
+        free(cursor);
+        return;
     }
-    
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+
+    uint64_t budgetRows = SORT_MEMORY_BUDGET / (ROW_SIZE + sizeof(uint8_t *));
+    if (limit == 0) {
+        outputFlush(outputBuffer);
+        free(cursor);
+        return;
     }
 
-    return pager;
-}
+    if (limit <= budgetRows) {
+        // The heap keeps the worst of the best limit rows on top, ready to be replaced
+        uint32_t numCells = 0;
+        uint8_t *rows = malloc(limit * ROW_SIZE);
+        uint8_t **cells = malloc(limit * sizeof(uint8_t *));
+        while (!cursor->endOfTable) {
+            uint8_t *value = cursorValue(cursor);
+            if (numCells < limit) {
+                cells[numCells] = rows + (size_t)numCells * ROW_SIZE;
+                memcpy(cells[numCells], value, ROW_SIZE);
+                numCells++;
+                if (numCells == limit) {
+                    for (uint32_t i = numCells / 2; i > 0; i--) {
+                        sortSiftDown(&order, cells, numCells, i - 1);
+                    }
+                }
+            } else if (compareSortCells(&order, value, cells[0]) < 0) {
+                memcpy(cells[0], value, ROW_SIZE);
+                sortSiftDown(&order, cells, numCells, 0);
+            }
+            cursorAdvance(cursor);
+        }
 
-void pagerFlush(Pager* pager, uint32_t pageNum) {
-    if (pager->pages[pageNum] == NULL) {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
+        sortCells(&order, cells, numCells);
+        for (uint32_t i = 0; i < numCells; i++) {
+            deserialiseRow(cells[i], &row);
+            printRow(outputBuffer, &row);
+        }
+        outputFlush(outputBuffer);
+        free(cells);
+        free(rows);
+        free(cursor);
+        return;
     }
 
-    off_t offset = lseek(pager->fileDescriptor, pageNum * PAGE_SIZE, SEEK_SET);
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
-    }
+    uint8_t *rows = malloc(budgetRows * ROW_SIZE);
+    uint8_t **cells = malloc(budgetRows * sizeof(uint8_t *));
+    uint32_t runsCapacity = 16;
+    uint32_t numRuns = 0;
+    SortRun *runs = malloc(runsCapacity * sizeof(SortRun));
+    OutputBuffer *spill = NULL;
+    off_t spilled = 0;
 
-    ssize_t bytesWritten = write(pager->fileDescriptor, pager->pages[pageNum], PAGE_SIZE);
+    while (true) {
+        uint32_t numCells = 0;
+        while (numCells < budgetRows && !cursor->endOfTable) {
+            cells[numCells] = rows + (size_t)numCells * ROW_SIZE;
+            memcpy(cells[numCells], cursorValue(cursor), ROW_SIZE);
+            numCells++;
+            cursorAdvance(cursor);
+        }
+        sortCells(&order, cells, numCells);
 
-    if (bytesWritten == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
-  }
-}
+        if (cursor->endOfTable && numRuns == 0) {
+            // Everything fit, no need to touch the disk
+            for (uint32_t i = 0; i < numCells && i < limit; i++) {
+                deserialiseRow(cells[i], &row);
+                printRow(outputBuffer, &row);
+            }
+            break;
+        }
 
-void printTable(Table *table, uint32_t pageNum) {
-    void *node = getPage(table->pager, pageNum);
-    NodeType type = getNodeType(node);
+        if (spill == NULL) {
+            const char *directory = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+            char *path = malloc(strlen(directory) + strlen(SORT_TEMP_NAME) + 2);
+            sprintf(path, "%s/%s", directory, SORT_TEMP_NAME);
+            int fd = mkstemp(path);
+            if (fd == -1) {
+                printf("Unable to create sort file %s\n", path);
+                exit(EXIT_FAILURE);
+            }
+            // Gone from the directory straight away, the space is freed when we close it
+            unlink(path);
+            free(path);
+            spill = NewOutputBuffer(fd);
+        }
 
-    if (type == LEAF_NODE) {
-        uint32_t numCells = *leafNodenumCells(node);
+        if (numRuns == runsCapacity) {
+            runsCapacity *= 2;
+            runs = realloc(runs, runsCapacity * sizeof(SortRun));
+        }
+        SortRun *run = &runs[numRuns++];
+        run->fileDescriptor = spill->fileDescriptor;
+        run->offset = spilled;
         for (uint32_t i = 0; i < numCells; i++) {
-            Row row;
-            void *value = leafNodeValue(node, i);
-            deserialiseRow(value, &row);
-            printRow(&row);
+            outputWrite(spill, cells[i], ROW_SIZE);
         }
-    } else if (type == INTERNAL_NODE) {
-        uint32_t numKeys = *internalNodeNumKeys(node);
-        Cursor *cursor = tableFind(table, *internalNodeKey(node, 0));
+        spilled += (off_t)numCells * ROW_SIZE;
+        run->end = spilled;
 
-        if (numKeys > 0) {
-            for (uint32_t i = 0; i < numKeys; i++) {
-                uint32_t leftChildPageNum = *internalNodeChild(node, i);
-                printTable(table, leftChildPageNum);
-            }
+        if (cursor->endOfTable) {
+            break;
         }
-        uint32_t rightChildPageNum = *internalNodeRightChild(node);
-        printTable(table, rightChildPageNum);
     }
-} 
 
-void printNodes(Cursor *cursor) {
-    Row row;
-
-    while (!(cursor->endOfTable)) {
-        deserialiseRow(cursorValue(cursor), &row);
-        printRow(&row);
-        cursorAdvance(cursor);
+    if (numRuns > 0) {
+        outputFlush(spill);
+        free(cells);
+        // The run buffers share the memory budget between them
+        uint32_t bufferRows = budgetRows / numRuns;
+        if (bufferRows < SORT_MIN_RUN_BUFFER_ROWS) {
+            bufferRows = SORT_MIN_RUN_BUFFER_ROWS;
+        }
+        if ((uint64_t)bufferRows * numRuns > budgetRows) {
+            free(rows);
+            rows = malloc((size_t)bufferRows * numRuns * ROW_SIZE);
+        }
+        for (uint32_t i = 0; i < numRuns; i++) {
+            runs[i].buffer = rows + (size_t)i * bufferRows * ROW_SIZE;
+            runs[i].capacity = bufferRows;
+            sortRunFill(&runs[i]);
+        }
+        sortRunsMerge(&order, runs, numRuns, limit, outputBuffer);
+        int spillFileDescriptor = spill->fileDescriptor;
+        closeOutput(spill);
+        close(spillFileDescriptor);
+    } else {
+        free(cells);
     }
-}
-
-Cursor *tableStart(Table *table) {
-    Cursor *cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->pageNum = table->rootPageNum;
-    cursor->cellNum = 0;
-
-    void *rootNode = getPage(table->pager, table->rootPageNum);
-    uint32_t numCells = *(uint32_t *)leafNodenumCells(rootNode);
-    cursor->endOfTable = (numCells == 0);
+    outputFlush(outputBuffer);
 
-    return cursor;
+    free(runs);
+    free(rows);
+    free(cursor);
 }
 
-Cursor *tableFind(Table *table, uint32_t key) {
-    uint32_t rootPageNum = table->rootPageNum;
-    void *rootNode = getPage(table->pager, rootPageNum);
+// Handles 'where <column> like/contains <pattern> [and ...]'. Rows are taken a batch at a time, each
+// predicate gathers its column of the batch into a vector and narrows the selection bitmap, and only
+// the rows left selected at the end are decoded.
+void doSelectWhere(char *text, OutputBuffer *outputBuffer, Table *table) {
+    FilterPredicate predicates[FILTER_MAX_PREDICATES];
+    uint32_t numPredicates = 0;
+    bool valid = true;
+
+    char *token = strtok(text, " ");
+    while (valid && token != NULL) {
+        if (strcmp(token, numPredicates == 0 ? "where" : "and") != 0 || numPredicates == FILTER_MAX_PREDICATES) {
+            valid = false;
+            break;
+        }
+        char *column = strtok(NULL, " ");
+        char *operator = strtok(NULL, " ");
+        char *pattern = strtok(NULL, " ");
+        if (column == NULL || operator == NULL || pattern == NULL) {
+            valid = false;
+            break;
+        }
 
-    if (getNodeType(rootNode) == LEAF_NODE) {
-        return leafNodeFind(table, rootPageNum, key);
-    } else {
-        return internalNodeFind(table, rootPageNum, key);
+        FilterPredicate *predicate = &predicates[numPredicates++];
+        if (strcmp(column, "username") == 0) {
+            predicate->offset = USERNAME_OFFSET;
+            predicate->size = USERNAME_SIZE;
+        } else if (strcmp(column, "email") == 0) {
+            predicate->offset = EMAIL_OFFSET;
+            predicate->size = EMAIL_SIZE;
+        } else {
+            valid = false;
+            break;
+        }
+
+        size_t length = strlen(pattern);
+        if (length >= 2 && (pattern[0] == '\'' || pattern[0] == '"') && pattern[length - 1] == pattern[0]) {
+            pattern[length - 1] = '\0';
+            pattern++;
+        }
+        if (strcmp(operator, "like") == 0) {
+            valid = filterCompile(predicate, pattern, false);
+        } else if (strcmp(operator, "contains") == 0) {
+            valid = filterCompile(predicate, pattern, true);
+        } else {
+            valid = false;
+        }
+        token = strtok(NULL, " ");
+    }
+    if (!valid || numPredicates == 0) {
+        printf("Usage: select where username/email like/contains '<pattern>' [and ...]\n");
+        return;
     }
-}
 
-Cursor *leafNodeFind(Table *table, uint32_t pageNum, uint32_t key) {
-    void *node = getPage(table->pager, pageNum);
-    uint32_t numCells = *leafNodenumCells(node);
+    fflush(stdout);
+    outputHeader(outputBuffer);
 
-    Cursor *cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->pageNum = pageNum;
+    uint8_t **rows = malloc(FILTER_BATCH_ROWS * sizeof(uint8_t *));
+    uint8_t *column = pageBufferAlloc((size_t)FILTER_BATCH_ROWS * FILTER_MAX_STRIDE);
+    uint16_t *lengths = malloc(FILTER_BATCH_ROWS * sizeof(uint16_t));
+    uint64_t selection[FILTER_BATCH_ROWS / 64];
+    Cursor *cursor = tableStart(table);
+    Row row;
 
-    uint32_t minIndex = 0;
-    uint32_t onePastMax = numCells;
+    while (!cursor->endOfTable) {
+        uint32_t numRows = filterGather(cursor, rows);
+        memset(selection, 0, sizeof(selection));
+        for (uint32_t i = 0; i < numRows / 64; i++) {
+            selection[i] = UINT64_MAX;
+        }
+        if (numRows % 64 != 0) {
+            selection[numRows / 64] = (1ull << (numRows % 64)) - 1;
+        }
 
-    while (onePastMax != minIndex) {
-        uint32_t index = (minIndex + onePastMax) / 2;
-        uint32_t keyAtIndex = *leafNodeKey(node, index);
-        if (key == keyAtIndex) {
-            cursor->cellNum = index;
-            return cursor;
+        uint32_t gatheredOffset = 0;
+        for (uint32_t p = 0; p < numPredicates; p++) {
+            FilterPredicate *predicate = &predicates[p];
+            uint32_t stride = FILTER_STRIDE(predicate->size);
+            if (predicate->offset != gatheredOffset) {
+                for (uint32_t i = 0; i < numRows; i++) {
+                    uint8_t *value = column + (size_t)i * stride;
+                    memcpy(value, rows[i] + predicate->offset, predicate->size);
+                    memset(value + predicate->size, 0, stride - predicate->size);
+                }
+                gatheredOffset = predicate->offset;
+            }
+            filterEvaluate(predicate, column, stride, numRows, lengths, selection);
         }
 
-        if (key < keyAtIndex) {
-            onePastMax = index;
-        } else {
-            minIndex = index + 1;
+        for (uint32_t word = 0; word < (numRows + 63) / 64; word++) {
+            for (uint64_t bits = selection[word]; bits != 0; bits &= bits - 1) {
+                deserialiseRow(rows[word * 64 + __builtin_ctzll(bits)], &row);
+                printRow(outputBuffer, &row);
+            }
         }
     }
-    cursor->cellNum = minIndex;
-    return cursor;
+    outputFlush(outputBuffer);
+
+    free(cursor);
+    free(lengths);
+    free(column);
+    free(rows);
 }
 
-void *cursorValue(Cursor *cursor) {
-    uint32_t pageNum = cursor->pageNum;
+// Splits the pattern on % in place. Contains is a like with % on both ends.
+bool filterCompile(FilterPredicate *predicate, char *pattern, bool contains) {
+    size_t length = strlen(pattern);
+    predicate->anchoredStart = !contains && pattern[0] != '%';
+    predicate->anchoredEnd = !contains && (length == 0 || pattern[length - 1] != '%');
+    predicate->numSegments = 0;
 
-    void *page = getPage(cursor->table->pager, pageNum);   
+    char *rest;
+    for (char *segment = strtok_r(pattern, "%", &rest); segment != NULL; segment = strtok_r(NULL, "%", &rest)) {
+        if (predicate->numSegments == FILTER_MAX_SEGMENTS) {
+            return false;
+        }
+        predicate->segments[predicate->numSegments] = segment;
+        predicate->segmentLengths[predicate->numSegments] = strlen(segment);
+        predicate->numSegments++;
+    }
 
-    return leafNodeValue(page, cursor->cellNum);
+    return true;
 }
 
-void cursorAdvance(Cursor *cursor) {
-    uint32_t pageNum = cursor->pageNum;
-    void *node = getPage(cursor->table->pager, pageNum);
+// Takes up to a batch of rows from the cursor, a page at a time. The rows stay in the page frames.
+uint32_t filterGather(Cursor *cursor, uint8_t **rows) {
+    Pager *pager = cursor->table->pager;
+    uint32_t numRows = 0;
 
-    cursor->cellNum += 1;
-    if (cursor->cellNum >= (*(uint32_t *)leafNodenumCells(node))) {
-        uint32_t nextPageNum = *leafNodeNextLeaf(node);
-        if (nextPageNum == 0) {
-            cursor->endOfTable = true;
-        } else {
-            cursor->pageNum = nextPageNum;
-            cursor->cellNum = 0;
+    if (cursor->lsm != NULL) {
+        // The rows are the cursor's own copies, so the next batch is only read on the following call
+        if (cursor->cellNum >= cursor->numRows) {
+            lsmCursorFill(cursor);
         }
+        while (numRows < FILTER_BATCH_ROWS && cursor->cellNum < cursor->numRows) {
+            rows[numRows++] = cursorValue(cursor);
+            cursor->cellNum++;
+        }
+        cursor->endOfTable = cursor->cellNum >= cursor->numRows && cursor->exhausted;
+        return numRows;
     }
-}
 
-uint32_t *leafNodeNextLeaf(void *node) {
-    return (uint32_t *)((uint8_t *)node + LEAF_NODE_NEXT_LEAF_OFFSET);
-}
+    while (numRows < FILTER_BATCH_ROWS && !cursor->endOfTable) {
+        void *node = getPage(pager, cursor->pageNum);
+        bool isBucket = getNodeType(node) == HASH_BUCKET_NODE;
+        uint32_t numCells = isBucket ? *hashBucketNumCells(node) : *leafNodenumCells(node);
 
-uint32_t *leafNodenumCells(void *node) {
-    return (uint32_t *)((uint8_t *)node + LEAF_NODE_NUM_CELLS_OFFSET);
+        for (; cursor->cellNum < numCells && numRows < FILTER_BATCH_ROWS; cursor->cellNum++) {
+            rows[numRows++] = isBucket ? hashBucketValue(node, pager->pageSize, cursor->cellNum) :
+                leafNodeValue(node, cursor->cellNum);
+        }
+        if (cursor->cellNum >= numCells) {
+            // Parked on the last cell so the advance moves to the next page
+            cursor->cellNum = numCells > 0 ? numCells - 1 : 0;
+            cursorAdvance(cursor);
+        }
+    }
+
+    return numRows;
 }
 
-void *leafNodeCell(void *node, uint32_t cellNum) {
-    return (uint8_t *)node + LEAF_NODE_HEADER_SIZE + cellNum * LEAF_NODE_CELL_SIZE;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+// Compares the needle's first and last bytes at 32 positions at once and only checks the rest where
+// both match
+__attribute__((target("avx2")))
+static const uint8_t *filterFindAvx2(const uint8_t *haystack, size_t length, const uint8_t *needle,
+    size_t needleLength) {
+    const __m256i first = _mm256_set1_epi8((char)needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)needle[needleLength - 1]);
+    size_t i = 0;
+
+    for (; i + needleLength - 1 + 32 <= length; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i *)(haystack + i + needleLength - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast)));
+        while (mask != 0) {
+            uint32_t bit = __builtin_ctz(mask);
+            if (needleLength <= 2 || memcmp(haystack + i + bit + 1, needle + 1, needleLength - 2) == 0) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return memmem(haystack + i, length - i, needle, needleLength);
 }
 
-uint32_t *leafNodeKey(void *node, uint32_t cellNum) {
-    return leafNodeCell(node, cellNum);
+// Values are NUL padded to a multiple of 32 bytes, so whole blocks can be loaded until the NUL shows up
+__attribute__((target("avx2")))
+static void filterLengthsAvx2(const uint8_t *column, uint32_t stride, uint32_t numRows, uint16_t *lengths) {
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (uint32_t i = 0; i < numRows; i++) {
+        const uint8_t *value = column + (size_t)i * stride;
+        uint32_t length = 0;
+        while (true) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)(value + length));
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+            if (mask != 0) {
+                length += __builtin_ctz(mask);
+                break;
+            }
+            length += 32;
+        }
+        lengths[i] = length;
+    }
 }
 
-void *leafNodeValue(void *node, uint32_t cellNum) {
-    return (uint8_t *)leafNodeCell(node, cellNum) + LEAF_NODE_KEY_SIZE;
+static bool filterHasAvx2() {
+    static int hasAvx2 = -1;
+    if (hasAvx2 == -1) {
+        hasAvx2 = __builtin_cpu_supports("avx2");
+    }
+    return hasAvx2;
 }
+#endif
 
-void initialiseLeafNode(void *node) {
-    setNodeType(node, LEAF_NODE);
-    *leafNodenumCells(node) = 0;
-    *leafNodeNextLeaf(node) = 0;
+// First occurrence of needle in haystack, or NULL
+static const uint8_t *filterFind(const uint8_t *haystack, size_t length, const uint8_t *needle,
+    size_t needleLength) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    if (filterHasAvx2()) {
+        return filterFindAvx2(haystack, length, needle, needleLength);
+    }
+#endif
+    return memmem(haystack, length, needle, needleLength);
 }
 
-void indent(uint32_t level) {
-    for (uint32_t i = 0; i < level; i++) {
-        printf("  ");
+static void filterLengths(const uint8_t *column, uint32_t stride, uint32_t size, uint32_t numRows,
+    uint16_t *lengths) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    if (filterHasAvx2()) {
+        filterLengthsAvx2(column, stride, numRows, lengths);
+        return;
+    }
+#endif
+    for (uint32_t i = 0; i < numRows; i++) {
+        lengths[i] = strnlen((const char *)column + (size_t)i * stride, size);
     }
 }
 
-void printTree(Pager *pager, uint32_t pageNum, uint32_t indentationLevel) {
-    void *node = getPage(pager, pageNum);
-    uint32_t numKeys, child;
+// Whether one value matches a like pattern: the anchored ends are compared in place, the segments
+// in between are searched for left to right. The searches run over the value's whole NUL padded stride,
+// which no segment can match into, so they stay on the vector path even for short values.
+static bool filterMatch(FilterPredicate *predicate, const uint8_t *value, uint32_t length, uint32_t stride) {
+    uint32_t first = 0;
+    uint32_t last = predicate->numSegments;
+    uint32_t start = 0;
+    uint32_t end = length;
+
+    if (predicate->numSegments == 0) {
+        return !predicate->anchoredStart || length == 0;
+    }
+    if (predicate->anchoredStart && predicate->anchoredEnd && predicate->numSegments == 1) {
+        return length == predicate->segmentLengths[0] && memcmp(value, predicate->segments[0], length) == 0;
+    }
+    if (predicate->anchoredStart) {
+        uint32_t segmentLength = predicate->segmentLengths[0];
+        if (segmentLength > length || memcmp(value, predicate->segments[0], segmentLength) != 0) {
+            return false;
+        }
+        start = segmentLength;
+        first = 1;
+    }
+    if (predicate->anchoredEnd) {
+        uint32_t segmentLength = predicate->segmentLengths[last - 1];
+        if (segmentLength > end - start ||
+            memcmp(value + end - segmentLength, predicate->segments[last - 1], segmentLength) != 0) {
+            return false;
+        }
+        end -= segmentLength;
+        last--;
+    }
+    for (uint32_t s = first; s < last; s++) {
+        const uint8_t *match = filterFind(value + start, stride - start, (uint8_t *)predicate->segments[s],
+            predicate->segmentLengths[s]);
+        if (match == NULL || (uint32_t)(match - value) + predicate->segmentLengths[s] > end) {
+            return false;
+        }
+        start = (uint32_t)(match - value) + predicate->segmentLengths[s];
+    }
+
+    return true;
+}
+
+// Clears the selection bits of the rows that fail the predicate
+void filterEvaluate(FilterPredicate *predicate, uint8_t *column, uint32_t stride, uint32_t numRows,
+    uint16_t *lengths, uint64_t *selection) {
+    uint32_t numWords = (numRows + 63) / 64;
+
+    if (!predicate->anchoredStart && !predicate->anchoredEnd && predicate->numSegments == 1) {
+        // A plain substring: one pass over the whole vector. The NUL padding between values keeps a match
+        // from spanning two rows, and after a match the search skips to the next row.
+        uint64_t matches[FILTER_BATCH_ROWS / 64] = { 0 };
+        const uint8_t *position = column;
+        const uint8_t *end = column + (size_t)numRows * stride;
+        while (position < end) {
+            const uint8_t *match = filterFind(position, end - position, (uint8_t *)predicate->segments[0],
+                predicate->segmentLengths[0]);
+            if (match == NULL) {
+                break;
+            }
+            uint32_t rowNum = (uint32_t)((match - column) / stride);
+            matches[rowNum / 64] |= 1ull << (rowNum % 64);
+            position = column + (size_t)(rowNum + 1) * stride;
+        }
+        for (uint32_t word = 0; word < numWords; word++) {
+            selection[word] &= matches[word];
+        }
+        return;
+    }
+
+    filterLengths(column, stride, predicate->size, numRows, lengths);
+    for (uint32_t word = 0; word < numWords; word++) {
+        for (uint64_t bits = selection[word]; bits != 0; bits &= bits - 1) {
+            uint32_t rowNum = word * 64 + __builtin_ctzll(bits);
+            if (!filterMatch(predicate, column + (size_t)rowNum * stride, lengths[rowNum], stride)) {
+                selection[word] &= ~(1ull << (rowNum % 64));
+            }
+        }
+    }
+}
+
+void doFormat(OutputBuffer *outputBuffer) {
+    char *arg = strtok(NULL, " ");
+    if (arg == NULL) {
+        printf("Format missing\n");
+        return;
+    }
+
+    if (strcmp(arg, "text") == 0) {
+        outputBuffer->format = OUTPUT_TEXT;
+    } else if (strcmp(arg, "aligned") == 0) {
+        outputBuffer->format = OUTPUT_ALIGNED;
+    } else if (strcmp(arg, "csv") == 0) {
+        outputBuffer->format = OUTPUT_CSV;
+    } else if (strcmp(arg, "json") == 0) {
+        outputBuffer->format = OUTPUT_JSON;
+    } else if (strcmp(arg, "binary") == 0) {
+        outputBuffer->format = OUTPUT_BINARY;
+    } else {
+        printf("Unknown format %s\n", arg);
+        return;
+    }
+    printf("Format set to %s\n", arg);
+}
+
+
+bool isNumber(char *number) {
+    if (number == NULL || *number == '\0') return false;
+    for (int i = 0; number[i]; i++) {
+        if (number[i] < '0' || number[i] > '9') {
+            printf("invalid number\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool isUserName(char *userName) {
+    if ((strlen(userName) <= 5) || (strlen(userName) > MAX_USERNAME_SIZE)) {
+        return false;
+    }
+
+    return true;
+}
+
+bool isEmail(char *email) {
+    if ((strstr(email, "@") == NULL) || (strlen(email) > MAX_EMAIL_SIZE)) {
+        return false;
+    }
+
+    return true;
+}
+
+// Creates new output buffer writing to fileDescriptor
+OutputBuffer *NewOutputBuffer(int fileDescriptor) {
+    OutputBuffer *newOutputBuffer = malloc(sizeof(OutputBuffer));
+    newOutputBuffer->fileDescriptor = fileDescriptor;
+    newOutputBuffer->format = OUTPUT_TEXT;
+    newOutputBuffer->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    newOutputBuffer->length = 0;
+
+    if (newOutputBuffer->buffer == NULL) {
+        printf("Error allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return newOutputBuffer;
+}
+
+void closeOutput(OutputBuffer *outputBuffer) {
+    outputFlush(outputBuffer);
+    free(outputBuffer->buffer);
+    free(outputBuffer);
+}
+
+static void outputWriteAll(int fileDescriptor, const char *data, size_t length) {
+    size_t written = 0;
+
+    while (written < length) {
+        ssize_t bytesWritten = write(fileDescriptor, data + written, length - written);
+
+        if (bytesWritten == -1) {
+            if (errno == EINTR) continue;
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        written += bytesWritten;
+    }
+}
+
+void outputFlush(OutputBuffer *outputBuffer) {
+    outputWriteAll(outputBuffer->fileDescriptor, outputBuffer->buffer, outputBuffer->length);
+    outputBuffer->length = 0;
+}
+
+void outputWrite(OutputBuffer *outputBuffer, const void *data, size_t length) {
+    if (outputBuffer->length + length > OUTPUT_BUFFER_SIZE) {
+        outputFlush(outputBuffer);
+    }
+
+    if (length > OUTPUT_BUFFER_SIZE) {
+        // Too big to ever fit, write it straight through
+        outputWriteAll(outputBuffer->fileDescriptor, data, length);
+        return;
+    }
+
+    memcpy(outputBuffer->buffer + outputBuffer->length, data, length);
+    outputBuffer->length += length;
+}
+
+// Writes value in decimal two digits at a time, returns number of chars written
+size_t formatUint(uint64_t value, char *destination) {
+    static const char digitPairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char digits[20];
+    char *end = digits + sizeof(digits);
+    char *start = end;
+
+    while (value >= 100) {
+        uint32_t pair = (value % 100) * 2;
+        value /= 100;
+        *--start = digitPairs[pair + 1];
+        *--start = digitPairs[pair];
+    }
+    if (value >= 10) {
+        *--start = digitPairs[value * 2 + 1];
+        *--start = digitPairs[value * 2];
+    } else {
+        *--start = '0' + value;
+    }
+
+    size_t length = end - start;
+    memcpy(destination, start, length);
+    return length;
+}
+
+static char *outputCsvField(char *position, const char *field, size_t length) {
+    if (strpbrk(field, ",\"\r\n") == NULL) {
+        memcpy(position, field, length);
+        return position + length;
+    }
+
+    *position++ = '"';
+    for (size_t i = 0; i < length; i++) {
+        if (field[i] == '"') *position++ = '"';
+        *position++ = field[i];
+    }
+    *position++ = '"';
+    return position;
+}
+
+static char *outputJsonString(char *position, const char *field, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+
+    *position++ = '"';
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = field[i];
+        if (c == '"' || c == '\\') {
+            *position++ = '\\';
+            *position++ = c;
+        } else if (c < 0x20) {
+            memcpy(position, "\\u00", 4);
+            position[4] = hex[c >> 4];
+            position[5] = hex[c & 0xf];
+            position += 6;
+        } else {
+            *position++ = c;
+        }
+    }
+    *position++ = '"';
+    return position;
+}
+
+static char *outputPadded(char *position, const char *field, size_t length, size_t width) {
+    memcpy(position, field, length);
+    position += length;
+    if (length < width) {
+        memset(position, ' ', width - length);
+        position += width - length;
+    }
+    return position;
+}
+
+// Prints column names for formats that have them
+void outputHeader(OutputBuffer *outputBuffer) {
+    char header[128];
+    char *position = header;
+
+    if (outputBuffer->format == OUTPUT_ALIGNED) {
+        position = outputPadded(position, "id", 2, ALIGNED_ID_WIDTH);
+        position = outputPadded(position, " | username", 11, MAX_USERNAME_SIZE + 3);
+        memcpy(position, " | email\n", 9);
+        position += 9;
+    } else if (outputBuffer->format == OUTPUT_CSV) {
+        memcpy(position, "id,username,email\n", 18);
+        position += 18;
+    }
+
+    outputWrite(outputBuffer, header, position - header);
+}
+
+void printRow(OutputBuffer *outputBuffer, Row *row) {
+    if (outputBuffer->length + OUTPUT_MAX_ROW_SIZE > OUTPUT_BUFFER_SIZE) {
+        outputFlush(outputBuffer);
+    }
+
+    // Stored strings are only NUL terminated when shorter than the column
+    size_t userNameLength = strnlen(row->userName, MAX_USERNAME_SIZE);
+    size_t emailLength = strnlen(row->email, MAX_EMAIL_SIZE);
+    char idText[20];
+    size_t idLength = formatUint(row->id, idText);
+    char *start = outputBuffer->buffer + outputBuffer->length;
+    char *position = start;
+
+    row->userName[userNameLength] = '\0';
+    row->email[emailLength] = '\0';
+
+    switch (outputBuffer->format) {
+        case OUTPUT_TEXT:
+            memcpy(position, "id: ", 4);
+            memcpy(position + 4, idText, idLength);
+            position += 4 + idLength;
+            memcpy(position, ", username: ", 12);
+            memcpy(position + 12, row->userName, userNameLength);
+            position += 12 + userNameLength;
+            memcpy(position, ", email: ", 9);
+            memcpy(position + 9, row->email, emailLength);
+            position += 9 + emailLength;
+            *position++ = '\n';
+            break;
+        case OUTPUT_ALIGNED:
+            position = outputPadded(position, idText, idLength, ALIGNED_ID_WIDTH);
+            memcpy(position, " | ", 3);
+            position = outputPadded(position + 3, row->userName, userNameLength, MAX_USERNAME_SIZE);
+            memcpy(position, " | ", 3);
+            memcpy(position + 3, row->email, emailLength);
+            position += 3 + emailLength;
+            *position++ = '\n';
+            break;
+        case OUTPUT_CSV:
+            memcpy(position, idText, idLength);
+            position += idLength;
+            *position++ = ',';
+            position = outputCsvField(position, row->userName, userNameLength);
+            *position++ = ',';
+            position = outputCsvField(position, row->email, emailLength);
+            *position++ = '\n';
+            break;
+        case OUTPUT_JSON:
+            memcpy(position, "{\"id\":", 6);
+            memcpy(position + 6, idText, idLength);
+            position += 6 + idLength;
+            memcpy(position, ",\"username\":", 12);
+            position = outputJsonString(position + 12, row->userName, userNameLength);
+            memcpy(position, ",\"email\":", 9);
+            position = outputJsonString(position + 9, row->email, emailLength);
+            memcpy(position, "}\n", 2);
+            position += 2;
+            break;
+        case OUTPUT_BINARY: {
+            // [u32 record length][u64 id][u16 length][username][u16 length][email], host byte order
+            uint32_t recordLength = ID_SIZE + 2 * sizeof(uint16_t) + userNameLength + emailLength;
+            uint16_t fieldLength;
+            memcpy(position, &recordLength, sizeof(recordLength));
+            memcpy(position + 4, &row->id, ID_SIZE);
+            position += 4 + ID_SIZE;
+            fieldLength = userNameLength;
+            memcpy(position, &fieldLength, sizeof(fieldLength));
+            memcpy(position + 2, row->userName, userNameLength);
+            position += 2 + userNameLength;
+            fieldLength = emailLength;
+            memcpy(position, &fieldLength, sizeof(fieldLength));
+            memcpy(position + 2, row->email, emailLength);
+            position += 2 + emailLength;
+            break;
+        }
+    }
+
+    outputBuffer->length += position - start;
+}
+
+// Copies a string into a fixed width field padded with NULs. One that fills the field is stored without
+// a terminator, readers bound it by the field size.
+void copyPadded(uint8_t *destination, const char *source, size_t size) {
+    size_t length = strnlen(source, size);
+    memcpy(destination, source, length);
+    memset(destination + length, 0, size - length);
+}
+
+void serialiseRow(Row *source, void *destination) {
+    memcpy((uint8_t *)destination + ID_OFFSET, &(source->id), ID_SIZE);
+    copyPadded((uint8_t *)destination + USERNAME_OFFSET, source->userName, USERNAME_SIZE);
+    copyPadded((uint8_t *)destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+}
+
+void deserialiseRow(void *source, Row *destination) {
+    memcpy(&(destination->id), (uint8_t *)source + ID_OFFSET, ID_SIZE);
+    memcpy(&(destination->userName), (uint8_t *)source + USERNAME_OFFSET, USERNAME_SIZE);
+    memcpy(&(destination->email), (uint8_t *)source + EMAIL_OFFSET, EMAIL_SIZE);
+    // Fields that fill their width have no terminator on the page
+    destination->userName[MAX_USERNAME_SIZE] = '\0';
+    destination->email[MAX_EMAIL_SIZE] = '\0';
+}
+
+// Hands out a page frame aligned to the page size. Frames are carved from large anonymous mappings,
+// backed by huge pages when asked for, and only go back to the system when the pager closes.
+void *pagerAllocFrame(Pager *pager) {
+    if (pager->freeFrames != NULL) {
+        void *frame = pager->freeFrames;
+        pager->freeFrames = *(void **)frame;
+        return frame;
+    }
+
+    if (pager->numFrameChunks == 0 || pager->nextFrame == FRAME_CHUNK_SIZE / pager->pageSize) {
+        void *chunk = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (pager->hugePages) {
+            chunk = mmap(NULL, FRAME_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                -1, 0);
+        }
+#endif
+        if (chunk == MAP_FAILED) {
+            chunk = mmap(NULL, FRAME_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                -1, 0);
+            if (chunk == MAP_FAILED) {
+                printf("Error allocating memory\n");
+                exit(EXIT_FAILURE);
+            }
+#ifdef MADV_HUGEPAGE
+            if (pager->hugePages) {
+                madvise(chunk, FRAME_CHUNK_SIZE, MADV_HUGEPAGE);
+            }
+#endif
+        }
+
+        pager->frameChunks = realloc(pager->frameChunks, (pager->numFrameChunks + 1) * sizeof(uint8_t *));
+        pager->frameChunks[pager->numFrameChunks++] = chunk;
+        pager->nextFrame = 0;
+    }
+
+    return pager->frameChunks[pager->numFrameChunks - 1] + (size_t)pager->nextFrame++ * pager->pageSize;
+}
+
+void pagerFreeFrame(Pager *pager, void *frame) {
+    *(void **)frame = pager->freeFrames;
+    pager->freeFrames = frame;
+}
+
+// Frames are numbered by chunk, then by position in the chunk
+uint32_t pagerFrameIndex(Pager *pager, void *frame) {
+    for (uint32_t i = 0; i < pager->numFrameChunks; i++) {
+        uint8_t *chunk = pager->frameChunks[i];
+        if ((uint8_t *)frame >= chunk && (uint8_t *)frame < chunk + FRAME_CHUNK_SIZE) {
+            return (i << pager->frameShift) + (uint32_t)(((uint8_t *)frame - chunk) / pager->pageSize);
+        }
+    }
+
+    printf("Page frame is not in the page cache\n");
+    exit(EXIT_FAILURE);
+}
+
+static inline void *pagerFrame(Pager *pager, uint32_t frameIndex) {
+    return pager->frameChunks[frameIndex >> pager->frameShift] +
+        (size_t)(frameIndex & ((1u << pager->frameShift) - 1)) * pager->pageSize;
+}
+
+// Puts the page numbers back into every swizzled child slot. Anything that writes cached pages out,
+// or reads child slots as page numbers rather than to descend, calls this first
+void pagerUnswizzle(Pager *pager) {
+    for (uint32_t i = 0; i < pager->numSwizzledFrames; i++) {
+        uint32_t frameIndex = pager->swizzledFrames[i];
+        void *node = pagerFrame(pager, frameIndex);
+        pager->frames[frameIndex].swizzledChildren = false;
+        // A follower may have replaced the page since, and a fresh image holds no frame indexes
+        if (getNodeType(node) != INTERNAL_NODE) {
+            continue;
+        }
+
+        uint32_t numKeys = *internalNodeNumKeys(node);
+        for (uint32_t childNum = 0; childNum <= numKeys; childNum++) {
+            uint32_t *slot = (childNum < numKeys) ? internalNodeCell(node, childNum) : internalNodeRightChild(node);
+            if (isSwizzled(*slot)) {
+                *slot = pager->frames[*slot & ~PAGE_SWIZZLED].pageNum;
+            }
+        }
+    }
+    pager->numSwizzledFrames = 0;
+}
+
+// Scratch buffer that can be read into straight from the db file, which needs alignment under O_DIRECT
+void *pageBufferAlloc(size_t size) {
+    void *buffer;
+    if (posix_memalign(&buffer, FRAME_ALIGNMENT, size) != 0) {
+        printf("Error allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+// Grows the page table so that pageNum has a slot
+void pagerReserve(Pager *pager, uint32_t pageNum) {
+    if (pageNum < pager->pagesCapacity) {
+        return;
+    }
+
+    uint32_t newCapacity = pager->pagesCapacity;
+    while (newCapacity <= pageNum) {
+        newCapacity *= 2;
+    }
+    void **newPages = realloc(pager->pages, newCapacity * sizeof(void *));
+    if (newPages == NULL) {
+        printf("Error allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(newPages + pager->pagesCapacity, 0, (newCapacity - pager->pagesCapacity) * sizeof(void *));
+    pager->pages = newPages;
+    pager->pagesCapacity = newCapacity;
+}
+
+void *getPage(Pager *pager, uint32_t pageNum) {
+    SPAN(getPage, "page", pageNum);
+    if (pageNum >= TABLE_MAX_PAGES) {
+        printf("Tried to fetch page number out of bounds. %d > %d\n", pageNum,
+            TABLE_MAX_PAGES);
+        exit(EXIT_FAILURE);
+    }
+
+    pagerReserve(pager, pageNum);
+
+    if (pager->pages[pageNum] == NULL && pager->shared != NULL && pager->shared->pages != NULL) {
+        pagerMapPage(pager, pageNum);
+    }
+    if (pager->pages[pageNum] == NULL) {
+        // Cache miss. Allocate memory and load from file.
+        void* page = pagerAllocFrame(pager);
+
+        uint32_t numPagesInFile = pager->fileLength / pager->pageSize;
+        if (pager->inMemory) {
+            memset(page, 0, pager->pageSize);
+        } else if (pageNum < numPagesInFile) {
+            lseek(pager->fileDescriptor, (off_t)pageNum * pager->pageSize, SEEK_SET);
+            ssize_t bytes_read = read(pager->fileDescriptor, page, pager->pageSize);
+
+            if (bytes_read == -1) {
+                printf("Error reading file: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+
+            if (bytes_read != pager->pageSize ||
+                *(uint32_t *)((uint8_t *)page + NODE_CHECKSUM_OFFSET) != pageChecksum(page, pager->pageSize)) {
+                printf("Checksum mismatch on page %d. Corrupt file\n", pageNum);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            memset(page, 0, pager->pageSize);
+        }
+
+        pager->pages[pageNum] = page;
+
+        if (pageNum >= pager->numPages) {
+            pager->numPages = pageNum + 1;
+        }
+    }
+
+    if (pager->shared != NULL && pager->shared->writing) {
+        sharedNoteWritten(pager->shared, pageNum);
+    }
+    return pager->pages[pageNum];    
+}
+
+void sharedNoteWritten(SharedState *shared, uint32_t pageNum) {
+    // Most repeats come straight after each other
+    if (shared->numWritten > 0 && shared->written[shared->numWritten - 1] == pageNum) {
+        return;
+    }
+    if (shared->numWritten == shared->writtenCapacity) {
+        shared->writtenCapacity = shared->writtenCapacity ? shared->writtenCapacity * 2 : 64;
+        shared->written = realloc(shared->written, shared->writtenCapacity * sizeof(uint32_t));
+    }
+    shared->written[shared->numWritten++] = pageNum;
+}
+
+// Points a page at its place in the shared cache mapping. One past the end of the file only needs the
+// file grown, the kernel hands back zeros.
+void pagerMapPage(Pager *pager, uint32_t pageNum) {
+    uint8_t *page = pager->shared->pages + (size_t)pageNum * pager->pageSize;
+    if (pageNum >= pager->fileLength / pager->pageSize) {
+        pager->fileLength = (off_t)(pageNum + 1) * pager->pageSize;
+        if (ftruncate(pager->fileDescriptor, pager->fileLength) == -1) {
+            printf("Error growing db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    } else if (*(uint32_t *)(page + NODE_CHECKSUM_OFFSET) != pageChecksum(page, pager->pageSize)) {
+        printf("Checksum mismatch on page %d. Corrupt file\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->pages[pageNum] = page;
+    if (pageNum >= pager->numPages) {
+        pager->numPages = pageNum + 1;
+    }
+}
+
+// pageSize only applies when the file is new, existing files keep the size in their header
+Database *databaseOpen(char *fileName, uint32_t pageSize, int ioFlags) {
+    const char *error;
+    Database *database = databaseTryOpen(fileName, pageSize, ioFlags, &error);
+    if (database == NULL) {
+        printf("%s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    return database;
+}
+
+// databaseOpen for callers that cannot exit. Returns NULL with error set, printing nothing.
+Database *databaseTryOpen(char *fileName, uint32_t pageSize, int ioFlags, const char **error) {
+    Pager *pager = pagerOpen(fileName, pageSize, ioFlags, error);
+    if (pager == NULL) {
+        return NULL;
+    }
+
+    Database *database = malloc(sizeof(Database));
+    database->pager = pager;
+    database->currentTable = NULL;
+    database->replication = NULL;
+    database->backupPid = 0;
+    database->backupPath = NULL;
+    database->capture = NULL;
+    database->defragment = NULL;
+    pthread_mutex_init(&database->lock, NULL);
+    database->hotPagesFileName = malloc(strlen(fileName) + strlen(HOT_PAGES_SUFFIX) + 1);
+    strcpy(database->hotPagesFileName, fileName);
+    strcat(database->hotPagesFileName, HOT_PAGES_SUFFIX);
+
+    if (pager->numPages == 0) {
+        initialiseCatalog(getPage(pager, CATALOG_PAGE_NUM), pager->pageSize);
+        createTable(pager, DEFAULT_TABLE_NAME, ENGINE_BTREE, NULL, 0);
+    } else if (!pager->inMemory && (pager->shared == NULL || pager->shared->pages == NULL)) {
+        warmStart(pager, database->hotPagesFileName);
+    }
+
+    // pagerOpen has checked the catalog of an existing file
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    if (*catalogNumTables(catalog) > 0) {
+        database->currentTable = tableOpen(pager, catalogTableName(catalog, 0));
+    }
+    // Held since pagerOpen, so two processes creating the same file cannot both write a catalog
+    if (pager->shared != NULL) {
+        pagerUnlock(pager, true);
+    }
+
+    return database;
+}
+
+void databaseClose(Database *database) {
+    Pager* pager = database->pager;
+    defragmentClose(database);
+    // A running backup reads uncached pages from the file, so it has to finish before we write to it
+    backupPoll(database, true);
+    replicationClose(database);
+    if (database->capture != NULL) {
+        int captureFileDescriptor = database->capture->fileDescriptor;
+        closeOutput(database->capture);
+        close(captureFileDescriptor);
+    }
+    pagerUnswizzle(pager);
+
+    // An in-memory database just goes away, anything worth keeping was saved. A shared one wrote its
+    // changes as each command finished, and the cache may be older than the file by now.
+    if (!pager->inMemory) {
+        if (pager->shared == NULL || pager->shared->pages == NULL) {
+            saveHotPages(pager, database->hotPagesFileName);
+        }
+        for (uint32_t i = 0; i < pager->numPages && pager->shared == NULL; i++) {
+            if (pager->pages[i] == NULL) {
+            continue;
+            }
+            pagerFlush(pager, i);
+            pager->pages[i] = NULL;
+        }
+
+        if (fsync(pager->fileDescriptor) == -1) {
+            printf("Error syncing db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        int result = close(pager->fileDescriptor);
+        if (result == -1) {
+            printf("Error closing db file.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint32_t i = 0; i < pager->numFrameChunks; i++) {
+        munmap(pager->frameChunks[i], FRAME_CHUNK_SIZE);
+    }
+    if (pager->shared != NULL) {
+        sharedClose(pager->shared);
+    }
+    free(pager->frameChunks);
+    free(pager->frames);
+    free(pager->swizzledFrames);
+    free(pager->pages);
+    free(pager->fileName);
+    free(pager);
+    tableClose(database->currentTable);
+    free(database->hotPagesFileName);
+    pthread_mutex_destroy(&database->lock);
+    free(database);
+}
+
+// Shared opens read lock the open byte, any other open write locks it, so a plain open never runs next
+// to shared ones, which would overwrite each other's pages. Fails rather than waits.
+static bool pagerOpenLock(int fd, bool shared) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = shared ? F_RDLCK : F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = PAGER_OPEN_LOCK_OFFSET;
+    lock.l_len = 1;
+    return fcntl(fd, F_SETLK, &lock) != -1;
+}
+
+// Gives up on an open that failed part way, leaving nothing behind. Always returns NULL.
+static Pager *pagerOpenFailed(int fd, SharedState *shared, const char **error, const char *message) {
+    if (shared != NULL) {
+        sharedClose(shared);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    *error = message;
+    return NULL;
+}
+
+// Returns NULL with error set if the file cannot be opened or is not a database. Prints nothing, so the
+// library can report it.
+Pager *pagerOpen(char *filename, uint32_t pageSize, int ioFlags, const char **error) {
+    bool inMemory = (strcmp(filename, MEMORY_DATABASE_NAME) == 0);
+    if (inMemory && (ioFlags & (PAGER_DIRECT_IO | PAGER_SHARED))) {
+        return pagerOpenFailed(-1, NULL, error, "Direct I/O and sharing need a database file");
+    }
+    if ((ioFlags & PAGER_SHARED_CACHE) && (ioFlags & PAGER_DIRECT_IO)) {
+        return pagerOpenFailed(-1, NULL, error,
+            "The shared page cache is the kernel's, so cannot be used with direct I/O");
+    }
+    int fd = inMemory ? -1 : open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+
+    if (fd == -1 && !inMemory) {
+        return pagerOpenFailed(-1, NULL, error, "Unable to open file");
+    }
+    if (!inMemory && !pagerOpenLock(fd, (ioFlags & PAGER_SHARED) != 0)) {
+        return pagerOpenFailed(fd, NULL, error, (ioFlags & PAGER_SHARED) ?
+            "Db file is open without --shared in another process" :
+            "Db file is open in another process, every process needs --shared");
+    }
+
+    // Locked before looking at the file, which another process may be in the middle of creating
+    SharedState *shared = NULL;
+    if ((ioFlags & PAGER_SHARED) && (shared = sharedOpen(filename, error)) == NULL) {
+        return pagerOpenFailed(fd, NULL, error, *error);
+    }
+
+    off_t fileLength = inMemory ? 0 : lseek(fd, 0, SEEK_END);
+
+    if (fileLength > 0) {
+        // The catalog header records the page size, read it before the first whole page
+        uint8_t header[CATALOG_HEADER_SIZE];
+        if (pread(fd, header, CATALOG_HEADER_SIZE, 0) != CATALOG_HEADER_SIZE || getNodeType(header) != CATALOG_NODE) {
+            return pagerOpenFailed(fd, shared, error, "Db file has no catalog. Corrupt file");
+        }
+        pageSize = *catalogPageSize(header);
+        if (pageSize < MIN_PAGE_SIZE || pageSize > MAX_PAGE_SIZE || (pageSize & (pageSize - 1)) != 0) {
+            return pagerOpenFailed(fd, shared, error, "Db file has an invalid page size. Corrupt file");
+        }
+        if (fileLength % pageSize != 0) {
+            return pagerOpenFailed(fd, shared, error, "Db file is not a whole number of pages. Corrupt file");
+        }
+
+        // Checked here so a bad catalog is an error for the caller rather than a failed getPage
+        uint8_t *catalog = malloc(pageSize);
+        bool valid = pread(fd, catalog, pageSize, 0) == (ssize_t)pageSize &&
+            *(uint32_t *)(catalog + NODE_CHECKSUM_OFFSET) == pageChecksum(catalog, pageSize);
+        free(catalog);
+        if (!valid) {
+            return pagerOpenFailed(fd, shared, error, "Checksum mismatch on the catalog page. Corrupt file");
+        }
+    }
+
+#ifdef O_DIRECT
+    // Switched on only now, the header read above is not aligned
+    if ((ioFlags & PAGER_DIRECT_IO) && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == -1) {
+        return pagerOpenFailed(fd, shared, error, "Direct I/O is not supported for this file");
+    }
+#else
+    if (ioFlags & PAGER_DIRECT_IO) {
+        return pagerOpenFailed(fd, shared, error, "Direct I/O is not supported on this platform");
+    }
+#endif
+
+    if (ioFlags & PAGER_SHARED_CACHE) {
+        // Address space for the largest file, so the mapping never moves as the file grows
+        shared->mapLength = (size_t)TABLE_MAX_PAGES * pageSize;
+        shared->pages = mmap(NULL, shared->mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (shared->pages == MAP_FAILED) {
+            shared->pages = NULL;
+            return pagerOpenFailed(fd, shared, error, "Unable to map the db file");
+        }
+    }
+
+    Pager *pager = malloc(sizeof(Pager));
+    pager->fileDescriptor = fd;
+    pager->fileName = malloc(strlen(filename) + 1);
+    strcpy(pager->fileName, filename);
+    pager->fileLength = fileLength;
+    pager->pageSize = pageSize;
+    pager->numPages = (fileLength / pageSize);
+    pager->directIo = (ioFlags & PAGER_DIRECT_IO) != 0;
+    pager->hugePages = (ioFlags & PAGER_HUGE_PAGES) != 0;
+    pager->inMemory = inMemory;
+    pager->shared = shared;
+    pager->frameChunks = NULL;
+    pager->numFrameChunks = 0;
+    pager->nextFrame = 0;
+    pager->freeFrames = NULL;
+    pager->frameShift = __builtin_ctz(FRAME_CHUNK_SIZE / pageSize);
+    pager->frames = NULL;
+    pager->framesCapacity = 0;
+    pager->swizzledFrames = NULL;
+    pager->numSwizzledFrames = 0;
+    pager->swizzledFramesCapacity = 0;
+    
+    pager->pagesCapacity = PAGER_INITIAL_CAPACITY;
+    while (pager->pagesCapacity < pager->numPages) {
+        pager->pagesCapacity *= 2;
+    }
+    pager->pages = calloc(pager->pagesCapacity, sizeof(void *));
+
+    return pager;
+}
+
+static void sharedFileLock(int fd, short type) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = SHARED_CHANGE_COUNTER_OFFSET;
+    lock.l_len = SHARED_CHANGE_COUNTER_SIZE;
+    while (fcntl(fd, F_SETLKW, &lock) == -1) {
+        if (errno != EINTR) {
+            printf("Error locking the shared lock file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static inline uint64_t *sharedChangeCounter(SharedState *shared) {
+    return (uint64_t *)(shared->lockFile + SHARED_CHANGE_COUNTER_OFFSET);
+}
+
+// Opens <db>.shm, creating it on first use, and returns holding the write lock. Every process with
+// the database open shared maps the same file, and readers and writers lock its change counter.
+// Returns NULL with error set if the lock file is unusable.
+SharedState *sharedOpen(char *fileName, const char **error) {
+    char *lockFileName = malloc(strlen(fileName) + strlen(SHARED_SUFFIX) + 1);
+    strcpy(lockFileName, fileName);
+    strcat(lockFileName, SHARED_SUFFIX);
+    int fd = open(lockFileName, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    free(lockFileName);
+    if (fd == -1) {
+        *error = "Unable to open the shared lock file";
+        return NULL;
+    }
+
+    sharedFileLock(fd, F_WRLCK);
+    struct stat lockFileStat;
+    void *lockFile = MAP_FAILED;
+    if (fstat(fd, &lockFileStat) == -1 ||
+        (lockFileStat.st_size < SHARED_FILE_SIZE && ftruncate(fd, SHARED_FILE_SIZE) == -1) ||
+        (lockFile = mmap(NULL, SHARED_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        *error = "Unable to map the shared lock file";
+        return NULL;
+    }
+
+    SharedState *shared = malloc(sizeof(SharedState));
+    shared->fileDescriptor = fd;
+    shared->lockFile = lockFile;
+    shared->changeCounter = *sharedChangeCounter(shared);
+    shared->pages = NULL;
+    shared->mapLength = 0;
+    shared->writing = true;
+    shared->written = NULL;
+    shared->numWritten = 0;
+    shared->writtenCapacity = 0;
+    return shared;
+}
+
+void sharedClose(SharedState *shared) {
+    if (shared->pages != NULL) {
+        munmap(shared->pages, shared->mapLength);
+    }
+    munmap(shared->lockFile, SHARED_FILE_SIZE);
+    close(shared->fileDescriptor);
+    free(shared->written);
+    free(shared);
+}
+
+// Takes the read lock, or the write lock to write, on a shared database. Returns true if another
+// process wrote since this one last held it, in which case the cache has been dropped.
+bool pagerLock(Pager *pager, bool write) {
+    SharedState *shared = pager->shared;
+    sharedFileLock(shared->fileDescriptor, write ? F_WRLCK : F_RDLCK);
+    shared->writing = write;
+
+    uint64_t changeCounter = *sharedChangeCounter(shared);
+    if (changeCounter == shared->changeCounter) {
+        return false;
+    }
+    shared->changeCounter = changeCounter;
+    pagerDropCache(pager);
+    return true;
+}
+
+// Publishes what a write changed before letting the other processes in
+void pagerUnlock(Pager *pager, bool write) {
+    SharedState *shared = pager->shared;
+    if (write && pagerCommit(pager)) {
+        shared->changeCounter = ++*sharedChangeCounter(shared);
+    }
+    shared->writing = false;
+    shared->numWritten = 0;
+    sharedFileLock(shared->fileDescriptor, F_UNLCK);
+}
+
+static int comparePageNums(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Writes out the pages a write changed, told apart from the ones it only read by their checksums as
+// replication does. With the shared cache they are already in the file and only need the checksums.
+bool pagerCommit(Pager *pager) {
+    SharedState *shared = pager->shared;
+    bool changed = false;
+    qsort(shared->written, shared->numWritten, sizeof(uint32_t), comparePageNums);
+    for (uint32_t n = 0; n < shared->numWritten; n++) {
+        uint32_t i = shared->written[n];
+        if (n > 0 && i == shared->written[n - 1]) {
+            continue;
+        }
+        void *page = pager->pages[i];
+        uint32_t checksum = pageChecksum(page, pager->pageSize);
+        if (*(uint32_t *)((uint8_t *)page + NODE_CHECKSUM_OFFSET) == checksum) {
+            continue;
+        }
+
+        changed = true;
+        if (shared->pages != NULL) {
+            *(uint32_t *)((uint8_t *)page + NODE_CHECKSUM_OFFSET) = checksum;
+        } else {
+            pagerFlush(pager, i);
+        }
+    }
+
+    if (pager->fileLength < (off_t)pager->numPages * pager->pageSize) {
+        pager->fileLength = (off_t)pager->numPages * pager->pageSize;
+    }
+    return changed;
+}
+
+// Forgets every page another process may have changed. Shared cache pages are the file itself, so only
+// the length needs reading again.
+void pagerDropCache(Pager *pager) {
+    if (pager->shared->pages == NULL) {
+        for (uint32_t i = 0; i < pager->numPages; i++) {
+            if (pager->pages[i] != NULL) {
+                pagerFreeFrame(pager, pager->pages[i]);
+                pager->pages[i] = NULL;
+            }
+        }
+    }
+
+    pager->fileLength = lseek(pager->fileDescriptor, 0, SEEK_END);
+    pager->numPages = pager->fileLength / pager->pageSize;
+    pagerReserve(pager, pager->numPages);
+}
+
+// Locks a shared database for one command. The current table is opened again if the cache was dropped,
+// as another process may have moved its root or dropped it.
+void sharedBegin(Database *database, bool write) {
+    if (database->pager->shared != NULL && pagerLock(database->pager, write)) {
+        reopenCurrentTable(database);
+    }
+}
+
+void sharedEnd(Database *database, bool write) {
+    if (database->pager->shared != NULL) {
+        pagerUnlock(database->pager, write);
+    }
+}
+
+// Reads the current table from the catalog again, falling back to the first table if it has gone
+void reopenCurrentTable(Database *database) {
+    Table *table = NULL;
+    void *catalog = getPage(database->pager, CATALOG_PAGE_NUM);
+    if (database->currentTable != NULL && catalogFindTable(database->pager, database->currentTable->name) != -1) {
+        table = tableOpen(database->pager, database->currentTable->name);
+    } else if (*catalogNumTables(catalog) > 0) {
+        table = tableOpen(database->pager, catalogTableName(catalog, 0));
+    }
+    tableClose(database->currentTable);
+    database->currentTable = table;
+}
+
+// Records the pages currently cached, internal nodes first, so the next open can load them up front.
+// The file is only a hint: a missing or stale one costs nothing but the prefetch.
+void saveHotPages(Pager *pager, char *fileName) {
+    uint8_t *buffer = malloc(HOT_PAGES_HEADER_SIZE + HOT_PAGES_MAX * sizeof(uint32_t));
+    uint32_t *hotPages = (uint32_t *)(buffer + HOT_PAGES_HEADER_SIZE);
+    uint32_t numHotPages = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < pager->numPages && numHotPages < HOT_PAGES_MAX; i++) {
+            if (pager->pages[i] == NULL) {
+                continue;
+            }
+            NodeType type = getNodeType(pager->pages[i]);
+            bool isInternal = (type == INTERNAL_NODE || type == CATALOG_NODE);
+            if ((pass == 0 && isInternal) || (pass == 1 && type == LEAF_NODE)) {
+                hotPages[numHotPages++] = i;
+            }
+        }
+    }
+
+    *(uint32_t *)(buffer + HOT_PAGES_MAGIC_OFFSET) = HOT_PAGES_MAGIC;
+    *(uint32_t *)(buffer + HOT_PAGES_PAGE_SIZE_OFFSET) = pager->pageSize;
+    *(uint32_t *)(buffer + HOT_PAGES_NUM_PAGES_OFFSET) = numHotPages;
+
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd != -1) {
+        size_t length = HOT_PAGES_HEADER_SIZE + numHotPages * sizeof(uint32_t);
+        if (write(fd, buffer, length) != (ssize_t)length) {
+            unlink(fileName);
+        }
+        close(fd);
+    }
+    free(buffer);
+}
+
+static void *warmStartWorker(void *arg) {
+    WarmStart *warm = arg;
+    Pager *pager = warm->pager;
+    struct iovec iov[WARM_START_MAX_RUN];
+
+    while (true) {
+        uint32_t runNum = __atomic_fetch_add(&warm->nextRun, 1, __ATOMIC_RELAXED);
+        if (runNum >= warm->numRuns) {
+            break;
+        }
+        WarmStartRun *run = &warm->runs[runNum];
+        uint32_t firstPageNum = warm->pageNums[run->firstPage];
+
+        for (uint32_t i = 0; i < run->numPages; i++) {
+            iov[i].iov_base = warm->frames[run->firstPage + i];
+            iov[i].iov_len = pager->pageSize;
+        }
+
+        ssize_t bytesRead = preadv(pager->fileDescriptor, iov, run->numPages, (off_t)firstPageNum * pager->pageSize);
+        for (uint32_t i = 0; i < run->numPages; i++) {
+            void *page = iov[i].iov_base;
+            // Anything short or failing its checksum is left for getPage to read and report
+            if (bytesRead >= (ssize_t)(i + 1) * pager->pageSize &&
+                *(uint32_t *)((uint8_t *)page + NODE_CHECKSUM_OFFSET) == pageChecksum(page, pager->pageSize)) {
+                pager->pages[firstPageNum + i] = page;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Loads the pages listed by saveHotPages. Consecutive pages are read with one preadv and runs are
+// spread over a few threads. Internal nodes come first in the file so they are read first.
+void warmStart(Pager *pager, char *fileName) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    uint8_t header[HOT_PAGES_HEADER_SIZE];
+    uint32_t numHotPages = 0;
+    if (read(fd, header, HOT_PAGES_HEADER_SIZE) == HOT_PAGES_HEADER_SIZE &&
+        *(uint32_t *)(header + HOT_PAGES_MAGIC_OFFSET) == HOT_PAGES_MAGIC &&
+        *(uint32_t *)(header + HOT_PAGES_PAGE_SIZE_OFFSET) == pager->pageSize) {
+        numHotPages = *(uint32_t *)(header + HOT_PAGES_NUM_PAGES_OFFSET);
+    }
+    if (numHotPages == 0 || numHotPages > HOT_PAGES_MAX) {
+        close(fd);
+        return;
+    }
+
+    uint32_t *pageNums = malloc(numHotPages * sizeof(uint32_t));
+    ssize_t length = numHotPages * sizeof(uint32_t);
+    if (read(fd, pageNums, length) != length) {
+        free(pageNums);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    WarmStart warm;
+    warm.pager = pager;
+    warm.pageNums = pageNums;
+    warm.frames = calloc(numHotPages, sizeof(void *));
+    warm.runs = malloc(numHotPages * sizeof(WarmStartRun));
+    warm.numRuns = 0;
+    warm.nextRun = 0;
+
+    // Frames are handed out here, the pool is not shared with the worker threads
+    pagerReserve(pager, pager->numPages);
+    for (uint32_t i = 0; i < numHotPages; i++) {
+        if (pageNums[i] >= pager->numPages || pager->pages[pageNums[i]] != NULL) {
+            continue;
+        }
+        warm.frames[i] = pagerAllocFrame(pager);
+        WarmStartRun *last = (warm.numRuns > 0) ? &warm.runs[warm.numRuns - 1] : NULL;
+        if (last != NULL && last->firstPage + last->numPages == i && last->numPages < WARM_START_MAX_RUN &&
+            pageNums[i] == pageNums[i - 1] + 1) {
+            last->numPages++;
+        } else {
+            warm.runs[warm.numRuns].firstPage = i;
+            warm.runs[warm.numRuns].numPages = 1;
+            warm.numRuns++;
+        }
+    }
+
+    uint32_t numThreads = warm.numRuns < WARM_START_THREADS ? warm.numRuns : WARM_START_THREADS;
+    pthread_t threads[WARM_START_THREADS];
+    for (uint32_t i = 0; i < numThreads; i++) {
+        pthread_create(&threads[i], NULL, warmStartWorker, &warm);
+    }
+    for (uint32_t i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (uint32_t i = 0; i < numHotPages; i++) {
+        if (warm.frames[i] != NULL && pager->pages[pageNums[i]] != warm.frames[i]) {
+            pagerFreeFrame(pager, warm.frames[i]);
+        }
+    }
+
+    free(warm.frames);
+    free(warm.runs);
+    free(pageNums);
+}
+
+static uint64_t replicationNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Appends one record holding the given page images. The follower only applies whole records, so a
+// record is the unit of consistency.
+static void replicationWriteRecord(Replication *replication, uint32_t pageSize, uint32_t *pageNums, void **pages,
+    uint32_t numPages) {
+    uint8_t header[REPLICATION_RECORD_HEADER_SIZE];
+    replication->lsn++;
+    *(uint32_t *)(header + REPLICATION_RECORD_MAGIC_OFFSET) = REPLICATION_RECORD_MAGIC;
+    *(uint32_t *)(header + REPLICATION_RECORD_NUM_PAGES_OFFSET) = numPages;
+    *(uint64_t *)(header + REPLICATION_RECORD_LSN_OFFSET) = replication->lsn;
+    *(uint64_t *)(header + REPLICATION_RECORD_TIMESTAMP_OFFSET) = replicationNow();
+
+    struct iovec iov[REPLICATION_MAX_IOV];
+    uint32_t numIov = 0;
+    ssize_t length = REPLICATION_RECORD_HEADER_SIZE;
+    iov[numIov].iov_base = header;
+    iov[numIov].iov_len = REPLICATION_RECORD_HEADER_SIZE;
+    numIov++;
+
+    for (uint32_t i = 0; i <= numPages; i++) {
+        if (i == numPages || numIov + 2 > REPLICATION_MAX_IOV) {
+            if (writev(replication->fileDescriptor, iov, numIov) != length) {
+                printf("Error writing replication log: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            numIov = 0;
+            length = 0;
+        }
+        if (i == numPages) {
+            break;
+        }
+
+        iov[numIov].iov_base = &pageNums[i];
+        iov[numIov].iov_len = REPLICATION_PAGE_NUM_SIZE;
+        iov[numIov + 1].iov_base = pages[i];
+        iov[numIov + 1].iov_len = pageSize;
+        numIov += 2;
+        length += REPLICATION_PAGE_NUM_SIZE + pageSize;
+    }
+}
+
+// Starts a new log next to the database, beginning with an image of every page
+void replicationLeaderStart(Database *database, char *logFileName) {
+    Pager *pager = database->pager;
+    Replication *replication = calloc(1, sizeof(Replication));
+    pagerUnswizzle(pager);
+    replication->isLeader = true;
+    replication->generation = replicationNow();
+    pthread_mutex_init(&replication->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &replication->lastShip);
+
+    replication->fileDescriptor = open(logFileName, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IWUSR | S_IRUSR);
+    if (replication->fileDescriptor == -1) {
+        printf("Unable to open replication log %s\n", logFileName);
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t header[REPLICATION_LOG_HEADER_SIZE];
+    *(uint32_t *)(header + REPLICATION_LOG_MAGIC_OFFSET) = REPLICATION_LOG_MAGIC;
+    *(uint32_t *)(header + REPLICATION_LOG_PAGE_SIZE_OFFSET) = pager->pageSize;
+    *(uint64_t *)(header + REPLICATION_LOG_GENERATION_OFFSET) = replication->generation;
+    if (write(replication->fileDescriptor, header, REPLICATION_LOG_HEADER_SIZE) != REPLICATION_LOG_HEADER_SIZE) {
+        printf("Error writing replication log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    // Cached pages go out as they are, the rest straight from the file without filling the cache
+    uint32_t pageNums[REPLICATION_BASE_BATCH];
+    void *pages[REPLICATION_BASE_BATCH];
+    uint8_t *buffer = pageBufferAlloc((size_t)REPLICATION_BASE_BATCH * pager->pageSize);
+    uint32_t numPagesInFile = pager->fileLength / pager->pageSize;
+
+    for (uint32_t first = 0; first < pager->numPages; first += REPLICATION_BASE_BATCH) {
+        uint32_t numPages = 0;
+        for (uint32_t pageNum = first; pageNum < pager->numPages && numPages < REPLICATION_BASE_BATCH; pageNum++) {
+            void *page;
+            if (pageNum < pager->pagesCapacity && pager->pages[pageNum] != NULL) {
+                page = pager->pages[pageNum];
+                *(uint32_t *)((uint8_t *)page + NODE_CHECKSUM_OFFSET) = pageChecksum(page, pager->pageSize);
+            } else if (pageNum < numPagesInFile) {
+                page = buffer + (size_t)numPages * pager->pageSize;
+                if (pread(pager->fileDescriptor, page, pager->pageSize, (off_t)pageNum * pager->pageSize) !=
+                    pager->pageSize) {
+                    printf("Error reading file: %d\n", errno);
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                continue;
+            }
+            pageNums[numPages] = pageNum;
+            pages[numPages] = page;
+            numPages++;
+        }
+        replicationWriteRecord(replication, pager->pageSize, pageNums, pages, numPages);
+    }
+    free(buffer);
+
+    database->replication = replication;
+}
+
+// Ships every cached page whose contents no longer match its stored checksum, which is exactly the
+// set changed since it was read, flushed or last shipped
+void replicationShip(Database *database) {
+    Replication *replication = database->replication;
+    Pager *pager = database->pager;
+    uint32_t capacity = 64;
+    uint32_t numPages = 0;
+    uint32_t *pageNums = malloc(capacity * sizeof(uint32_t));
+    void **pages = malloc(capacity * sizeof(void *));
+    // Swizzled slots would both ship as frame indexes and make every page read since look changed
+    pagerUnswizzle(pager);
+
+    for (uint32_t i = 0; i < pager->numPages; i++) {
+        void *page = pager->pages[i];
+        if (page == NULL) {
+            continue;
+        }
+        uint32_t checksum = pageChecksum(page, pager->pageSize);
+        if (*(uint32_t *)((uint8_t *)page + NODE_CHECKSUM_OFFSET) == checksum) {
+            continue;
+        }
+        *(uint32_t *)((uint8_t *)page + NODE_CHECKSUM_OFFSET) = checksum;
+
+        if (numPages == capacity) {
+            capacity *= 2;
+            pageNums = realloc(pageNums, capacity * sizeof(uint32_t));
+            pages = realloc(pages, capacity * sizeof(void *));
+        }
+        pageNums[numPages] = i;
+        pages[numPages] = page;
+        numPages++;
+    }
+
+    if (numPages > 0) {
+        replicationWriteRecord(replication, pager->pageSize, pageNums, pages, numPages);
+    }
+    free(pageNums);
+    free(pages);
+
+    replication->pending = false;
+    clock_gettime(CLOCK_MONOTONIC, &replication->lastShip);
+}
+
+// Called after a write command. Ships at most every REPLICATION_INTERVAL_MS while commands keep coming.
+void replicationCommit(Database *database) {
+    Replication *replication = database->replication;
+    if (replication == NULL || !replication->isLeader) {
+        return;
+    }
+
+    replication->pending = true;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsedMs = (now.tv_sec - replication->lastShip.tv_sec) * 1000 +
+        (now.tv_nsec - replication->lastShip.tv_nsec) / 1000000;
+    if (elapsedMs >= REPLICATION_INTERVAL_MS) {
+        replicationShip(database);
+    }
+}
+
+void replicationIdle(Database *database) {
+    Replication *replication = database->replication;
+    if (replication != NULL && replication->isLeader && replication->pending) {
+        replicationShip(database);
+    }
+}
+
+// Applies the next whole record in the log, returns false if there is none yet
+static bool replicationApply(Database *database) {
+    Replication *replication = database->replication;
+    Pager *pager = database->pager;
+    struct stat logStat;
+    uint8_t header[REPLICATION_LOG_HEADER_SIZE];
+
+    if (fstat(replication->fileDescriptor, &logStat) == -1 ||
+        pread(replication->fileDescriptor, header, REPLICATION_LOG_HEADER_SIZE, 0) != REPLICATION_LOG_HEADER_SIZE ||
+        *(uint32_t *)(header + REPLICATION_LOG_MAGIC_OFFSET) != REPLICATION_LOG_MAGIC) {
+        return false;
+    }
+    if (*(uint32_t *)(header + REPLICATION_LOG_PAGE_SIZE_OFFSET) != pager->pageSize) {
+        printf("Replication log page size %d does not match %d, stopping replication\n",
+            *(uint32_t *)(header + REPLICATION_LOG_PAGE_SIZE_OFFSET), pager->pageSize);
+        replication->stop = true;
+        return false;
+    }
+
+    // A new generation means the leader restarted and the log starts over with a full image
+    uint64_t generation = *(uint64_t *)(header + REPLICATION_LOG_GENERATION_OFFSET);
+    if (generation != replication->generation || logStat.st_size < replication->offset) {
+        pthread_mutex_lock(&replication->lock);
+        replication->generation = generation;
+        replication->offset = REPLICATION_LOG_HEADER_SIZE;
+        pthread_mutex_unlock(&replication->lock);
+    }
+
+    uint8_t recordHeader[REPLICATION_RECORD_HEADER_SIZE];
+    if (logStat.st_size < replication->offset + (off_t)REPLICATION_RECORD_HEADER_SIZE ||
+        pread(replication->fileDescriptor, recordHeader, REPLICATION_RECORD_HEADER_SIZE, replication->offset) !=
+        REPLICATION_RECORD_HEADER_SIZE) {
+        return false;
+    }
+    if (*(uint32_t *)(recordHeader + REPLICATION_RECORD_MAGIC_OFFSET) != REPLICATION_RECORD_MAGIC) {
+        printf("Replication log corrupt at offset %lld, stopping replication\n", (long long)replication->offset);
+        replication->stop = true;
+        return false;
+    }
+
+    uint32_t numPages = *(uint32_t *)(recordHeader + REPLICATION_RECORD_NUM_PAGES_OFFSET);
+    size_t entrySize = REPLICATION_PAGE_NUM_SIZE + pager->pageSize;
+    size_t bodySize = (size_t)numPages * entrySize;
+    if (logStat.st_size < replication->offset + (off_t)(REPLICATION_RECORD_HEADER_SIZE + bodySize)) {
+        return false;
+    }
+
+    uint8_t *body = malloc(bodySize > 0 ? bodySize : 1);
+    if (pread(replication->fileDescriptor, body, bodySize, replication->offset + REPLICATION_RECORD_HEADER_SIZE) !=
+        (ssize_t)bodySize) {
+        free(body);
+        return false;
+    }
+    for (uint32_t i = 0; i < numPages; i++) {
+        uint8_t *page = body + i * entrySize + REPLICATION_PAGE_NUM_SIZE;
+        if (*(uint32_t *)(page + NODE_CHECKSUM_OFFSET) != pageChecksum(page, pager->pageSize)) {
+            printf("Replication log corrupt at offset %lld, stopping replication\n", (long long)replication->offset);
+            replication->stop = true;
+            free(body);
+            return false;
+        }
+    }
+
+    pthread_mutex_lock(&replication->lock);
+    for (uint32_t i = 0; i < numPages; i++) {
+        uint32_t pageNum = *(uint32_t *)(body + i * entrySize);
+        pagerReserve(pager, pageNum);
+        if (pager->pages[pageNum] == NULL) {
+            pager->pages[pageNum] = pagerAllocFrame(pager);
+        }
+        memcpy(pager->pages[pageNum], body + i * entrySize + REPLICATION_PAGE_NUM_SIZE, pager->pageSize);
+        if (pageNum >= pager->numPages) {
+            pager->numPages = pageNum + 1;
+        }
+    }
+
+    // Roots move when tables are created, dropped or rebuilt. Otherwise the table stays open and only
+    // forgets what it cached from pages that may have changed.
+    Table *table = database->currentTable;
+    if (table != NULL && tableCatalogUnchanged(table)) {
+        table->rightmostLeafPageNum = INVALID_PAGE_NUM;
+        if (table->engine == ENGINE_HASH) {
+            free(table->hashBuckets);
+            hashTableLoad(table);
+        }
+    } else {
+        char name[CATALOG_TABLE_NAME_SIZE];
+        snprintf(name, sizeof(name), "%s", table != NULL ? table->name : "");
+        tableClose(table);
+        database->currentTable = NULL;
+
+        void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+        if (name[0] != '\0') {
+            database->currentTable = tableOpen(pager, name);
+        } else if (*catalogNumTables(catalog) > 0) {
+            database->currentTable = tableOpen(pager, catalogTableName(catalog, 0));
+        }
+    }
+
+    replication->lsn = *(uint64_t *)(recordHeader + REPLICATION_RECORD_LSN_OFFSET);
+    replication->offset += REPLICATION_RECORD_HEADER_SIZE + bodySize;
+    pthread_mutex_unlock(&replication->lock);
+
+    free(body);
+    return true;
+}
+
+static void *replicationFollow(void *arg) {
+    Database *database = arg;
+    Replication *replication = database->replication;
+
+    while (!__atomic_load_n(&replication->stop, __ATOMIC_RELAXED)) {
+        if (!replicationApply(database)) {
+            usleep(REPLICATION_POLL_MS * 1000);
+        }
+    }
+
+    return NULL;
+}
+
+// Tails a leader's log from the start in a background thread, this database becomes read-only
+void replicationFollowerStart(Database *database, char *logFileName) {
+    Replication *replication = calloc(1, sizeof(Replication));
+    replication->isLeader = false;
+    pthread_mutex_init(&replication->lock, NULL);
+
+    replication->fileDescriptor = open(logFileName, O_RDONLY | O_CREAT, S_IWUSR | S_IRUSR);
+    if (replication->fileDescriptor == -1) {
+        printf("Unable to open replication log %s\n", logFileName);
+        exit(EXIT_FAILURE);
+    }
+
+    database->replication = replication;
+    pthread_create(&replication->thread, NULL, replicationFollow, database);
+}
+
+void replicationClose(Database *database) {
+    Replication *replication = database->replication;
+    if (replication == NULL) {
+        return;
+    }
+
+    if (replication->isLeader) {
+        replicationShip(database);
+    } else {
+        __atomic_store_n(&replication->stop, true, __ATOMIC_RELAXED);
+        pthread_join(replication->thread, NULL);
+    }
+
+    close(replication->fileDescriptor);
+    pthread_mutex_destroy(&replication->lock);
+    free(replication);
+    database->replication = NULL;
+}
+
+void printReplicationStatus(Database *database) {
+    Replication *replication = database->replication;
+    if (replication == NULL) {
+        printf("Replication is off\n");
+        return;
+    }
+
+    struct stat logStat;
+    fstat(replication->fileDescriptor, &logStat);
+    if (replication->isLeader) {
+        printf("Leader at lsn %llu, log is %lld bytes\n", (unsigned long long)replication->lsn,
+            (long long)logStat.st_size);
+        return;
+    }
+
+    // Lag is the age of the oldest record not yet applied
+    double lagMs = 0;
+    uint8_t recordHeader[REPLICATION_RECORD_HEADER_SIZE];
+    if (logStat.st_size > replication->offset &&
+        pread(replication->fileDescriptor, recordHeader, REPLICATION_RECORD_HEADER_SIZE, replication->offset) ==
+        REPLICATION_RECORD_HEADER_SIZE) {
+        lagMs = (replicationNow() - *(uint64_t *)(recordHeader + REPLICATION_RECORD_TIMESTAMP_OFFSET)) / 1e6;
+    }
+    printf("Follower at lsn %llu, %lld bytes and %.1f ms behind%s\n", (unsigned long long)replication->lsn,
+        (long long)(logStat.st_size - replication->offset), lagMs, replication->stop ? ", stopped" : "");
+}
+
+// Snapshots the database into path from a forked child. Copy-on-write keeps the child's view of the
+// cache as it was at the fork while the parent goes on taking commands. The file itself is only
+// written at close, which waits for the backup, so uncached pages read from it are consistent too.
+void doBackup(Database *database) {
+    char *path = strtok(NULL, " ");
+    if (path == NULL) {
+        printf("Backup path missing\n");
+        return;
+    }
+
+    if (database->backupPid != 0) {
+        printf("Backup to %s is still running\n", database->backupPath);
+        return;
+    }
+    // The child would read the file without holding the lock
+    if (database->pager->shared != NULL) {
+        printf("Shared databases are backed up with 'save'\n");
+        return;
+    }
+    if (catalogHasLsmTables(database->pager)) {
+        printf("Lsm tables keep their rows outside the db file, so cannot be backed up\n");
+        return;
+    }
+
+    // Anything still buffered would be written a second time by the child
+    fflush(stdout);
+    pagerUnswizzle(database->pager);
+    pid_t pid = fork();
+    if (pid == -1) {
+        printf("Unable to start backup: %d\n", errno);
+        return;
+    }
+    if (pid == 0) {
+        _exit(backupWrite(database->pager, path) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    database->backupPid = pid;
+    database->backupPath = malloc(strlen(path) + 1);
+    strcpy(database->backupPath, path);
+    printf("Backup to %s started\n", path);
+}
+
+// Writes every page to a temporary file next to path and renames it into place once it is synced
+bool backupWrite(Pager *pager, char *path) {
+    char *tempPath = malloc(strlen(path) + strlen(BACKUP_TEMP_SUFFIX) + 1);
+    strcpy(tempPath, path);
+    strcat(tempPath, BACKUP_TEMP_SUFFIX);
+
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        free(tempPath);
+        return false;
+    }
+
+    uint8_t *buffer = pageBufferAlloc((size_t)BACKUP_BATCH * pager->pageSize);
+    bool ok = true;
+    for (uint32_t first = 0; ok && first < pager->numPages; first += BACKUP_BATCH) {
+        uint32_t numPages = 0;
+        for (uint32_t pageNum = first; pageNum < pager->numPages && numPages < BACKUP_BATCH; pageNum++) {
+            uint8_t *page = buffer + (size_t)numPages * pager->pageSize;
+            if (pageNum < pager->pagesCapacity && pager->pages[pageNum] != NULL) {
+                // Checksummed in the copy, touching the cached page would only cost a page fault
+                memcpy(page, pager->pages[pageNum], pager->pageSize);
+                *(uint32_t *)(page + NODE_CHECKSUM_OFFSET) = pageChecksum(page, pager->pageSize);
+            } else if (pager->inMemory) {
+                memset(page, 0, pager->pageSize);
+                *(uint32_t *)(page + NODE_CHECKSUM_OFFSET) = pageChecksum(page, pager->pageSize);
+            } else if (pread(pager->fileDescriptor, page, pager->pageSize, (off_t)pageNum * pager->pageSize) !=
+                pager->pageSize) {
+                ok = false;
+                break;
+            }
+            numPages++;
+        }
+
+        size_t length = (size_t)numPages * pager->pageSize;
+        if (ok && write(fd, buffer, length) != (ssize_t)length) {
+            ok = false;
+        }
+    }
+    free(buffer);
+
+    if (ok && fsync(fd) == -1) {
+        ok = false;
+    }
+    close(fd);
+
+    if (ok && rename(tempPath, path) == -1) {
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tempPath);
+    }
+    free(tempPath);
+    return ok;
+}
+
+// Handles 'save <path>'. Unlike backup it finishes before returning, and works the same without a file.
+void doSave(Database *database) {
+    char *path = strtok(NULL, " ");
+    if (path == NULL) {
+        printf("Save path missing\n");
+        return;
+    }
+
+    pagerUnswizzle(database->pager);
+    if (!backupWrite(database->pager, path)) {
+        printf("Unable to save to %s\n", path);
+        return;
+    }
+    printf("Saved %u pages to %s\n", database->pager->numPages, path);
+}
+
+// Handles 'load <path>', replacing every table of an in-memory database with those in a saved file
+void doLoad(Database *database) {
+    char *path = strtok(NULL, " ");
+    if (path == NULL) {
+        printf("Load path missing\n");
+        return;
+    }
+    if (!database->pager->inMemory) {
+        printf("Only %s databases can be loaded into\n", MEMORY_DATABASE_NAME);
+        return;
+    }
+    if (!pagerLoad(database->pager, path)) {
+        return;
+    }
+
+    // Roots are wherever the saved catalog says
+    reopenCurrentTable(database);
+    printf("Loaded %u pages from %s\n", database->pager->numPages, path);
+}
+
+// Reads a saved database front to back into fresh frames. The current pages are only dropped once the
+// whole file has checked out.
+bool pagerLoad(Pager *pager, char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("Unable to open %s\n", path);
+        return false;
+    }
+
+    struct stat fileStat;
+    uint8_t header[CATALOG_HEADER_SIZE];
+    if (fstat(fd, &fileStat) == -1 || pread(fd, header, CATALOG_HEADER_SIZE, 0) != CATALOG_HEADER_SIZE ||
+        getNodeType(header) != CATALOG_NODE) {
+        printf("%s has no catalog\n", path);
+        close(fd);
+        return false;
+    }
+    if (*catalogPageSize(header) != pager->pageSize || fileStat.st_size % pager->pageSize != 0) {
+        printf("%s has page size %d, this database uses %d\n", path, *catalogPageSize(header), pager->pageSize);
+        close(fd);
+        return false;
+    }
+
+    uint32_t numPages = fileStat.st_size / pager->pageSize;
+    uint32_t capacity = PAGER_INITIAL_CAPACITY;
+    while (capacity < numPages) {
+        capacity *= 2;
+    }
+    void **pages = calloc(capacity, sizeof(void *));
+    uint8_t *buffer = pageBufferAlloc((size_t)BACKUP_BATCH * pager->pageSize);
+    bool ok = true;
+    for (uint32_t first = 0; ok && first < numPages; first += BACKUP_BATCH) {
+        uint32_t numRead = (numPages - first < BACKUP_BATCH) ? numPages - first : BACKUP_BATCH;
+        size_t length = (size_t)numRead * pager->pageSize;
+        if (pread(fd, buffer, length, (off_t)first * pager->pageSize) != (ssize_t)length) {
+            ok = false;
+            break;
+        }
+
+        for (uint32_t i = 0; i < numRead; i++) {
+            uint8_t *page = buffer + (size_t)i * pager->pageSize;
+            uint32_t checksum = pageChecksum(page, pager->pageSize);
+            if (*(uint32_t *)(page + NODE_CHECKSUM_OFFSET) != checksum) {
+                printf("Checksum mismatch on page %d of %s\n", first + i, path);
+                ok = false;
+                break;
+            }
+            // Loaded pages have to read as changed, or a leader would never ship them
+            *(uint32_t *)(page + NODE_CHECKSUM_OFFSET) = ~checksum;
+            pages[first + i] = pagerAllocFrame(pager);
+            memcpy(pages[first + i], page, pager->pageSize);
+        }
+    }
+    free(buffer);
+    close(fd);
+
+    void **dropped = ok ? pager->pages : pages;
+    uint32_t numDropped = ok ? pager->numPages : numPages;
+    if (ok) {
+        pagerUnswizzle(pager);
+        pager->pages = pages;
+        pager->pagesCapacity = capacity;
+        pager->numPages = numPages;
+    } else {
+        printf("Unable to load %s\n", path);
+    }
+    for (uint32_t i = 0; i < numDropped; i++) {
+        if (dropped[i] != NULL) {
+            pagerFreeFrame(pager, dropped[i]);
+        }
+    }
+    free(dropped);
+    return ok;
+}
+
+// Reaps a finished backup and reports how it went, optionally waiting for it
+void backupPoll(Database *database, bool wait) {
+    if (database->backupPid == 0) {
+        return;
+    }
+
+    int status;
+    pid_t result = waitpid(database->backupPid, &status, wait ? 0 : WNOHANG);
+    if (result == 0) {
+        return;
+    }
+
+    if (result == database->backupPid && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+        printf("Backup to %s finished\n", database->backupPath);
+    } else {
+        printf("Backup to %s failed\n", database->backupPath);
+    }
+    database->backupPid = 0;
+    free(database->backupPath);
+    database->backupPath = NULL;
+}
+
+void pagerFlush(Pager* pager, uint32_t pageNum) {
+    SPAN(pagerFlush, "page", pageNum);
+    if (pager->pages[pageNum] == NULL) {
+        printf("Tried to flush null page\n");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t offset = lseek(pager->fileDescriptor, (off_t)pageNum * pager->pageSize, SEEK_SET);
+    if (offset == -1) {
+        printf("Error seeking: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    *(uint32_t *)((uint8_t *)pager->pages[pageNum] + NODE_CHECKSUM_OFFSET) =
+        pageChecksum(pager->pages[pageNum], pager->pageSize);
+    ssize_t bytesWritten = write(pager->fileDescriptor, pager->pages[pageNum], pager->pageSize);
+
+    if (bytesWritten == -1) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+  }
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, size_t length) {
+    uint64_t crc64 = crc;
+    while (length >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        data += sizeof(word);
+        length -= sizeof(word);
+    }
+    crc = (uint32_t)crc64;
+    while (length-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    }
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += sizeof(word);
+        length -= sizeof(word);
+    }
+    while (length-- > 0) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+static uint32_t crc32cTable[256];
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+static bool crc32cHasHardware = false;
+#endif
+
+// Run once before the first checksum, integrity checks compute them from several threads at a time
+static void crc32cInit(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t entry = i;
+        for (int bit = 0; bit < 8; bit++) {
+            entry = (entry >> 1) ^ (0x82F63B78 & (0 - (entry & 1)));
+        }
+        crc32cTable[i] = entry;
+    }
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    crc32cHasHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32cSoftware(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length-- > 0) {
+        crc = crc32cTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// CRC32C (Castagnoli) of data continuing from crc, using the CPU instruction when there is one
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc32cOnce, crc32cInit);
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    if (crc32cHasHardware) {
+        return crc32cHardware(crc, data, length);
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    return crc32cHardware(crc, data, length);
+#endif
+    return crc32cSoftware(crc, data, length);
+}
+
+// Checksum of a whole page, skipping the checksum field itself
+uint32_t pageChecksum(void *page, uint32_t pageSize) {
+    uint32_t crc = crc32c(UINT32_MAX, page, NODE_CHECKSUM_OFFSET);
+    crc = crc32c(crc, (uint8_t *)page + NODE_CHECKSUM_OFFSET + NODE_CHECKSUM_SIZE,
+        pageSize - NODE_CHECKSUM_OFFSET - NODE_CHECKSUM_SIZE);
+    return ~crc;
+}
+
+void printTable(Table *table, OutputBuffer *outputBuffer, uint32_t pageNum) {
+    void *node = getPage(table->pager, pageNum);
+    NodeType type = getNodeType(node);
+
+    if (type == LEAF_NODE) {
+        uint32_t numCells = *leafNodenumCells(node);
+        for (uint32_t i = 0; i < numCells; i++) {
+            Row row;
+            void *value = leafNodeValue(node, i);
+            deserialiseRow(value, &row);
+            printRow(outputBuffer, &row);
+        }
+    } else if (type == INTERNAL_NODE) {
+        uint32_t numKeys = *internalNodeNumKeys(node);
+
+        if (numKeys > 0) {
+            for (uint32_t i = 0; i < numKeys; i++) {
+                uint32_t leftChildPageNum;
+                internalNodeDescend(table->pager, node, i, &leftChildPageNum);
+                printTable(table, outputBuffer, leftChildPageNum);
+            }
+        }
+        uint32_t rightChildPageNum;
+        internalNodeDescend(table->pager, node, numKeys, &rightChildPageNum);
+        printTable(table, outputBuffer, rightChildPageNum);
+    } else if (type == HASH_HEADER_NODE) {
+        Cursor *cursor = hashTableStart(table);
+        printNodes(outputBuffer, cursor);
+        free(cursor);
+    }
+} 
+
+void printNodes(OutputBuffer *outputBuffer, Cursor *cursor) {
+    Row row;
+
+    while (!(cursor->endOfTable)) {
+        deserialiseRow(cursorValue(cursor), &row);
+        printRow(outputBuffer, &row);
+        cursorAdvance(cursor);
+    }
+}
+
+Cursor *tableStart(Table *table) {
+    if (table->lsm != NULL) {
+        return lsmTableStart(table);
+    } else if (table->engine == ENGINE_HASH) {
+        return hashTableStart(table);
+    }
+    // All zero bytes sorts before every key
+    static const uint8_t firstKey[KEY_MAX_SIZE];
+    Cursor *cursor = tableFind(table, firstKey);
+
+    void *node = getPage(table->pager, cursor->pageNum);
+    uint32_t numCells = *leafNodenumCells(node);
+    cursor->endOfTable = (numCells == 0);
+
+    return cursor;
+}
+
+Cursor *tableFind(Table *table, const uint8_t *key) {
+    uint32_t rootPageNum = table->rootPageNum;
+    void *rootNode = getPage(table->pager, rootPageNum);
+
+    if (getNodeType(rootNode) == LEAF_NODE) {
+        return leafNodeFind(table, rootPageNum, key);
+    } else {
+        return internalNodeFind(table, rootPageNum, key);
+    }
+}
+
+int compareKeys(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return (left > right) - (left < right);
+}
+
+// Sorts keys and drops duplicates, returns the new count
+uint32_t sortKeys(uint64_t *keys, uint32_t numKeys) {
+    if (numKeys == 0) {
+        return 0;
+    }
+
+    qsort(keys, numKeys, sizeof(uint64_t), compareKeys);
+    uint32_t unique = 1;
+    for (uint32_t i = 1; i < numKeys; i++) {
+        if (keys[i] != keys[unique - 1]) {
+            keys[unique++] = keys[i];
+        }
+    }
+    return unique;
+}
+
+// Starts loading every page of a level before any of them is searched
+void pagerPrefetch(Pager *pager, LookupGroup *groups, uint32_t numGroups) {
+    uint32_t numPagesInFile = pager->fileLength / pager->pageSize;
+
+    for (uint32_t i = 0; i < numGroups; i++) {
+        uint32_t pageNum = groups[i].pageNum;
+        if (pageNum < pager->pagesCapacity && pager->pages[pageNum] != NULL) {
+            __builtin_prefetch(pager->pages[pageNum]);
+        } else if (pageNum < numPagesInFile) {
+#ifdef POSIX_FADV_WILLNEED
+            posix_fadvise(pager->fileDescriptor, (off_t)pageNum * pager->pageSize, pager->pageSize,
+                POSIX_FADV_WILLNEED);
+#endif
+        }
+    }
+}
+
+// Looks up sorted, unique keys one tree level at a time. Keys under the same node share its
+// descent, and the pages of a whole level are prefetched together so their misses overlap.
+// Rows found are written to rows in key order, returns how many were found.
+uint32_t tableMultiGet(Table *table, uint64_t *keys, uint32_t numKeys, Row *rows) {
+    if (table->lsm != NULL) {
+        return lsmMultiGet(table->lsm, keys, numKeys, rows);
+    } else if (table->engine == ENGINE_HASH) {
+        return hashMultiGet(table, keys, numKeys, rows);
+    }
+    if (numKeys == 0) {
+        return 0;
+    }
+    if (!tableKeyedById(table)) {
+        // Ids are not the key, so the table is scanned for them and rows come back in key order
+        uint32_t numFound = 0;
+        Cursor *cursor = tableStart(table);
+        while (!cursor->endOfTable && numFound < numKeys) {
+            uint64_t id;
+            memcpy(&id, (uint8_t *)cursorValue(cursor) + ID_OFFSET, ID_SIZE);
+            if (bsearch(&id, keys, numKeys, sizeof(uint64_t), compareKeys) != NULL) {
+                deserialiseRow(cursorValue(cursor), &rows[numFound++]);
+            }
+            cursorAdvance(cursor);
+        }
+        free(cursor);
+        return numFound;
+    }
+
+    LookupGroup *groups = malloc(numKeys * sizeof(LookupGroup));
+    LookupGroup *nextGroups = malloc(numKeys * sizeof(LookupGroup));
+    uint32_t numGroups = 1;
+    groups[0].pageNum = table->rootPageNum;
+    groups[0].firstKey = 0;
+    groups[0].numKeys = numKeys;
+
+    while (true) {
+        pagerPrefetch(table->pager, groups, numGroups);
+
+        bool descended = false;
+        uint32_t numNextGroups = 0;
+        for (uint32_t g = 0; g < numGroups; g++) {
+            void *node = getPage(table->pager, groups[g].pageNum);
+            if (getNodeType(node) != INTERNAL_NODE) {
+                nextGroups[numNextGroups++] = groups[g];
+                continue;
+            }
+            descended = true;
+
+            uint32_t nodeNumKeys = *internalNodeNumKeys(node);
+            uint32_t end = groups[g].firstKey + groups[g].numKeys;
+            uint32_t childIndex = 0;
+            for (uint32_t k = groups[g].firstKey; k < end; k++) {
+                // Later keys only move right, so each search starts where the last one ended
+                uint32_t maxIndex = nodeNumKeys;
+                while (childIndex != maxIndex) {
+                    uint32_t index = (childIndex + maxIndex) / 2;
+                    if (keyDecodeUint64(internalNodeKey(node, index)) >= keys[k]) {
+                        maxIndex = index;
+                    } else {
+                        childIndex = index + 1;
+                    }
+                }
+
+                uint32_t childPageNum;
+                internalNodeDescend(table->pager, node, childIndex, &childPageNum);
+                if (k > groups[g].firstKey && nextGroups[numNextGroups - 1].pageNum == childPageNum) {
+                    nextGroups[numNextGroups - 1].numKeys++;
+                } else {
+                    nextGroups[numNextGroups].pageNum = childPageNum;
+                    nextGroups[numNextGroups].firstKey = k;
+                    nextGroups[numNextGroups].numKeys = 1;
+                    numNextGroups++;
+                }
+            }
+        }
+
+        LookupGroup *swap = groups;
+        groups = nextGroups;
+        nextGroups = swap;
+        numGroups = numNextGroups;
+        if (!descended) {
+            break;
+        }
+    }
+
+    uint32_t numFound = 0;
+    for (uint32_t g = 0; g < numGroups; g++) {
+        void *node = getPage(table->pager, groups[g].pageNum);
+        uint32_t numCells = *leafNodenumCells(node);
+        uint32_t end = groups[g].firstKey + groups[g].numKeys;
+        uint32_t cellNum = 0;
+
+        for (uint32_t k = groups[g].firstKey; k < end; k++) {
+            uint32_t maxCell = numCells;
+            while (cellNum != maxCell) {
+                uint32_t index = (cellNum + maxCell) / 2;
+                if (keyDecodeUint64(leafNodeKey(node, index)) >= keys[k]) {
+                    maxCell = index;
+                } else {
+                    cellNum = index + 1;
+                }
+            }
+            if (cellNum < numCells && keyDecodeUint64(leafNodeKey(node, cellNum)) == keys[k]) {
+                deserialiseRow(leafNodeValue(node, cellNum), &rows[numFound++]);
+            }
+        }
+    }
+
+    free(groups);
+    free(nextGroups);
+    return numFound;
+}
+
+// Cursor past the last row when key sorts after every key in the table, otherwise NULL
+Cursor *tableFindAppend(Table *table, const uint8_t *key) {
+    if (table->rightmostLeafPageNum == INVALID_PAGE_NUM) {
+        return NULL;
+    }
+
+    void *node = getPage(table->pager, table->rightmostLeafPageNum);
+    uint32_t numCells = *leafNodenumCells(node);
+    if (getNodeType(node) != LEAF_NODE || *leafNodeNextLeaf(node) != 0) {
+        return NULL;
+    }
+    if (numCells == 0 || keyCompare(key, leafNodeKey(node, numCells - 1), table->keySize) <= 0) {
+        return NULL;
+    }
+
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->lsm = NULL;
+    cursor->pageNum = table->rightmostLeafPageNum;
+    cursor->cellNum = numCells;
+    cursor->endOfTable = true;
+    return cursor;
+}
+
+// Cursor at the first cell whose key is at least key
+Cursor *leafNodeFind(Table *table, uint32_t pageNum, const uint8_t *key) {
+    void *node = getPage(table->pager, pageNum);
+    uint32_t numCells = *leafNodenumCells(node);
+    uint32_t keySize = *nodeKeySize(node);
+
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->lsm = NULL;
+    cursor->pageNum = pageNum;
+    cursor->endOfTable = false;
+
+    uint32_t minIndex = 0;
+    uint32_t onePastMax = numCells;
+
+    if (keySize == ID_SIZE) {
+        uint64_t value = keyDecodeUint64(key);
+        while (onePastMax != minIndex) {
+            uint32_t index = (minIndex + onePastMax) / 2;
+            if (keyDecodeUint64(leafNodeKey(node, index)) >= value) {
+                onePastMax = index;
+            } else {
+                minIndex = index + 1;
+            }
+        }
+    } else {
+        while (onePastMax != minIndex) {
+            uint32_t index = (minIndex + onePastMax) / 2;
+            if (memcmp(leafNodeKey(node, index), key, keySize) >= 0) {
+                onePastMax = index;
+            } else {
+                minIndex = index + 1;
+            }
+        }
+    }
+    cursor->cellNum = minIndex;
+    return cursor;
+}
+
+void keyEncodeUint64(uint64_t value, uint8_t *destination) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    memcpy(destination, &value, sizeof(value));
+}
+
+uint64_t keyDecodeUint64(const uint8_t *source) {
+    uint64_t value;
+    memcpy(&value, source, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+// Pads with NULs, so a shorter string sorts before any longer one it is a prefix of
+void keyEncodeString(const char *value, uint32_t size, uint8_t *destination) {
+    copyPadded(destination, value, size);
+}
+
+// Encodes the row's key columns one after the other
+void tableKey(Table *table, Row *row, uint8_t *key) {
+    for (uint32_t i = 0; i < table->numKeyColumns; i++) {
+        switch (table->keyColumns[i]) {
+            case KEY_ID:
+                keyEncodeUint64(row->id, key);
+                key += ID_SIZE;
+                break;
+            case KEY_USERNAME:
+                keyEncodeString(row->userName, USERNAME_SIZE, key);
+                key += USERNAME_SIZE;
+                break;
+            case KEY_EMAIL:
+                keyEncodeString(row->email, EMAIL_SIZE, key);
+                key += EMAIL_SIZE;
+                break;
+        }
+    }
+}
+
+// Same sign as memcmp, with a fast path for ids
+int keyCompare(const uint8_t *a, const uint8_t *b, uint32_t keySize) {
+    if (keySize == ID_SIZE) {
+        uint64_t left = keyDecodeUint64(a);
+        uint64_t right = keyDecodeUint64(b);
+        return (left > right) - (left < right);
+    }
+    return memcmp(a, b, keySize);
+}
+
+// Whether a lookup by id can go straight to the row
+bool tableKeyedById(Table *table) {
+    return table->numKeyColumns == 1 && table->keyColumns[0] == KEY_ID;
+}
+
+void *cursorValue(Cursor *cursor) {
+    if (cursor->lsm != NULL) {
+        return cursor->rows + (size_t)cursor->cellNum * ROW_SIZE;
+    }
+    uint32_t pageNum = cursor->pageNum;
+
+    void *page = getPage(cursor->table->pager, pageNum);   
+
+    if (getNodeType(page) == HASH_BUCKET_NODE) {
+        return hashBucketValue(page, cursor->table->pager->pageSize, cursor->cellNum);
+    }
+    return leafNodeValue(page, cursor->cellNum);
+}
+
+void cursorAdvance(Cursor *cursor) {
+    if (cursor->lsm != NULL) {
+        if (++cursor->cellNum >= cursor->numRows) {
+            lsmCursorFill(cursor);
+        }
+        return;
+    }
+    uint32_t pageNum = cursor->pageNum;
+    void *node = getPage(cursor->table->pager, pageNum);
+
+    cursor->cellNum += 1;
+    if (getNodeType(node) == HASH_BUCKET_NODE) {
+        hashCursorSettle(cursor);
+        return;
+    }
+    if (cursor->cellNum >= (*(uint32_t *)leafNodenumCells(node))) {
+        uint32_t nextPageNum = *leafNodeNextLeaf(node);
+        if (nextPageNum == 0) {
+            cursor->endOfTable = true;
+        } else {
+            cursor->pageNum = nextPageNum;
+            cursor->cellNum = 0;
+        }
+    }
+}
+
+uint32_t *leafNodeNextLeaf(void *node) {
+    return (uint32_t *)((uint8_t *)node + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+uint32_t *leafNodenumCells(void *node) {
+    return (uint32_t *)((uint8_t *)node + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+// Leaf and internal nodes alike
+uint32_t *nodeKeySize(void *node) {
+    return (uint32_t *)((uint8_t *)node + LEAF_NODE_KEY_SIZE_OFFSET);
+}
+
+void *leafNodeCell(void *node, uint32_t cellNum) {
+    return (uint8_t *)node + LEAF_NODE_HEADER_SIZE + cellNum * LEAF_NODE_CELL_SIZE(*nodeKeySize(node));
+}
+
+uint8_t *leafNodeKey(void *node, uint32_t cellNum) {
+    return (uint8_t *)leafNodeCell(node, cellNum) + LEAF_NODE_KEY_OFFSET;
+}
+
+void *leafNodeValue(void *node, uint32_t cellNum) {
+    return (uint8_t *)leafNodeCell(node, cellNum) + *nodeKeySize(node);
+}
+
+void initialiseLeafNode(void *node, uint32_t keySize) {
+    setNodeType(node, LEAF_NODE);
+    *leafNodenumCells(node) = 0;
+    *leafNodeNextLeaf(node) = 0;
+    *nodeKeySize(node) = keySize;
+}
+
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
+    }
+}
+
+// Ids in decimal, composite keys as hex
+static void printKey(const uint8_t *key, uint32_t keySize) {
+    if (keySize == ID_SIZE) {
+        printf("%llu\n", (unsigned long long)keyDecodeUint64(key));
+        return;
+    }
+    for (uint32_t i = 0; i < keySize; i++) {
+        printf("%02x", key[i]);
+    }
+    printf("\n");
+}
+
+void printTree(Pager *pager, uint32_t pageNum, uint32_t indentationLevel) {
+    void *node = getPage(pager, pageNum);
+    uint32_t numKeys, child;
+
+    NodeType type = getNodeType(node);
+    printf("Debug: pageNum=%d, node type=", pageNum);
+    if (type == LEAF_NODE) {
+        printf("Leaf\n");
+    } else if (type == HASH_HEADER_NODE) {
+        printf("Hash\n");
+    } else {
+        printf("Internal\n");
+    }
+
+    if (type == LEAF_NODE) {
+        numKeys = *leafNodenumCells(node);
+        indent(indentationLevel);
+        printf("- leaf (size %d)\n", numKeys);
+
+        for (uint32_t i = 0; i < numKeys; i++) {
+            indent(indentationLevel + 1);
+            printf("- ");
+            printKey(leafNodeKey(node, i), *nodeKeySize(node));
+        }
+    } else if (type == INTERNAL_NODE) {
+        numKeys = *internalNodeNumKeys(node);
+        indent(indentationLevel);
+        printf("- internal (size %d)\n", numKeys);
+        if (numKeys > 0) {
+            for (uint32_t i = 0; i < numKeys; i++) {
+                internalNodeDescend(pager, node, i, &child);
+                printTree(pager, child, indentationLevel + 1);
+    
+                indent(indentationLevel + 1);
+                printf("- key ");
+                printKey(internalNodeKey(node, i), *nodeKeySize(node));
+            }
+        }
+        internalNodeDescend(pager, node, numKeys, &child);
+        printTree(pager, child, indentationLevel + 1);
+    } else if (type == HASH_HEADER_NODE) {
+        printHashTable(pager, node, indentationLevel);
+    }
+}
+
+void printConstants(Table *table) {
+    uint32_t pageSize = table->pager->pageSize;
+    printf("Page Size: %d\n", pageSize);
+    printf("Row Size: %zu\n", (size_t)ROW_SIZE);
+    printf("Key Size: %d\n", table->keySize);
+    printf("Common Node Header Size: %zu\n", (size_t)COMMON_NODE_HEADER_SIZE);
+    printf("Leaf NodeHeader Size: %zu\n", (size_t)LEAF_NODE_HEADER_SIZE);
+    printf("Leaf Node Cell Size: %zu\n", (size_t)LEAF_NODE_CELL_SIZE(table->keySize));
+    printf("Leaf Node Space for Cells: %zu\n", (size_t)LEAF_NODE_SPACE_FOR_CELLS(pageSize));
+    printf("Leaf Node Max Cells: %zu\n", (size_t)LEAF_NODE_MAX_CELLS(pageSize, table->keySize));
+    printf("Internal Node Max Cells: %zu\n", (size_t)INTERNAL_NODE_MAX_CELLS(pageSize, table->keySize));
+}
+
+NodeType getNodeType(void *node) {
+    uint8_t value = *((uint8_t *)((uint8_t *)node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
+}
+
+void setNodeType(void *node, NodeType type) {
+    uint8_t value = type;
+    *((uint8_t *)((uint8_t *)node + NODE_TYPE_OFFSET)) = value;
+}
+
+// Reuses the most recently freed page, otherwise the next page past the end of the file
+uint32_t getUnusedPageNum(Pager *pager) {
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    uint32_t freePageNum = *catalogFreePage(catalog);
+
+    if (freePageNum == 0) {
+        return pager->numPages;
+    }
+
+    void *page = getPage(pager, freePageNum);
+    *catalogFreePage(catalog) = *(uint32_t *)((uint8_t *)page + FREE_NODE_NEXT_OFFSET);
+    memset(page, 0, pager->pageSize);
+    return freePageNum;
+}
+
+void createNewRoot(Table *table, uint32_t rightChildPageNum) {
+    SPAN(createNewRoot, "page", rightChildPageNum);
+    pagerUnswizzle(table->pager);
+    void *root = getPage(table->pager, table->rootPageNum);
+    void *rightChild = getPage(table->pager, rightChildPageNum);
+    uint32_t leftChildPageNum = getUnusedPageNum(table->pager);
+    void *leftChild = getPage(table->pager, leftChildPageNum);
+    uint32_t keySize = *nodeKeySize(root);
+
+    if (getNodeType(root) == INTERNAL_NODE) {
+        initialiseInternalNode(rightChild, keySize);
+        initialiseInternalNode(leftChild, keySize);
+    }
+
+    memcpy(leftChild, root, table->pager->pageSize);
+    setNodeRoot(leftChild, false);
+
+    if (getNodeType(leftChild) == INTERNAL_NODE) {
+        void *child;
+        for (int i = 0; i < *internalNodeNumKeys(leftChild); i ++) {
+            child = getPage(table->pager, *internalNodeChild(leftChild, i));
+            *nodeParent(child) = leftChildPageNum;
+        }
+        child = getPage(table->pager, *internalNodeRightChild(leftChild));
+        *nodeParent(child) = leftChildPageNum;
+    }
+
+    initialiseInternalNode(root, keySize);
+    setNodeRoot(root, true);
+    *internalNodeNumKeys(root) = 1;
+    *internalNodeChild(root, 0) = leftChildPageNum;
+    memcpy(internalNodeKey(root, 0), getNodeMaxKey(table->pager, leftChild), keySize);
+    *internalNodeRightChild(root) = rightChildPageNum; 
+    *nodeParent(leftChild) = table->rootPageNum;
+    *nodeParent(rightChild) = table->rootPageNum;
+}
+
+void initialiseInternalNode(void *node, uint32_t keySize) {
+    setNodeType(node, INTERNAL_NODE);
+    setNodeRoot(node, false);
+    *internalNodeNumKeys(node) = 0;
+    *nodeKeySize(node) = keySize;
+
+    *internalNodeRightChild(node) = INVALID_PAGE_NUM;
+}
+
+uint32_t *internalNodeNumKeys(void *node) {
+    return (uint32_t *)((uint8_t *)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint32_t *internalNodeRightChild(void *node) {
+    return (uint32_t *)((uint8_t *)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint32_t *internalNodeCell(void *node, uint32_t cellNum) {
+    return (uint32_t *)((uint8_t *)node + INTERNAL_NODE_HEADER_SIZE +
+        cellNum * INTERNAL_NODE_CELL_SIZE(*nodeKeySize(node)));
+}
+
+uint32_t *internalNodeChild(void *node, uint32_t childNum) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    if (childNum > numKeys) {
+        printf("Tried to access childNum %d > numKeys %d\n", childNum, numKeys);
+        exit(EXIT_FAILURE);
+    } else if (childNum == numKeys) {
+        uint32_t *rightChild = internalNodeRightChild(node);
+        if (*rightChild == INVALID_PAGE_NUM) {
+            printf("Tried to access right child of node, but was invalid page\n");
+            exit(EXIT_FAILURE);
+        }
+        return rightChild;
+    } else {
+        return internalNodeCell(node, childNum);
+        uint32_t *child = internalNodeCell(node, childNum);
+        if (*child == INVALID_PAGE_NUM) {
+            printf("Tried to access child %d of node, but was invalid page\n", childNum);
+            exit(EXIT_FAILURE);
+        }
+        return child;
+    }
+}
+
+// The slot holding childPageNum, or NULL if it is not a child of node
+uint32_t *internalNodeChildSlot(void *node, uint32_t childPageNum) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    for (uint32_t i = 0; i < numKeys; i++) {
+        if (*internalNodeCell(node, i) == childPageNum) {
+            return internalNodeCell(node, i);
+        }
+    }
+    return (*internalNodeRightChild(node) == childPageNum) ? internalNodeRightChild(node) : NULL;
+}
+
+// Follows a child slot on the way down a lookup. The first visit swizzles the slot to the child's
+// frame, later ones go straight there without the page table
+void *internalNodeDescend(Pager *pager, void *node, uint32_t childNum, uint32_t *childPageNum) {
+    uint32_t *slot = internalNodeChild(node, childNum);
+    // Shared pages are only tracked through getPage, and other processes cannot follow frame indexes
+    if (pager->shared != NULL) {
+        *childPageNum = *slot;
+        return getPage(pager, *slot);
+    }
+    if (isSwizzled(*slot)) {
+        uint32_t frameIndex = *slot & ~PAGE_SWIZZLED;
+        *childPageNum = pager->frames[frameIndex].pageNum;
+        return pagerFrame(pager, frameIndex);
+    }
+
+    uint32_t pageNum = *slot;
+    void *child = getPage(pager, pageNum);
+    uint32_t frameIndex = pagerFrameIndex(pager, child);
+    uint32_t nodeFrameIndex = pagerFrameIndex(pager, node);
+
+    uint32_t numFrames = pager->numFrameChunks << pager->frameShift;
+    if (pager->framesCapacity < numFrames) {
+        pager->frames = realloc(pager->frames, numFrames * sizeof(FrameInfo));
+        memset(pager->frames + pager->framesCapacity, 0, (numFrames - pager->framesCapacity) * sizeof(FrameInfo));
+        pager->framesCapacity = numFrames;
+    }
+    if (!pager->frames[nodeFrameIndex].swizzledChildren) {
+        if (pager->numSwizzledFrames == pager->swizzledFramesCapacity) {
+            pager->swizzledFramesCapacity = pager->swizzledFramesCapacity ? pager->swizzledFramesCapacity * 2 : 64;
+            pager->swizzledFrames = realloc(pager->swizzledFrames, pager->swizzledFramesCapacity * sizeof(uint32_t));
+        }
+        pager->swizzledFrames[pager->numSwizzledFrames++] = nodeFrameIndex;
+        pager->frames[nodeFrameIndex].swizzledChildren = true;
+    }
+
+    pager->frames[frameIndex].pageNum = pageNum;
+    *slot = PAGE_SWIZZLED | frameIndex;
+    *childPageNum = pageNum;
+    return child;
+}
+
+uint8_t *internalNodeKey(void *node, uint32_t keyNum) {
+    return (uint8_t *)internalNodeCell(node, keyNum) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint8_t *getNodeMaxKey(Pager *pager, void *node) {
+    if (getNodeType(node) == LEAF_NODE) {
+        return leafNodeKey(node, *leafNodenumCells(node) - 1);
+    }
+
+    void *rightChild = getPage(pager, *internalNodeRightChild(node));
+    return getNodeMaxKey(pager, rightChild);
+}
+
+bool isNodeRoot(void *node) {
+    uint8_t value = *((uint8_t *)node + IS_ROOT_OFFSET);
+    return (value != 0);
+}
+
+void setNodeRoot(void *node, bool isRoot) {
+    uint8_t value = isRoot;
+    *((uint8_t *)node + IS_ROOT_OFFSET) = value;
+}
+
+void doDelete(InputBuffer *input, Table *table) {
+    char *arg = strtok(NULL, " ");
+    if (arg == NULL) {
+        printf("Id missing\n");
+        return;
+    }
+
+    if (strcmp(arg, "where") == 0) {
+        doDeleteRange(table);
+        return;
+    }
+
+    if (!isNumber(arg)) {
+        printf("Id not a number\n");
+        return;
+    }
+
+    uint64_t id;
+    if (!parseId(arg, &id)) {
+        return;
+    }
+
+    if (!tableDelete(table, id)) {
+        printf("Id not in databse\n");
+        return;
+    }
+    printf("Deleted Successfuly\n");
+}
+
+// Deletes the row with this id, returns false if there is none
+bool tableDelete(Table *table, uint64_t id) {
+    if (table->lsm != NULL) {
+        return lsmDelete(table->lsm, id);
+    } else if (table->engine == ENGINE_HASH) {
+        return hashDelete(table, id);
+    } else if (tableKeyedById(table)) {
+        // Only the leaf holding the id is touched
+        return tableDeleteRange(table, id, id) == 1;
+    } else if (tableGet(table, id, NULL) == NULL) {
+        return false;
+    }
+    deleteNode(table, id, id);
+    return true;
+}
+
+// The stored row with this id, or NULL. Lsm rows are copied into buffer, the others point into their page.
+void *tableGet(Table *table, uint64_t id, uint8_t *buffer) {
+    if (table->lsm != NULL) {
+        return lsmGet(table->lsm, id, buffer) ? buffer : NULL;
+    } else if (table->engine == ENGINE_HASH) {
+        uint32_t bucketPageNum, pageNum, cellNum;
+        if (!hashFind(table, id, &bucketPageNum, &pageNum, &cellNum)) {
+            return NULL;
+        }
+        return hashBucketValue(getPage(table->pager, pageNum), table->pager->pageSize, cellNum);
+    }
+
+    void *value = NULL;
+    if (tableKeyedById(table)) {
+        uint8_t key[KEY_MAX_SIZE];
+        keyEncodeUint64(id, key);
+        Cursor *cursor = tableFind(table, key);
+        void *node = getPage(table->pager, cursor->pageNum);
+        if (cursor->cellNum < *leafNodenumCells(node) && keyDecodeUint64(leafNodeKey(node, cursor->cellNum)) == id) {
+            value = leafNodeValue(node, cursor->cellNum);
+        }
+        free(cursor);
+        return value;
+    }
+
+    Cursor *cursor = tableStart(table);
+    while (value == NULL && !cursor->endOfTable) {
+        uint64_t rowId;
+        memcpy(&rowId, (uint8_t *)cursorValue(cursor) + ID_OFFSET, ID_SIZE);
+        if (rowId == id) {
+            value = cursorValue(cursor);
+        }
+        cursorAdvance(cursor);
+    }
+    free(cursor);
+    return value;
+}
+
+// Rebuilds the table without the ids in [lowerId, upperId] into fresh pages, then frees the old tree.
+// Returns how many rows were left out.
+uint32_t deleteNode(Table *table, uint64_t lowerId, uint64_t upperId) {
+    SPAN(deleteNode, "id", lowerId);
+    Table tempTable = *table;
+    tempTable.rootPageNum = getUnusedPageNum(table->pager);
+    tempTable.rightmostLeafPageNum = INVALID_PAGE_NUM;
+    void *rootNode = getPage(table->pager, tempTable.rootPageNum);
+    initialiseLeafNode(rootNode, table->keySize);
+    setNodeRoot(rootNode, true);
+
+    pagerUnswizzle(table->pager);
+    bool *visisted = calloc(table->pager->numPages, sizeof(bool));
+    uint32_t numDeleted = copyFile(table, &tempTable, lowerId, upperId, table->rootPageNum, visisted);
+    free(visisted);
+
+    freeTree(table->pager, table->rootPageNum);
+
+    void *catalog = getPage(table->pager, CATALOG_PAGE_NUM);
+    *catalogTableRoot(catalog, catalogFindTable(table->pager, table->name)) = tempTable.rootPageNum;
+    table->rootPageNum = tempTable.rootPageNum;
+    table->rightmostLeafPageNum = tempTable.rightmostLeafPageNum;
+    return numDeleted;
+}
+
+// Handles 'delete where id between <lower> and <upper>'
+void doDeleteRange(Table *table) {
+    char *column = strtok(NULL, " ");
+    char *between = strtok(NULL, " ");
+    char *lower = strtok(NULL, " ");
+    char *and = strtok(NULL, " ");
+    char *upper = strtok(NULL, " ");
+
+    if (column == NULL || strcmp(column, "id") != 0 || between == NULL || strcmp(between, "between") != 0 ||
+        and == NULL || strcmp(and, "and") != 0 || !isNumber(lower) || !isNumber(upper)) {
+        printf("Usage: delete where id between <id> and <id>\n");
+        return;
+    }
+
+    uint64_t lowerId, upperId;
+    if (!parseId(lower, &lowerId) || !parseId(upper, &upperId)) {
+        return;
+    }
+    if (lowerId > upperId) {
+        printf("Empty range\n");
+        return;
+    }
+
+    uint32_t numDeleted = tableDeleteRange(table, lowerId, upperId);
+    printf("Deleted %u rows\n", numDeleted);
+}
+
+// Deletes every row with lowerId <= id <= upperId in place. Only the leaves in the range are
+// visited: the two boundary leaves are trimmed, the ones in between are emptied and unlinked from
+// the leaf chain, and the internal nodes above them are fixed up in one pass at the end.
+uint32_t tableDeleteRange(Table *table, uint64_t lowerId, uint64_t upperId) {
+    if (table->lsm != NULL) {
+        return lsmDeleteRange(table->lsm, lowerId, upperId);
+    } else if (table->engine == ENGINE_HASH) {
+        return hashDeleteRange(table, lowerId, upperId);
+    } else if (!tableKeyedById(table)) {
+        // The ids are spread over the whole key space
+        return deleteNode(table, lowerId, upperId);
+    }
+    Pager *pager = table->pager;
+    pagerUnswizzle(pager);
+
+    // Find the first leaf that can hold lowerId and the leaf just before it
+    uint8_t lowerKey[KEY_MAX_SIZE];
+    keyEncodeUint64(lowerId, lowerKey);
+    uint32_t pageNum = table->rootPageNum;
+    uint32_t leftSiblingPageNum = INVALID_PAGE_NUM;
+    void *node = getPage(pager, pageNum);
+    while (getNodeType(node) == INTERNAL_NODE) {
+        uint32_t childIndex = internalNodeFindChild(node, lowerKey);
+        if (childIndex > 0) {
+            leftSiblingPageNum = *internalNodeChild(node, childIndex - 1);
+        }
+        pageNum = *internalNodeChild(node, childIndex);
+        node = getPage(pager, pageNum);
+    }
+
+    uint32_t prevLeafPageNum = leftSiblingPageNum;
+    while (prevLeafPageNum != INVALID_PAGE_NUM) {
+        void *prev = getPage(pager, prevLeafPageNum);
+        if (getNodeType(prev) == LEAF_NODE) {
+            break;
+        }
+        prevLeafPageNum = *internalNodeRightChild(prev);
+    }
+
+    uint32_t numDeleted = 0;
+    while (true) {
+        node = getPage(pager, pageNum);
+        uint32_t numCells = *leafNodenumCells(node);
+        uint32_t start = 0;
+        while (start < numCells && keyDecodeUint64(leafNodeKey(node, start)) < lowerId) {
+            start++;
+        }
+        uint32_t end = start;
+        while (end < numCells && keyDecodeUint64(leafNodeKey(node, end)) <= upperId) {
+            end++;
+        }
+
+        memmove(leafNodeCell(node, start), leafNodeCell(node, end),
+            (numCells - end) * LEAF_NODE_CELL_SIZE(table->keySize));
+        *leafNodenumCells(node) = numCells - (end - start);
+        numDeleted += end - start;
+
+        uint32_t nextPageNum = *leafNodeNextLeaf(node);
+        if (*leafNodenumCells(node) == 0 && !isNodeRoot(node)) {
+            // Emptied, so the leaf before it skips straight past it
+            if (prevLeafPageNum != INVALID_PAGE_NUM) {
+                *leafNodeNextLeaf(getPage(pager, prevLeafPageNum)) = nextPageNum;
+            }
+        } else {
+            prevLeafPageNum = pageNum;
+        }
+
+        if (end < numCells || nextPageNum == 0) {
+            break;
+        }
+        pageNum = nextPageNum;
+    }
+
+    uint32_t freedCapacity = 16;
+    uint32_t numFreed = 0;
+    uint32_t *freedPages = malloc(freedCapacity * sizeof(uint32_t));
+    void *root = getPage(pager, table->rootPageNum);
+
+    if (getNodeType(root) == INTERNAL_NODE &&
+        pruneEmptyChildren(table, table->rootPageNum, lowerId, upperId, &freedPages, &numFreed, &freedCapacity)) {
+        initialiseLeafNode(root, table->keySize);
+        setNodeRoot(root, true);
+    }
+
+    // A root left with a single child is replaced by that child
+    while (getNodeType(root) == INTERNAL_NODE && *internalNodeNumKeys(root) == 0) {
+        uint32_t childPageNum = *internalNodeRightChild(root);
+        memcpy(root, getPage(pager, childPageNum), pager->pageSize);
+        setNodeRoot(root, true);
+
+        if (getNodeType(root) == INTERNAL_NODE) {
+            for (uint32_t i = 0; i <= *internalNodeNumKeys(root); i++) {
+                *nodeParent(getPage(pager, *internalNodeChild(root, i))) = table->rootPageNum;
+            }
+        }
+
+        if (numFreed == freedCapacity) {
+            freedCapacity *= 2;
+            freedPages = realloc(freedPages, freedCapacity * sizeof(uint32_t));
+        }
+        freedPages[numFreed++] = childPageNum;
+    }
+
+    for (uint32_t i = 0; i < numFreed; i++) {
+        freePage(pager, freedPages[i]);
+    }
+    free(freedPages);
+
+    table->rightmostLeafPageNum = INVALID_PAGE_NUM;
+    return numDeleted;
+}
+
+// Drops the children of an internal node that the range delete emptied, splices out children left
+// with a single child of their own and tightens the keys of the children that were touched.
+// Returns true if the node itself no longer has any children.
+bool pruneEmptyChildren(Table *table, uint32_t pageNum, uint64_t lowerId, uint64_t upperId,
+    uint32_t **freedPages, uint32_t *numFreed, uint32_t *freedCapacity) {
+    Pager *pager = table->pager;
+    void *node = getPage(pager, pageNum);
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    uint32_t keySize = *nodeKeySize(node);
+    uint32_t numKept = 0;
+    uint32_t rightChildPageNum = INVALID_PAGE_NUM;
+
+    for (uint32_t i = 0; i <= numKeys; i++) {
+        uint32_t childPageNum = *internalNodeChild(node, i);
+        uint8_t key[KEY_MAX_SIZE];
+        if (i < numKeys) {
+            memcpy(key, internalNodeKey(node, i), keySize);
+        }
+        bool touched = (i == 0 || keyDecodeUint64(internalNodeKey(node, i - 1)) < upperId) &&
+            (i == numKeys || keyDecodeUint64(internalNodeKey(node, i)) >= lowerId);
+
+        if (touched) {
+            void *child = getPage(pager, childPageNum);
+            bool empty;
+            if (getNodeType(child) == LEAF_NODE) {
+                empty = (*leafNodenumCells(child) == 0);
+            } else {
+                empty = pruneEmptyChildren(table, childPageNum, lowerId, upperId, freedPages, numFreed,
+                    freedCapacity);
+            }
+
+            if (empty || (getNodeType(child) == INTERNAL_NODE && *internalNodeNumKeys(child) == 0)) {
+                if (*numFreed == *freedCapacity) {
+                    *freedCapacity *= 2;
+                    *freedPages = realloc(*freedPages, *freedCapacity * sizeof(uint32_t));
+                }
+                (*freedPages)[(*numFreed)++] = childPageNum;
+                if (empty) {
+                    continue;
+                }
+
+                // Only one grandchild left, it takes the child's place
+                childPageNum = *internalNodeRightChild(child);
+                child = getPage(pager, childPageNum);
+                *nodeParent(child) = pageNum;
+            }
+
+            if (i < numKeys) {
+                memcpy(key, getNodeMaxKey(pager, child), keySize);
+            }
+        }
+
+        // Kept children are packed down in place, cells never move right
+        if (i < numKeys) {
+            *internalNodeCell(node, numKept) = childPageNum;
+            memcpy(internalNodeKey(node, numKept), key, keySize);
+            numKept++;
+        } else {
+            rightChildPageNum = childPageNum;
+        }
+    }
+
+    if (rightChildPageNum == INVALID_PAGE_NUM) {
+        if (numKept == 0) {
+            return true;
+        }
+        // The last kept child becomes the right child and gives up its key
+        numKept--;
+        rightChildPageNum = *internalNodeCell(node, numKept);
+    }
+
+    *internalNodeRightChild(node) = rightChildPageNum;
+    *internalNodeNumKeys(node) = numKept;
+    return false;
+}
+
+// Copies the rows under pageNum into tempTable, leaving out ids in [lowerId, upperId]. Returns how many
+// were left out.
+uint32_t copyFile(Table *table, Table *tempTable, uint64_t lowerId, uint64_t upperId, uint32_t pageNum,
+    bool *visited) {
+    if (visited[pageNum]) {
+        return 0;
+    }
+    visited[pageNum] = true;
+    uint32_t numSkipped = 0;
+    void *node = getPage(table->pager, pageNum);
+    NodeType type = getNodeType(node);
+    if (type == LEAF_NODE) {
+        uint32_t numCells = *leafNodenumCells(node);
+        for (uint32_t i = 0; i < numCells; i++) {
+            Row row;
+            Row *rowToInsert = malloc(sizeof(Row));
+            void *value = leafNodeValue(node, i);
+            deserialiseRow(value, &row);
+            if (row.id >= lowerId && row.id <= upperId) {
+                free(rowToInsert);
+                numSkipped++;
+                continue; 
+            };
+            
+            *rowToInsert = row;
+            uint8_t keyToInsert[KEY_MAX_SIZE];
+            tableKey(tempTable, rowToInsert, keyToInsert);
+            Cursor *cursor = tableFind(tempTable, keyToInsert);
+            leafNodeInsert(cursor, keyToInsert, rowToInsert);
+            free(rowToInsert);
+            free(cursor);
+        }
+    } else if (type == INTERNAL_NODE) {
+        uint32_t numKeys = *internalNodeNumKeys(node);
+
+        if (numKeys > 0) {
+            for (uint32_t i = 0; i < numKeys; i++) {
+                uint32_t leftChildPageNum = *internalNodeChild(node, i);
+                numSkipped += copyFile(table, tempTable, lowerId, upperId, leftChildPageNum, visited);
+            }
+        }
+        uint32_t rightChildPageNum = *internalNodeRightChild(node);
+        numSkipped += copyFile(table, tempTable, lowerId, upperId, rightChildPageNum, visited);
+    }
+    return numSkipped;
+}
+
+// Steps whatever table is in use, taking the database lock for one step at a time so commands wait
+// for at most one page move
+static void *defragmentWorker(void *arg) {
+    Database *database = arg;
+    Defragment *defragment = database->defragment;
+
+    while (!__atomic_load_n(&defragment->stop, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&database->lock);
+        Table *table = database->currentTable;
+        bool busy = table != NULL && table->engine == ENGINE_BTREE && defragmentStep(defragment, table);
+        if (busy) {
+            replicationCommit(database);
+        } else {
+            replicationIdle(database);
+        }
+        pthread_mutex_unlock(&database->lock);
+        usleep(busy ? DEFRAGMENT_STEP_US : DEFRAGMENT_IDLE_MS * 1000);
+    }
+
+    return NULL;
+}
+
+// Handles 'defragment' and 'defragment background'
+void doDefragment(Database *database) {
+    Table *table = database->currentTable;
+    char *mode = strtok(NULL, " ");
+    if (table->engine != ENGINE_BTREE) {
+        printf("Only btree tables can be defragmented\n");
+    } else if (mode == NULL) {
+        Defragment defragment;
+        memset(&defragment, 0, sizeof(Defragment));
+        while (defragmentStep(&defragment, table));
+        defragmentReset(&defragment);
+        printf("Repacked %u leaves, freed %u pages and moved %u leaves\n", defragment.numRepacked,
+            defragment.numFreed, defragment.numMoved);
+    } else if (strcmp(mode, "background") == 0) {
+        // Its plan spans many commands, other processes would change the tree under it
+        if (table->pager->shared != NULL) {
+            printf("Shared databases can only be defragmented in the foreground\n");
+            return;
+        }
+        if (database->defragment != NULL) {
+            printf("Already defragmenting in the background\n");
+            return;
+        }
+        database->defragment = calloc(1, sizeof(Defragment));
+        pthread_create(&database->defragment->thread, NULL, defragmentWorker, database);
+        printf("Defragmenting in the background\n");
+    } else {
+        printf("Unrecognised defragment mode %s\n", mode);
+    }
+}
+
+void defragmentClose(Database *database) {
+    Defragment *defragment = database->defragment;
+    if (defragment == NULL) {
+        return;
+    }
+    __atomic_store_n(&defragment->stop, true, __ATOMIC_RELAXED);
+    pthread_join(defragment->thread, NULL);
+    defragmentReset(defragment);
+    free(defragment);
+    database->defragment = NULL;
+}
+
+// Drops the current pass, the next step starts a new one
+void defragmentReset(Defragment *defragment) {
+    free(defragment->leaves);
+    free(defragment->targets);
+    free(defragment->positions);
+    defragment->leaves = NULL;
+    defragment->targets = NULL;
+    defragment->positions = NULL;
+    defragment->numLeaves = 0;
+    defragment->leavesCapacity = 0;
+    defragment->phase = DEFRAGMENT_START;
+}
+
+// True if pageNum is a non-root leaf that its parents lead down to from the table's root. Commands run
+// between steps, so pages remembered from an earlier step are checked before they are touched.
+static bool defragmentOwnsLeaf(Table *table, uint32_t pageNum) {
+    Pager *pager = table->pager;
+    if (pageNum == 0 || pageNum >= pager->numPages) {
+        return false;
+    }
+    void *node = getPage(pager, pageNum);
+    if (getNodeType(node) != LEAF_NODE || isNodeRoot(node)) {
+        return false;
+    }
+
+    while (!isNodeRoot(node)) {
+        uint32_t parentPageNum = *nodeParent(node);
+        if (parentPageNum == 0 || parentPageNum >= pager->numPages) {
+            return false;
+        }
+        void *parent = getPage(pager, parentPageNum);
+        if (getNodeType(parent) != INTERNAL_NODE || internalNodeChildSlot(parent, pageNum) == NULL) {
+            return false;
+        }
+        pageNum = parentPageNum;
+        node = parent;
+    }
+    return pageNum == table->rootPageNum;
+}
+
+// The leaf whose next leaf is pageNum, found through the parents rather than the keys
+static uint32_t defragmentPreviousLeaf(Pager *pager, uint32_t pageNum) {
+    void *node = getPage(pager, pageNum);
+    while (!isNodeRoot(node)) {
+        uint32_t parentPageNum = *nodeParent(node);
+        void *parent = getPage(pager, parentPageNum);
+        uint32_t childNum = 0;
+        while (*internalNodeChild(parent, childNum) != pageNum) {
+            childNum++;
+        }
+
+        if (childNum > 0) {
+            uint32_t leafPageNum = *internalNodeChild(parent, childNum - 1);
+            void *leaf = getPage(pager, leafPageNum);
+            while (getNodeType(leaf) == INTERNAL_NODE) {
+                leafPageNum = *internalNodeRightChild(leaf);
+                leaf = getPage(pager, leafPageNum);
+            }
+            return leafPageNum;
+        }
+        pageNum = parentPageNum;
+        node = parent;
+    }
+    return INVALID_PAGE_NUM;
+}
+
+// A moved page still carries a valid checksum for its content, which would hide the move from replication
+static void defragmentTouch(Pager *pager, uint32_t pageNum) {
+    void *page = getPage(pager, pageNum);
+    *(uint32_t *)((uint8_t *)page + NODE_CHECKSUM_OFFSET) = ~pageChecksum(page, pager->pageSize);
+}
+
+// Fills the leaf at pageNum with cells from the next leaf if both hang off the same parent. A next leaf
+// left empty is freed, and a parent left with one child is replaced by it. Returns false if nothing moved.
+static bool defragmentRepack(Defragment *defragment, Table *table, uint32_t pageNum) {
+    Pager *pager = table->pager;
+    void *node = getPage(pager, pageNum);
+    uint32_t keySize = *nodeKeySize(node);
+    uint32_t numCells = *leafNodenumCells(node);
+    uint32_t maxCells = LEAF_NODE_MAX_CELLS(pager->pageSize, keySize);
+    uint32_t nextPageNum = *leafNodeNextLeaf(node);
+    if (numCells >= maxCells || nextPageNum == 0) {
+        return false;
+    }
+
+    uint32_t parentPageNum = *nodeParent(node);
+    void *parent = getPage(pager, parentPageNum);
+    void *next = getPage(pager, nextPageNum);
+    uint32_t numKeys = *internalNodeNumKeys(parent);
+    uint32_t childNum = 0;
+    while (childNum < numKeys && *internalNodeCell(parent, childNum) != pageNum) {
+        childNum++;
+    }
+    if (childNum == numKeys || *internalNodeChild(parent, childNum + 1) != nextPageNum) {
+        return false;
+    }
+
+    uint32_t numNextCells = *leafNodenumCells(next);
+    uint32_t numTaken = (numNextCells < maxCells - numCells) ? numNextCells : maxCells - numCells;
+    if (numTaken == numNextCells && numKeys == 1 && !isNodeRoot(parent)) {
+        // Emptying the next leaf would leave the parent one child. Only the root can be spliced out, anywhere
+        // else the leaf would end up shallower than the rest, so the next leaf keeps a cell.
+        if (numTaken <= 1) {
+            return false;
+        }
+        numTaken--;
+    }
+    memcpy(leafNodeCell(node, numCells), leafNodeCell(next, 0), numTaken * LEAF_NODE_CELL_SIZE(keySize));
+    memmove(leafNodeCell(next, 0), leafNodeCell(next, numTaken),
+        (numNextCells - numTaken) * LEAF_NODE_CELL_SIZE(keySize));
+    *leafNodenumCells(node) = numCells + numTaken;
+    *leafNodenumCells(next) = numNextCells - numTaken;
+    defragment->numRepacked++;
+
+    if (numTaken < numNextCells) {
+        memcpy(internalNodeKey(parent, childNum), leafNodeKey(node, numCells + numTaken - 1), keySize);
+        return true;
+    }
+
+    // The next leaf is empty, this leaf takes its slot and its key
+    *leafNodeNextLeaf(node) = *leafNodeNextLeaf(next);
+    if (childNum + 1 == numKeys) {
+        *internalNodeRightChild(parent) = pageNum;
+    } else {
+        *internalNodeCell(parent, childNum + 1) = pageNum;
+        memmove(internalNodeCell(parent, childNum), internalNodeCell(parent, childNum + 1),
+            (numKeys - childNum - 1) * INTERNAL_NODE_CELL_SIZE(keySize));
+    }
+    *internalNodeNumKeys(parent) = numKeys - 1;
+    freePage(pager, nextPageNum);
+    defragment->numFreed++;
+
+    if (numKeys > 1) {
+        return true;
+    }
+    // The last leaf becomes the root, which keeps its page
+    memcpy(parent, node, pager->pageSize);
+    setNodeRoot(parent, true);
+    freePage(pager, pageNum);
+    defragment->numFreed++;
+    return true;
+}
+
+// Swaps the leaves on pages a and b, pointing their parents and the leaves before them at the new pages
+static void defragmentSwap(Table *table, uint32_t a, uint32_t b) {
+    Pager *pager = table->pager;
+    uint32_t *slotA = internalNodeChildSlot(getPage(pager, *nodeParent(getPage(pager, a))), a);
+    uint32_t *slotB = internalNodeChildSlot(getPage(pager, *nodeParent(getPage(pager, b))), b);
+    uint32_t previousA = defragmentPreviousLeaf(pager, a);
+    uint32_t previousB = defragmentPreviousLeaf(pager, b);
+
+    uint8_t *scratch = malloc(pager->pageSize);
+    memcpy(scratch, getPage(pager, a), pager->pageSize);
+    memcpy(getPage(pager, a), getPage(pager, b), pager->pageSize);
+    memcpy(getPage(pager, b), scratch, pager->pageSize);
+    free(scratch);
+
+    *slotA = b;
+    *slotB = a;
+    // Either leaf may have been next to the other
+    uint32_t pageNums[2] = {a, b};
+    for (uint32_t i = 0; i < 2; i++) {
+        uint32_t *nextLeaf = leafNodeNextLeaf(getPage(pager, pageNums[i]));
+        if (*nextLeaf == a || *nextLeaf == b) {
+            *nextLeaf = (*nextLeaf == a) ? b : a;
+        }
+    }
+    if (previousA != INVALID_PAGE_NUM) {
+        *leafNodeNextLeaf(getPage(pager, (previousA == b) ? a : previousA)) = b;
+    }
+    if (previousB != INVALID_PAGE_NUM) {
+        *leafNodeNextLeaf(getPage(pager, (previousB == a) ? b : previousB)) = a;
+    }
+
+    defragmentTouch(pager, a);
+    defragmentTouch(pager, b);
+}
+
+// Does one repack or one leaf move of a defragment pass over table. Returns false once the pass is over.
+bool defragmentStep(Defragment *defragment, Table *table) {
+    Pager *pager = table->pager;
+    pagerUnswizzle(pager);
+    // Moves and repacks can take the rightmost leaf's page
+    table->rightmostLeafPageNum = INVALID_PAGE_NUM;
+
+    if (defragment->phase != DEFRAGMENT_START && defragment->rootPageNum != table->rootPageNum) {
+        defragmentReset(defragment);
+    }
+    if (defragment->phase == DEFRAGMENT_START) {
+        uint32_t pageNum = table->rootPageNum;
+        void *node = getPage(pager, pageNum);
+        if (getNodeType(node) != INTERNAL_NODE) {
+            return false;
+        }
+        while (getNodeType(node) == INTERNAL_NODE) {
+            pageNum = *internalNodeChild(node, 0);
+            node = getPage(pager, pageNum);
+        }
+        defragment->phase = DEFRAGMENT_REPACK;
+        defragment->rootPageNum = table->rootPageNum;
+        defragment->pageNum = pageNum;
+        return true;
+    }
+
+    if (defragment->phase == DEFRAGMENT_REPACK) {
+        uint32_t pageNum = defragment->pageNum;
+        if (!defragmentOwnsLeaf(table, pageNum)) {
+            defragmentReset(defragment);
+            return true;
+        }
+
+        // Leaves join the plan in key order once nothing more can be moved into them
+        for (uint32_t i = 0; i < DEFRAGMENT_SCAN_LEAVES && pageNum != 0; i++) {
+            if (defragmentRepack(defragment, table, pageNum)) {
+                break;
+            }
+            if (defragment->numLeaves == defragment->leavesCapacity) {
+                defragment->leavesCapacity = defragment->leavesCapacity ? defragment->leavesCapacity * 2 : 64;
+                defragment->leaves = realloc(defragment->leaves, defragment->leavesCapacity * sizeof(uint32_t));
+            }
+            defragment->leaves[defragment->numLeaves++] = pageNum;
+            pageNum = *leafNodeNextLeaf(getPage(pager, pageNum));
+        }
+        defragment->pageNum = pageNum;
+        if (pageNum != 0) {
+            return true;
+        }
+
+        // Leaves keep the pages they have between them, handed out in key order
+        uint32_t numLeaves = defragment->numLeaves;
+        defragment->targets = malloc((numLeaves + 1) * sizeof(uint32_t));
+        memcpy(defragment->targets, defragment->leaves, numLeaves * sizeof(uint32_t));
+        qsort(defragment->targets, numLeaves, sizeof(uint32_t), comparePageNums);
+        defragment->positions = malloc(pager->numPages * sizeof(uint32_t));
+        for (uint32_t i = 0; i < numLeaves; i++) {
+            defragment->positions[defragment->leaves[i]] = i;
+        }
+        defragment->phase = DEFRAGMENT_MOVE;
+        defragment->nextLeaf = 0;
+        return true;
+    }
+
+    while (defragment->nextLeaf < defragment->numLeaves &&
+        defragment->leaves[defragment->nextLeaf] == defragment->targets[defragment->nextLeaf]) {
+        defragment->nextLeaf++;
+    }
+    if (defragment->nextLeaf == defragment->numLeaves) {
+        defragmentReset(defragment);
+        return false;
+    }
+
+    uint32_t index = defragment->nextLeaf;
+    uint32_t a = defragment->leaves[index];
+    uint32_t b = defragment->targets[index];
+    if (!defragmentOwnsLeaf(table, a) || !defragmentOwnsLeaf(table, b)) {
+        defragmentReset(defragment);
+        return true;
+    }
+    defragmentSwap(table, a, b);
+
+    uint32_t other = defragment->positions[b];
+    defragment->leaves[other] = a;
+    defragment->positions[a] = other;
+    defragment->leaves[index] = b;
+    defragment->positions[b] = index;
+    defragment->nextLeaf++;
+    defragment->numMoved++;
+    return true;
+}
+
+void doIntegrityCheck(Database *database) {
+    Pager *pager = database->pager;
+    IntegrityCheck check;
+    pagerUnswizzle(pager);
+    check.pager = pager;
+    check.numLeaves = 0;
+    check.nextLeaf = 0;
+    check.numErrors = 0;
+    check.numRows = 0;
+    check.boundsLength = 0;
+    check.boundsCapacity = 4096;
+    check.bounds = malloc(check.boundsCapacity);
+    pthread_mutex_init(&check.lock, NULL);
+
+    uint32_t leavesCapacity = 64;
+    check.leaves = malloc(leavesCapacity * sizeof(LeafCheck));
+    bool *visited = calloc(pager->numPages, sizeof(bool));
+    uint8_t *catalog = pageBufferAlloc(pager->pageSize);
+    uint8_t *freeNode = pageBufferAlloc(pager->pageSize);
+
+    visited[CATALOG_PAGE_NUM] = true;
+    if (!integrityReadPage(&check, CATALOG_PAGE_NUM, catalog)) {
+        printf("Integrity check failed: catalog unreadable\n");
+        pthread_mutex_destroy(&check.lock);
+        free(catalog);
+        free(freeNode);
+        free(visited);
+        free(check.leaves);
+        free(check.bounds);
+        return;
+    }
+
+    for (uint32_t pageNum = *catalogFreePage(catalog); pageNum != 0;) {
+        if (pageNum >= pager->numPages || visited[pageNum]) {
+            integrityError(&check, "Free list revisits page %d\n", pageNum);
+            break;
+        }
+        visited[pageNum] = true;
+        if (!integrityReadPage(&check, pageNum, freeNode)) {
+            break;
+        }
+        if (getNodeType(freeNode) != FREE_NODE) {
+            integrityError(&check, "Page %d is on the free list but in use\n", pageNum);
+            break;
+        }
+        pageNum = *(uint32_t *)(freeNode + FREE_NODE_NEXT_OFFSET);
+    }
+
+    // Internal nodes are few, walk them here and hand every leaf to the workers in key order
+    for (uint32_t tableNum = 0; tableNum < *catalogNumTables(catalog); tableNum++) {
+        if (*catalogTableRoot(catalog, tableNum) == INVALID_PAGE_NUM) {
+            continue;
+        }
+        uint32_t firstLeaf = check.numLeaves;
+        TableEngine engine;
+        KeyColumn keyColumns[KEY_MAX_COLUMNS];
+        uint32_t numKeyColumns;
+        uint32_t keySize = 0;
+        if (parseSchema(catalogTableSchema(catalog, tableNum), &engine, keyColumns, &numKeyColumns)) {
+            keySize = keyColumnsSize(keyColumns, numKeyColumns);
+        } else {
+            integrityError(&check, "Table %.*s has an unsupported schema\n", CATALOG_TABLE_NAME_SIZE,
+                catalogTableName(catalog, tableNum));
+        }
+        check.leafDepth = UINT32_MAX;
+        integrityCheckInternal(&check, *catalogTableRoot(catalog, tableNum), INVALID_PAGE_NUM, 0, keySize, NULL,
+            NULL, &leavesCapacity, visited);
+
+        for (uint32_t i = firstLeaf; i < check.numLeaves; i++) {
+            check.leaves[i].nextLeafPageNum = (i + 1 < check.numLeaves) ? check.leaves[i + 1].pageNum : 0;
+        }
+    }
+
+    for (uint32_t pageNum = 0; pageNum < pager->numPages; pageNum++) {
+        if (!visited[pageNum]) {
+            integrityError(&check, "Page %d is not referenced\n", pageNum);
+        }
+    }
+
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t numThreads = numCpus > 0 ? (uint32_t)numCpus : 1;
+    if (numThreads > INTEGRITY_MAX_THREADS) numThreads = INTEGRITY_MAX_THREADS;
+    if (numThreads > check.numLeaves) numThreads = check.numLeaves;
+
+    pthread_t threads[INTEGRITY_MAX_THREADS];
+    uint32_t started = 0;
+    for (; started < numThreads; started++) {
+        if (pthread_create(&threads[started], NULL, integrityCheckLeaves, &check) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        integrityCheckLeaves(&check);
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (check.numErrors == 0) {
+        printf("Integrity check passed: %d leaf pages, %llu rows\n", check.numLeaves,
+            (unsigned long long)check.numRows);
+    } else {
+        printf("Integrity check failed: %d errors\n", check.numErrors);
+    }
+
+    pthread_mutex_destroy(&check.lock);
+    free(catalog);
+    free(freeNode);
+    free(visited);
+    free(check.leaves);
+    free(check.bounds);
+}
+
+// Appends a key bound for the leaf workers, returns its offset
+static size_t integrityBound(IntegrityCheck *check, const uint8_t *key, uint32_t keySize) {
+    if (check->boundsLength + keySize > check->boundsCapacity) {
+        while (check->boundsLength + keySize > check->boundsCapacity) {
+            check->boundsCapacity *= 2;
+        }
+        check->bounds = realloc(check->bounds, check->boundsCapacity);
+    }
+    memcpy(check->bounds + check->boundsLength, key, keySize);
+    check->boundsLength += keySize;
+    return check->boundsLength - keySize;
+}
+
+void integrityError(IntegrityCheck *check, const char *format, ...) {
+    pthread_mutex_lock(&check->lock);
+    if (check->numErrors < INTEGRITY_MAX_REPORTED_ERRORS) {
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
+    check->numErrors++;
+    pthread_mutex_unlock(&check->lock);
+}
+
+// Copies a page without touching the cache, verifying the checksum when it comes from disk
+bool integrityReadPage(IntegrityCheck *check, uint32_t pageNum, void *buffer) {
+    Pager *pager = check->pager;
+
+    if (pageNum >= pager->numPages) {
+        integrityError(check, "Page %d out of bounds\n", pageNum);
+        return false;
+    }
+
+    // Cached pages may be dirty, so their stored checksum is not meaningful yet
+    if (pager->pages[pageNum] != NULL) {
+        memcpy(buffer, pager->pages[pageNum], pager->pageSize);
+        return true;
+    }
+
+    ssize_t bytesRead = pread(pager->fileDescriptor, buffer, pager->pageSize, (off_t)pageNum * pager->pageSize);
+    if (bytesRead != pager->pageSize) {
+        integrityError(check, "Page %d could not be read\n", pageNum);
+        return false;
+    }
+
+    if (*(uint32_t *)((uint8_t *)buffer + NODE_CHECKSUM_OFFSET) != pageChecksum(buffer, pager->pageSize)) {
+        integrityError(check, "Page %d checksum mismatch\n", pageNum);
+        return false;
+    }
+
+    return true;
+}
+
+// Bounds are NULL where the node's keys are unbounded on that side
+void integrityCheckInternal(IntegrityCheck *check, uint32_t pageNum, uint32_t parentPageNum, uint32_t depth,
+    uint32_t keySize, const uint8_t *lowerBound, const uint8_t *upperBound, uint32_t *leavesCapacity, bool *visited) {
+    if (pageNum < check->pager->numPages) {
+        if (visited[pageNum]) {
+            integrityError(check, "Page %d is reachable more than once\n", pageNum);
+            return;
+        }
+        visited[pageNum] = true;
+    }
+
+    uint8_t *node = pageBufferAlloc(check->pager->pageSize);
+    if (!integrityReadPage(check, pageNum, node)) {
+        free(node);
+        return;
+    }
+
+    if (getNodeType(node) == LEAF_NODE) {
+        if (check->leafDepth == UINT32_MAX) {
+            check->leafDepth = depth;
+        } else if (depth != check->leafDepth) {
+            integrityError(check, "Page %d leaf is at depth %u, expected %u\n", pageNum, depth, check->leafDepth);
+        }
+        if (check->numLeaves == *leavesCapacity) {
+            *leavesCapacity *= 2;
+            check->leaves = realloc(check->leaves, *leavesCapacity * sizeof(LeafCheck));
+        }
+        LeafCheck *leaf = &check->leaves[check->numLeaves++];
+        leaf->pageNum = pageNum;
+        leaf->parentPageNum = parentPageNum;
+        leaf->keySize = keySize;
+        leaf->hasLowerBound = (lowerBound != NULL);
+        leaf->lowerBound = (lowerBound != NULL) ? integrityBound(check, lowerBound, keySize) : 0;
+        leaf->hasUpperBound = (upperBound != NULL);
+        leaf->upperBound = (upperBound != NULL) ? integrityBound(check, upperBound, keySize) : 0;
+        free(node);
+        return;
+    }
+
+    if (getNodeType(node) == HASH_HEADER_NODE && parentPageNum == INVALID_PAGE_NUM) {
+        integrityCheckHash(check, pageNum, node, visited);
+        free(node);
+        return;
+    }
+
+    if (getNodeType(node) != INTERNAL_NODE) {
+        integrityError(check, "Page %d has unknown node type %d\n", pageNum, getNodeType(node));
+        free(node);
+        return;
+    }
+
+    bool isRoot = (parentPageNum == INVALID_PAGE_NUM);
+    if (isNodeRoot(node) != isRoot) {
+        integrityError(check, "Page %d root flag is wrong\n", pageNum);
+    }
+    if (!isRoot && *nodeParent(node) != parentPageNum) {
+        integrityError(check, "Page %d parent is %d, expected %d\n", pageNum, *nodeParent(node), parentPageNum);
+    }
+
+    if (*nodeKeySize(node) != keySize) {
+        integrityError(check, "Page %d key size is %u, expected %u\n", pageNum, *nodeKeySize(node), keySize);
+        free(node);
+        return;
+    }
+
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    if (numKeys == 0 || numKeys > INTERNAL_NODE_MAX_CELLS(check->pager->pageSize, keySize)) {
+        integrityError(check, "Page %d has %d keys\n", pageNum, numKeys);
+        free(node);
+        return;
+    }
+
+    for (uint32_t i = 0; i < numKeys; i++) {
+        uint8_t *key = internalNodeKey(node, i);
+        if ((i > 0 && keyCompare(key, internalNodeKey(node, i - 1), keySize) <= 0) ||
+            (i == 0 && lowerBound != NULL && keyCompare(key, lowerBound, keySize) <= 0) ||
+            (upperBound != NULL && keyCompare(key, upperBound, keySize) > 0)) {
+            integrityError(check, "Page %d key %u is out of order\n", pageNum, i);
+        }
+    }
+
+    for (uint32_t i = 0; i <= numKeys; i++) {
+        uint32_t childPageNum = (i < numKeys) ? *internalNodeCell(node, i) : *internalNodeRightChild(node);
+        const uint8_t *childLower = (i > 0) ? internalNodeKey(node, i - 1) : lowerBound;
+        const uint8_t *childUpper = (i < numKeys) ? internalNodeKey(node, i) : upperBound;
+
+        integrityCheckInternal(check, childPageNum, pageNum, depth + 1, keySize, childLower, childUpper,
+            leavesCapacity, visited);
+    }
+
+    free(node);
+}
+
+void *integrityCheckLeaves(void *arg) {
+    IntegrityCheck *check = arg;
+    uint8_t *node = pageBufferAlloc(check->pager->pageSize);
+    uint64_t numRows = 0;
+
+    while (true) {
+        uint32_t index = __atomic_fetch_add(&check->nextLeaf, 1, __ATOMIC_RELAXED);
+        if (index >= check->numLeaves) {
+            break;
+        }
+        LeafCheck *leaf = &check->leaves[index];
+        if (!integrityReadPage(check, leaf->pageNum, node)) {
+            continue;
+        }
+
+        bool isRoot = (leaf->parentPageNum == INVALID_PAGE_NUM);
+        if (isNodeRoot(node) != isRoot) {
+            integrityError(check, "Page %d root flag is wrong\n", leaf->pageNum);
+        }
+        if (!isRoot && *nodeParent(node) != leaf->parentPageNum) {
+            integrityError(check, "Page %d parent is %d, expected %d\n", leaf->pageNum, *nodeParent(node),
+                leaf->parentPageNum);
+        }
+        if (*leafNodeNextLeaf(node) != leaf->nextLeafPageNum) {
+            integrityError(check, "Page %d next leaf is %d, expected %d\n", leaf->pageNum,
+                *leafNodeNextLeaf(node), leaf->nextLeafPageNum);
+        }
+
+        uint32_t keySize = leaf->keySize;
+        if (*nodeKeySize(node) != keySize) {
+            integrityError(check, "Page %d key size is %u, expected %u\n", leaf->pageNum, *nodeKeySize(node),
+                keySize);
+            continue;
+        }
+
+        uint32_t numCells = *leafNodenumCells(node);
+        if (numCells > LEAF_NODE_MAX_CELLS(check->pager->pageSize, keySize) || (numCells == 0 && !isRoot)) {
+            integrityError(check, "Page %d has %d cells\n", leaf->pageNum, numCells);
+            continue;
+        }
+
+        for (uint32_t i = 0; i < numCells; i++) {
+            uint8_t *key = leafNodeKey(node, i);
+            if ((i > 0 && keyCompare(key, leafNodeKey(node, i - 1), keySize) <= 0) ||
+                (leaf->hasLowerBound && keyCompare(key, check->bounds + leaf->lowerBound, keySize) <= 0) ||
+                (leaf->hasUpperBound && keyCompare(key, check->bounds + leaf->upperBound, keySize) > 0)) {
+                integrityError(check, "Page %d key %u is out of order\n", leaf->pageNum, i);
+            }
+        }
+        numRows += numCells;
+    }
+
+    __atomic_fetch_add(&check->numRows, numRows, __ATOMIC_RELAXED);
+    free(node);
+    return NULL;
+}
+
+// Walks the directory and every bucket chain of a hash table, checking each row sits in the bucket its
+// id hashes to
+void integrityCheckHash(IntegrityCheck *check, uint32_t pageNum, void *header, bool *visited) {
+    Pager *pager = check->pager;
+    uint32_t numBuckets = hashNumBuckets(header);
+    uint32_t bucketsPerPage = HASH_DIRECTORY_MAX_BUCKETS(pager->pageSize);
+    uint32_t numDirectoryPages = *hashHeaderNumDirectoryPages(header);
+
+    if (*hashHeaderSplit(header) >= (1u << *hashHeaderLevel(header)) ||
+        numDirectoryPages != (numBuckets + bucketsPerPage - 1) / bucketsPerPage ||
+        numDirectoryPages > HASH_HEADER_MAX_DIRECTORY_PAGES(pager->pageSize)) {
+        integrityError(check, "Page %d hash header is inconsistent\n", pageNum);
+        return;
+    }
+
+    uint8_t *directory = pageBufferAlloc(pager->pageSize);
+    uint8_t *node = pageBufferAlloc(pager->pageSize);
+    uint64_t numRows = 0;
+
+    for (uint32_t bucketNum = 0; bucketNum < numBuckets; bucketNum++) {
+        if (bucketNum % bucketsPerPage == 0) {
+            uint32_t directoryPageNum = *hashHeaderDirectoryPage(header, bucketNum / bucketsPerPage);
+            if (directoryPageNum < pager->numPages && visited[directoryPageNum]) {
+                integrityError(check, "Page %d is reachable more than once\n", directoryPageNum);
+                break;
+            }
+            if (!integrityReadPage(check, directoryPageNum, directory)) {
+                break;
+            }
+            visited[directoryPageNum] = true;
+            if (getNodeType(directory) != HASH_DIRECTORY_NODE) {
+                integrityError(check, "Page %d is not a hash directory\n", directoryPageNum);
+                break;
+            }
+        }
+
+        uint32_t chainPageNum = *hashDirectoryBucket(directory, bucketNum % bucketsPerPage);
+        bool first = true;
+        while (chainPageNum != 0) {
+            if (chainPageNum < pager->numPages && visited[chainPageNum]) {
+                integrityError(check, "Page %d is reachable more than once\n", chainPageNum);
+                break;
+            }
+            if (!integrityReadPage(check, chainPageNum, node)) {
+                break;
+            }
+            visited[chainPageNum] = true;
+
+            uint32_t numCells = *hashBucketNumCells(node);
+            if (getNodeType(node) != HASH_BUCKET_NODE || numCells > HASH_BUCKET_MAX_CELLS(pager->pageSize) ||
+                (numCells == 0 && !first)) {
+                integrityError(check, "Page %d is not a valid page of bucket %d\n", chainPageNum, bucketNum);
+                break;
+            }
+            for (uint32_t i = 0; i < numCells; i++) {
+                if (hashBucketNum(*hashHeaderLevel(header), *hashHeaderSplit(header), *hashBucketKey(node, i)) !=
+                    bucketNum) {
+                    integrityError(check, "Page %d key %llu is in the wrong bucket\n", chainPageNum,
+                        (unsigned long long)*hashBucketKey(node, i));
+                }
+            }
+            numRows += numCells;
+            first = false;
+            chainPageNum = *hashBucketOverflow(node);
+        }
+    }
+
+    if (numRows != *hashHeaderNumRows(header)) {
+        integrityError(check, "Page %d counts %d rows, found %llu\n", pageNum, *hashHeaderNumRows(header),
+            (unsigned long long)numRows);
+    }
+    __atomic_fetch_add(&check->numRows, numRows, __ATOMIC_RELAXED);
+
+    free(directory);
+    free(node);
+}
+
+void initialiseCatalog(void *node, uint32_t pageSize) {
+    setNodeType(node, CATALOG_NODE);
+    *catalogNumTables(node) = 0;
+    *catalogFreePage(node) = 0;
+    *catalogPageSize(node) = pageSize;
+}
+
+uint32_t *catalogPageSize(void *node) {
+    return (uint32_t *)((uint8_t *)node + CATALOG_PAGE_SIZE_OFFSET);
+}
+
+uint32_t *catalogNumTables(void *node) {
+    return (uint32_t *)((uint8_t *)node + CATALOG_NUM_TABLES_OFFSET);
+}
+
+uint32_t *catalogFreePage(void *node) {
+    return (uint32_t *)((uint8_t *)node + CATALOG_FREE_PAGE_OFFSET);
+}
+
+static uint8_t *catalogEntry(void *node, uint32_t tableNum) {
+    return (uint8_t *)node + CATALOG_HEADER_SIZE + tableNum * CATALOG_ENTRY_SIZE;
+}
+
+char *catalogTableName(void *node, uint32_t tableNum) {
+    return (char *)catalogEntry(node, tableNum) + CATALOG_TABLE_NAME_OFFSET;
+}
+
+uint32_t *catalogTableRoot(void *node, uint32_t tableNum) {
+    return (uint32_t *)(catalogEntry(node, tableNum) + CATALOG_TABLE_ROOT_OFFSET);
+}
+
+char *catalogTableSchema(void *node, uint32_t tableNum) {
+    return (char *)catalogEntry(node, tableNum) + CATALOG_TABLE_SCHEMA_OFFSET;
+}
+
+// Returns the catalog index of the table, or -1 if there is none
+int32_t catalogFindTable(Pager *pager, char *name) {
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    uint32_t numTables = *catalogNumTables(catalog);
+
+    for (uint32_t i = 0; i < numTables; i++) {
+        if (strncmp(catalogTableName(catalog, i), name, CATALOG_TABLE_NAME_SIZE) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Lsm tables own no pages, their rows are in run files next to the db file and in the memtable
+bool catalogHasLsmTables(Pager *pager) {
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    for (uint32_t i = 0; i < *catalogNumTables(catalog); i++) {
+        if (*catalogTableRoot(catalog, i) == INVALID_PAGE_NUM) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *keyColumnNames[] = { "id", "username", "email" };
+
+// Parses '(<column>, ...)' naming each column at most once
+bool parseKeyColumns(const char *text, KeyColumn *keyColumns, uint32_t *numKeyColumns) {
+    const char *p = text;
+    while (*p == ' ') p++;
+    if (*p++ != '(') {
+        return false;
+    }
+
+    *numKeyColumns = 0;
+    while (true) {
+        while (*p == ' ') p++;
+        size_t length = strcspn(p, " ,)");
+        int32_t column = -1;
+        for (uint32_t i = 0; i < sizeof(keyColumnNames) / sizeof(keyColumnNames[0]); i++) {
+            if (length == strlen(keyColumnNames[i]) && strncmp(p, keyColumnNames[i], length) == 0) {
+                column = i;
+            }
+        }
+        if (column == -1 || *numKeyColumns == KEY_MAX_COLUMNS) {
+            return false;
+        }
+        for (uint32_t i = 0; i < *numKeyColumns; i++) {
+            if (keyColumns[i] == (KeyColumn)column) {
+                return false;
+            }
+        }
+        keyColumns[(*numKeyColumns)++] = column;
+
+        p += length;
+        while (*p == ' ') p++;
+        if (*p == ')') {
+            break;
+        } else if (*p++ != ',') {
+            return false;
+        }
+    }
+
+    p++;
+    while (*p == ' ') p++;
+    return *p == '\0';
+}
+
+uint32_t keyColumnsSize(KeyColumn *keyColumns, uint32_t numKeyColumns) {
+    uint32_t keySize = 0;
+    for (uint32_t i = 0; i < numKeyColumns; i++) {
+        keySize += keyColumns[i] == KEY_USERNAME ? USERNAME_SIZE : keyColumns[i] == KEY_EMAIL ? EMAIL_SIZE : ID_SIZE;
+    }
+    return keySize;
+}
+
+// Reads a catalog schema, tables without a key clause are keyed by id
+bool parseSchema(char *schema, TableEngine *engine, KeyColumn *keyColumns, uint32_t *numKeyColumns) {
+    char text[CATALOG_TABLE_SCHEMA_SIZE + 1];
+    memcpy(text, schema, CATALOG_TABLE_SCHEMA_SIZE);
+    text[CATALOG_TABLE_SCHEMA_SIZE] = '\0';
+
+    keyColumns[0] = KEY_ID;
+    *numKeyColumns = 1;
+    if (strcmp(text, ROW_SCHEMA) == 0) {
+        *engine = ENGINE_BTREE;
+    } else if (strcmp(text, LSM_SCHEMA) == 0) {
+        *engine = ENGINE_LSM;
+    } else if (strcmp(text, HASH_SCHEMA) == 0) {
+        *engine = ENGINE_HASH;
+    } else if (strncmp(text, ROW_SCHEMA KEY_SCHEMA, strlen(ROW_SCHEMA KEY_SCHEMA)) == 0) {
+        *engine = ENGINE_BTREE;
+        return parseKeyColumns(text + strlen(ROW_SCHEMA KEY_SCHEMA), keyColumns, numKeyColumns);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+Table *tableOpen(Pager *pager, char *name) {
+    int32_t tableNum = catalogFindTable(pager, name);
+    if (tableNum == -1) {
+        return NULL;
+    }
+
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    char *schema = catalogTableSchema(catalog, tableNum);
+    TableEngine engine;
+    KeyColumn keyColumns[KEY_MAX_COLUMNS];
+    uint32_t numKeyColumns;
+    if (!parseSchema(schema, &engine, keyColumns, &numKeyColumns)) {
+        printf("Table %s has unsupported schema %.*s\n", name, CATALOG_TABLE_SCHEMA_SIZE, schema);
+        return NULL;
+    }
+    if (engine == ENGINE_LSM && pager->shared != NULL) {
+        printf("Lsm table %s cannot be used in a shared database\n", name);
+        return NULL;
+    }
+
+    Table *table = malloc(sizeof(Table));
+    table->pager = pager;
+    table->rootPageNum = *catalogTableRoot(catalog, tableNum);
+    table->rightmostLeafPageNum = INVALID_PAGE_NUM;
+    snprintf(table->name, sizeof(table->name), "%s", name);
+    table->engine = engine;
+    table->lsm = NULL;
+    table->numKeyColumns = numKeyColumns;
+    memcpy(table->keyColumns, keyColumns, numKeyColumns * sizeof(KeyColumn));
+    table->keySize = keyColumnsSize(keyColumns, numKeyColumns);
+    table->hashBuckets = NULL;
+
+    if (engine == ENGINE_LSM) {
+        // Run files sit next to the database file as <db>.<table>.<run>.run
+        char *prefix = malloc(strlen(pager->fileName) + strlen(name) + 2);
+        sprintf(prefix, "%s.%s", pager->fileName, name);
+        table->lsm = lsmOpen(prefix);
+        free(prefix);
+    } else if (engine == ENGINE_HASH) {
+        hashTableLoad(table);
+    }
+
+    return table;
+}
+
+void tableClose(Table *table) {
+    if (table == NULL) {
+        return;
+    }
+    if (table->lsm != NULL) {
+        lsmClose(table->lsm, false);
+    }
+    free(table->hashBuckets);
+    free(table);
+}
+
+// Whether the catalog still has the table at the same root with the same schema, so an open table
+// only needs what it cached from its pages read again
+bool tableCatalogUnchanged(Table *table) {
+    int32_t tableNum = catalogFindTable(table->pager, table->name);
+    if (tableNum == -1) {
+        return false;
+    }
+
+    void *catalog = getPage(table->pager, CATALOG_PAGE_NUM);
+    TableEngine engine;
+    KeyColumn keyColumns[KEY_MAX_COLUMNS];
+    uint32_t numKeyColumns;
+    return *catalogTableRoot(catalog, tableNum) == table->rootPageNum &&
+        parseSchema(catalogTableSchema(catalog, tableNum), &engine, keyColumns, &numKeyColumns) &&
+        engine == table->engine && numKeyColumns == table->numKeyColumns &&
+        memcmp(keyColumns, table->keyColumns, numKeyColumns * sizeof(KeyColumn)) == 0;
+}
+
+// A table keyed by id alone takes no key columns
+bool createTable(Pager *pager, char *name, TableEngine engine, KeyColumn *keyColumns, uint32_t numKeyColumns) {
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    uint32_t numTables = *catalogNumTables(catalog);
+
+    if (numTables >= CATALOG_MAX_TABLES(pager->pageSize)) {
+        printf("Catalog is full\n");
+        return false;
+    }
+    if (catalogFindTable(pager, name) != -1) {
+        printf("Table %s already exists\n", name);
+        return false;
+    }
+
+    if (numKeyColumns == 1 && keyColumns[0] == KEY_ID) {
+        numKeyColumns = 0;
+    }
+    if (numKeyColumns > 0 && engine != ENGINE_BTREE) {
+        printf("Only btree tables take a key\n");
+        return false;
+    }
+    if (engine == ENGINE_LSM && pager->inMemory) {
+        printf("Lsm tables keep their runs in files, so need a database file\n");
+        return false;
+    }
+    if (engine == ENGINE_LSM && pager->shared != NULL) {
+        printf("Lsm tables keep their memtable in one process, so cannot be shared\n");
+        return false;
+    }
+
+    // LSM tables keep their rows in run files and own no pages
+    uint32_t rootPageNum = INVALID_PAGE_NUM;
+    char schema[CATALOG_TABLE_SCHEMA_SIZE] = ROW_SCHEMA;
+    if (engine == ENGINE_BTREE) {
+        KeyColumn idKey = KEY_ID;
+        if (numKeyColumns > 0) {
+            strcat(schema, KEY_SCHEMA "(");
+            for (uint32_t i = 0; i < numKeyColumns; i++) {
+                strcat(schema, keyColumnNames[keyColumns[i]]);
+                strcat(schema, i + 1 < numKeyColumns ? ", " : ")");
+            }
+        } else {
+            keyColumns = &idKey;
+            numKeyColumns = 1;
+        }
+        rootPageNum = getUnusedPageNum(pager);
+        void *rootNode = getPage(pager, rootPageNum);
+        initialiseLeafNode(rootNode, keyColumnsSize(keyColumns, numKeyColumns));
+        setNodeRoot(rootNode, true);
+    } else if (engine == ENGINE_HASH) {
+        rootPageNum = getUnusedPageNum(pager);
+        initialiseHashTable(pager, rootPageNum);
+        strcpy(schema, HASH_SCHEMA);
+    } else {
+        strcpy(schema, LSM_SCHEMA);
+    }
+
+    memset(catalogEntry(catalog, numTables), 0, CATALOG_ENTRY_SIZE);
+    snprintf(catalogTableName(catalog, numTables), CATALOG_TABLE_NAME_SIZE, "%s", name);
+    snprintf(catalogTableSchema(catalog, numTables), CATALOG_TABLE_SCHEMA_SIZE, "%s", schema);
+    *catalogTableRoot(catalog, numTables) = rootPageNum;
+    *catalogNumTables(catalog) = numTables + 1;
+
+    return true;
+}
+
+// Pushes the page onto the free list kept in the catalog
+void freePage(Pager *pager, uint32_t pageNum) {
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    void *page = getPage(pager, pageNum);
+
+    memset(page, 0, pager->pageSize);
+    setNodeType(page, FREE_NODE);
+    *(uint32_t *)((uint8_t *)page + FREE_NODE_NEXT_OFFSET) = *catalogFreePage(catalog);
+    *catalogFreePage(catalog) = pageNum;
+}
+
+void freeTree(Pager *pager, uint32_t pageNum) {
+    pagerUnswizzle(pager);
+    void *node = getPage(pager, pageNum);
+
+    if (getNodeType(node) == HASH_HEADER_NODE) {
+        uint32_t numBuckets = hashNumBuckets(node);
+        for (uint32_t bucketNum = 0; bucketNum < numBuckets; bucketNum++) {
+            for (uint32_t bucketPageNum = *hashBucketPage(pager, node, bucketNum); bucketPageNum != 0;) {
+                uint32_t nextPageNum = *hashBucketOverflow(getPage(pager, bucketPageNum));
+                freePage(pager, bucketPageNum);
+                bucketPageNum = nextPageNum;
+            }
+        }
+        for (uint32_t i = 0; i < *hashHeaderNumDirectoryPages(node); i++) {
+            freePage(pager, *hashHeaderDirectoryPage(node, i));
+        }
+    } else if (getNodeType(node) == INTERNAL_NODE) {
+        uint32_t numKeys = *internalNodeNumKeys(node);
+        for (uint32_t i = 0; i < numKeys; i++) {
+            freeTree(pager, *internalNodeCell(node, i));
+        }
+        if (*internalNodeRightChild(node) != INVALID_PAGE_NUM) {
+            freeTree(pager, *internalNodeRightChild(node));
+        }
+    }
+
+    freePage(pager, pageNum);
+}
+
+bool isTableName(char *name) {
+    if (name == NULL || *name == '\0' || strlen(name) > MAX_TABLE_NAME_SIZE) {
+        return false;
+    }
+    for (int i = 0; name[i]; i++) {
+        if (!(name[i] == '_' || (name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') ||
+            (name[i] >= '0' && name[i] <= '9'))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void doCreateTable(Database *database) {
+    char *keyword = strtok(NULL, " ");
+    char *name = strtok(NULL, " ");
+    char *rest = strtok(NULL, "");
+    TableEngine engine = ENGINE_BTREE;
+    KeyColumn keyColumns[KEY_MAX_COLUMNS];
+    uint32_t numKeyColumns = 0;
+
+    if (keyword == NULL || strcmp(keyword, "table") != 0) {
+        printf("Usage: create table <name> [using btree/lsm/hash] [key (<column>, ...)]\n");
+        return;
+    }
+    if (!isTableName(name)) {
+        printf("Invalid table name\n");
+        return;
+    }
+    while (rest != NULL && *rest == ' ') rest++;
+    if (rest != NULL && strncmp(rest, "using ", 6) == 0) {
+        char *engineName = rest + 6;
+        while (*engineName == ' ') engineName++;
+        size_t length = strcspn(engineName, " ");
+        rest = engineName + length;
+        if (length == 3 && strncmp(engineName, "lsm", 3) == 0) {
+            engine = ENGINE_LSM;
+        } else if (length == 4 && strncmp(engineName, "hash", 4) == 0) {
+            engine = ENGINE_HASH;
+        } else if (length != 5 || strncmp(engineName, "btree", 5) != 0) {
+            printf("Unknown engine %.*s\n", (int)length, engineName);
+            return;
+        }
+        while (*rest == ' ') rest++;
+    }
+    if (rest != NULL && *rest != '\0') {
+        if (strncmp(rest, "key", 3) != 0 || !parseKeyColumns(rest + 3, keyColumns, &numKeyColumns)) {
+            printf("Usage: create table <name> [using btree/lsm/hash] [key (<column>, ...)]\n");
+            return;
+        }
+    }
+
+    // Replication ships pages, which an lsm table has none of
+    if (engine == ENGINE_LSM && database->replication != NULL) {
+        printf("Lsm tables keep their rows outside the db file, so cannot be replicated\n");
+        return;
+    }
+    if (createTable(database->pager, name, engine, keyColumns, numKeyColumns)) {
+        printf("Created table %s\n", name);
+    }
+}
+
+void doDropTable(Database *database) {
+    char *keyword = strtok(NULL, " ");
+    char *name = strtok(NULL, " ");
+
+    if (keyword == NULL || strcmp(keyword, "table") != 0 || name == NULL) {
+        printf("Usage: drop table <name>\n");
+        return;
+    }
+
+    Pager *pager = database->pager;
+    int32_t tableNum = catalogFindTable(pager, name);
+    if (tableNum == -1) {
+        printf("No table %s\n", name);
+        return;
+    }
+
+    Table *table = NULL;
+    if (database->currentTable != NULL && strcmp(database->currentTable->name, name) == 0) {
+        table = database->currentTable;
+        database->currentTable = NULL;
+    }
+
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    if (*catalogTableRoot(catalog, tableNum) == INVALID_PAGE_NUM) {
+        if (table == NULL) {
+            table = tableOpen(pager, name);
+        }
+        if (table != NULL && table->lsm != NULL) {
+            lsmClose(table->lsm, true);
+            table->lsm = NULL;
+        }
+    } else {
+        freeTree(pager, *catalogTableRoot(catalog, tableNum));
+    }
+    tableClose(table);
+
+    catalog = getPage(pager, CATALOG_PAGE_NUM);
+    uint32_t numTables = *catalogNumTables(catalog);
+    memmove(catalogEntry(catalog, tableNum), catalogEntry(catalog, tableNum + 1),
+        (numTables - tableNum - 1) * CATALOG_ENTRY_SIZE);
+    *catalogNumTables(catalog) = numTables - 1;
+
+    printf("Dropped table %s\n", name);
+}
+
+void doUseTable(Database *database) {
+    char *name = strtok(NULL, " ");
+    if (name == NULL) {
+        printf("Table name missing\n");
+        return;
+    }
+
+    // Reopening an LSM table would start a second worker on the same files
+    if (database->currentTable != NULL && strcmp(database->currentTable->name, name) == 0) {
+        printf("Using table %s\n", name);
+        return;
+    }
+
+    Table *table = tableOpen(database->pager, name);
+    if (table == NULL) {
+        printf("No table %s\n", name);
+        return;
+    }
+
+    tableClose(database->currentTable);
+    database->currentTable = table;
+    printf("Using table %s\n", name);
+}
+
+void printTables(Pager *pager) {
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    uint32_t numTables = *catalogNumTables(catalog);
+
+    for (uint32_t i = 0; i < numTables; i++) {
+        if (*catalogTableRoot(catalog, i) == INVALID_PAGE_NUM) {
+            printf("%s (run files): %s\n", catalogTableName(catalog, i), catalogTableSchema(catalog, i));
+            continue;
+        }
+        printf("%s (root page %d): %s\n", catalogTableName(catalog, i), *catalogTableRoot(catalog, i),
+            catalogTableSchema(catalog, i));
+    }
+}
+
+const char *tableEngineName(TableEngine engine) {
+    if (engine == ENGINE_LSM) {
+        return "lsm";
+    } else if (engine == ENGINE_HASH) {
+        return "hash";
+    }
+    return "btree";
+}
+
+// A header, one directory page and one empty bucket
+void initialiseHashTable(Pager *pager, uint32_t headerPageNum) {
+    void *header = getPage(pager, headerPageNum);
+    setNodeType(header, HASH_HEADER_NODE);
+    setNodeRoot(header, true);
+    *hashHeaderLevel(header) = 0;
+    *hashHeaderSplit(header) = 0;
+    *hashHeaderNumRows(header) = 0;
+    *hashHeaderNumDirectoryPages(header) = 1;
+
+    uint32_t directoryPageNum = getUnusedPageNum(pager);
+    setNodeType(getPage(pager, directoryPageNum), HASH_DIRECTORY_NODE);
+    *hashHeaderDirectoryPage(header, 0) = directoryPageNum;
+
+    uint32_t bucketPageNum = getUnusedPageNum(pager);
+    initialiseHashBucket(getPage(pager, bucketPageNum));
+    *hashBucketPage(pager, header, 0) = bucketPageNum;
+}
+
+void initialiseHashBucket(void *node) {
+    setNodeType(node, HASH_BUCKET_NODE);
+    *hashBucketNumCells(node) = 0;
+    *hashBucketOverflow(node) = 0;
+}
+
+uint32_t *hashHeaderLevel(void *node) {
+    return (uint32_t *)((uint8_t *)node + HASH_HEADER_LEVEL_OFFSET);
+}
+
+uint32_t *hashHeaderSplit(void *node) {
+    return (uint32_t *)((uint8_t *)node + HASH_HEADER_SPLIT_OFFSET);
+}
+
+uint32_t *hashHeaderNumRows(void *node) {
+    return (uint32_t *)((uint8_t *)node + HASH_HEADER_NUM_ROWS_OFFSET);
+}
+
+uint32_t *hashHeaderNumDirectoryPages(void *node) {
+    return (uint32_t *)((uint8_t *)node + HASH_HEADER_NUM_DIRECTORY_PAGES_OFFSET);
+}
+
+uint32_t *hashHeaderDirectoryPage(void *node, uint32_t index) {
+    return (uint32_t *)((uint8_t *)node + HASH_HEADER_SIZE) + index;
+}
+
+uint32_t *hashDirectoryBucket(void *node, uint32_t index) {
+    return (uint32_t *)((uint8_t *)node + HASH_DIRECTORY_HEADER_SIZE) + index;
+}
+
+uint32_t *hashBucketNumCells(void *node) {
+    return (uint32_t *)((uint8_t *)node + HASH_BUCKET_NUM_CELLS_OFFSET);
+}
+
+uint32_t *hashBucketOverflow(void *node) {
+    return (uint32_t *)((uint8_t *)node + HASH_BUCKET_OVERFLOW_OFFSET);
+}
+
+uint64_t *hashBucketKey(void *node, uint32_t cellNum) {
+    return (uint64_t *)((uint8_t *)node + HASH_BUCKET_HEADER_SIZE) + cellNum;
+}
+
+void *hashBucketValue(void *node, uint32_t pageSize, uint32_t cellNum) {
+    return (uint8_t *)node + HASH_BUCKET_HEADER_SIZE + HASH_BUCKET_MAX_CELLS(pageSize) * sizeof(uint64_t) +
+        cellNum * ROW_SIZE;
+}
+
+// Ids are often sequential, mix them so every bit of the hash depends on the whole key
+static uint32_t hashKey(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+uint32_t hashNumBuckets(void *header) {
+    return (1u << *hashHeaderLevel(header)) + *hashHeaderSplit(header);
+}
+
+// Buckets before the split pointer have already been split this round and use one more bit of the hash
+uint32_t hashBucketNum(uint32_t level, uint32_t split, uint64_t key) {
+    uint32_t hash = hashKey(key);
+    uint32_t bucketNum = hash & ((1u << level) - 1);
+    if (bucketNum < split) {
+        bucketNum = hash & ((2u << level) - 1);
+    }
+    return bucketNum;
+}
+
+// The directory slot holding the first page of the bucket
+uint32_t *hashBucketPage(Pager *pager, void *header, uint32_t bucketNum) {
+    uint32_t bucketsPerPage = HASH_DIRECTORY_MAX_BUCKETS(pager->pageSize);
+    void *directory = getPage(pager, *hashHeaderDirectoryPage(header, bucketNum / bucketsPerPage));
+    return hashDirectoryBucket(directory, bucketNum % bucketsPerPage);
+}
+
+// Copies the header fields and the directory into the table. Room is kept for every bucket of the
+// current level, so splits only grow it once per level.
+void hashTableLoad(Table *table) {
+    void *header = getPage(table->pager, table->rootPageNum);
+    table->hashLevel = *hashHeaderLevel(header);
+    table->hashSplit = *hashHeaderSplit(header);
+    table->hashBuckets = malloc((2u << table->hashLevel) * sizeof(uint32_t));
+
+    uint32_t numBuckets = hashNumBuckets(header);
+    for (uint32_t bucketNum = 0; bucketNum < numBuckets; bucketNum++) {
+        table->hashBuckets[bucketNum] = *hashBucketPage(table->pager, header, bucketNum);
+    }
+}
+
+// Looks for key in its bucket. On success leaves the page and cell holding it, either way leaves the
+// bucket's first page.
+bool hashFind(Table *table, uint64_t key, uint32_t *bucketPageNum, uint32_t *pageNum, uint32_t *cellNum) {
+    *bucketPageNum = table->hashBuckets[hashBucketNum(table->hashLevel, table->hashSplit, key)];
+
+    for (uint32_t chainPageNum = *bucketPageNum; chainPageNum != 0;) {
+        void *node = getPage(table->pager, chainPageNum);
+        uint32_t numCells = *hashBucketNumCells(node);
+        uint64_t *keys = hashBucketKey(node, 0);
+        for (uint32_t i = 0; i < numCells; i++) {
+            if (keys[i] == key) {
+                *pageNum = chainPageNum;
+                *cellNum = i;
+                return true;
+            }
+        }
+        chainPageNum = *hashBucketOverflow(node);
+    }
+
+    return false;
+}
+
+// Adds a cell to the last page of a bucket's chain, chaining on an overflow page when that one is full.
+// Every page but the last is kept full.
+static void hashBucketAppend(Pager *pager, uint32_t pageNum, uint64_t key, uint8_t *value) {
+    void *node = getPage(pager, pageNum);
+    while (*hashBucketOverflow(node) != 0) {
+        node = getPage(pager, *hashBucketOverflow(node));
+    }
+
+    if (*hashBucketNumCells(node) >= HASH_BUCKET_MAX_CELLS(pager->pageSize)) {
+        uint32_t overflowPageNum = getUnusedPageNum(pager);
+        void *overflow = getPage(pager, overflowPageNum);
+        initialiseHashBucket(overflow);
+        *hashBucketOverflow(node) = overflowPageNum;
+        node = overflow;
+    }
+
+    uint32_t cellNum = (*hashBucketNumCells(node))++;
+    *hashBucketKey(node, cellNum) = key;
+    memcpy(hashBucketValue(node, pager->pageSize, cellNum), value, ROW_SIZE);
+}
+
+// Empties a bucket, returning a copy of its cells as id and row pairs and freeing its overflow pages
+static uint8_t *hashBucketTake(Pager *pager, uint32_t pageNum, uint32_t *numCells) {
+    uint32_t capacity = HASH_BUCKET_MAX_CELLS(pager->pageSize);
+    uint8_t *cells = malloc((size_t)capacity * HASH_CELL_SIZE);
+    *numCells = 0;
+
+    for (uint32_t chainPageNum = pageNum; chainPageNum != 0;) {
+        void *node = getPage(pager, chainPageNum);
+        uint32_t pageCells = *hashBucketNumCells(node);
+        if (*numCells + pageCells > capacity) {
+            capacity *= 2;
+            cells = realloc(cells, (size_t)capacity * HASH_CELL_SIZE);
+        }
+        for (uint32_t i = 0; i < pageCells; i++) {
+            uint8_t *cell = cells + (size_t)(*numCells)++ * HASH_CELL_SIZE;
+            memcpy(cell, hashBucketKey(node, i), sizeof(uint64_t));
+            memcpy(cell + sizeof(uint64_t), hashBucketValue(node, pager->pageSize, i), ROW_SIZE);
+        }
+
+        uint32_t nextPageNum = *hashBucketOverflow(node);
+        if (chainPageNum != pageNum) {
+            freePage(pager, chainPageNum);
+        }
+        chainPageNum = nextPageNum;
+    }
+
+    void *node = getPage(pager, pageNum);
+    *hashBucketNumCells(node) = 0;
+    *hashBucketOverflow(node) = 0;
+    return cells;
+}
+
+// Splits the bucket under the split pointer into itself and a new bucket at the end of the directory.
+// Only that bucket's rows move, there is never a rehash of the whole table.
+static void hashSplit(Table *table) {
+    Pager *pager = table->pager;
+    void *header = getPage(pager, table->rootPageNum);
+    uint32_t level = *hashHeaderLevel(header);
+    uint32_t bucketNum = *hashHeaderSplit(header);
+    uint32_t newBucketNum = hashNumBuckets(header);
+
+    if (newBucketNum % HASH_DIRECTORY_MAX_BUCKETS(pager->pageSize) == 0) {
+        uint32_t numDirectoryPages = *hashHeaderNumDirectoryPages(header);
+        if (numDirectoryPages == HASH_HEADER_MAX_DIRECTORY_PAGES(pager->pageSize)) {
+            // The directory is full, from here on buckets only grow longer chains
+            return;
+        }
+        uint32_t directoryPageNum = getUnusedPageNum(pager);
+        setNodeType(getPage(pager, directoryPageNum), HASH_DIRECTORY_NODE);
+        *hashHeaderDirectoryPage(header, numDirectoryPages) = directoryPageNum;
+        *hashHeaderNumDirectoryPages(header) = numDirectoryPages + 1;
+    }
+
+    uint32_t newPageNum = getUnusedPageNum(pager);
+    initialiseHashBucket(getPage(pager, newPageNum));
+    *hashBucketPage(pager, header, newBucketNum) = newPageNum;
+    table->hashBuckets[newBucketNum] = newPageNum;
+
+    uint32_t pageNum = table->hashBuckets[bucketNum];
+    uint32_t numCells;
+    uint8_t *cells = hashBucketTake(pager, pageNum, &numCells);
+    uint32_t mask = (2u << level) - 1;
+    for (uint32_t i = 0; i < numCells; i++) {
+        uint8_t *cell = cells + (size_t)i * HASH_CELL_SIZE;
+        uint64_t key;
+        memcpy(&key, cell, sizeof(uint64_t));
+        hashBucketAppend(pager, (hashKey(key) & mask) == bucketNum ? pageNum : newPageNum, key,
+            cell + sizeof(uint64_t));
+    }
+    free(cells);
+
+    if (bucketNum + 1 == (1u << level)) {
+        *hashHeaderLevel(header) = level + 1;
+        *hashHeaderSplit(header) = 0;
+        table->hashBuckets = realloc(table->hashBuckets, (4u << level) * sizeof(uint32_t));
+    } else {
+        *hashHeaderSplit(header) = bucketNum + 1;
+    }
+    table->hashLevel = *hashHeaderLevel(header);
+    table->hashSplit = *hashHeaderSplit(header);
+}
+
+bool hashInsert(Table *table, Row *row) {
+    Pager *pager = table->pager;
+    uint32_t bucketPageNum, pageNum, cellNum;
+    if (hashFind(table, row->id, &bucketPageNum, &pageNum, &cellNum)) {
+        return false;
+    }
+
+    uint8_t value[ROW_SIZE];
+    serialiseRow(row, value);
+    hashBucketAppend(pager, bucketPageNum, row->id, value);
+
+    void *header = getPage(pager, table->rootPageNum);
+    uint64_t numRows = ++*hashHeaderNumRows(header);
+    if (numRows * 100 > (uint64_t)hashNumBuckets(header) * HASH_BUCKET_MAX_CELLS(pager->pageSize) * HASH_MAX_LOAD) {
+        hashSplit(table);
+    }
+    return true;
+}
+
+// Fills the hole with the last cell of the bucket, freeing the last overflow page once it is empty
+bool hashDelete(Table *table, uint64_t key) {
+    Pager *pager = table->pager;
+    uint32_t bucketPageNum, pageNum, cellNum;
+    if (!hashFind(table, key, &bucketPageNum, &pageNum, &cellNum)) {
+        return false;
+    }
+
+    uint32_t previousPageNum = 0;
+    uint32_t lastPageNum = bucketPageNum;
+    void *last = getPage(pager, lastPageNum);
+    while (*hashBucketOverflow(last) != 0) {
+        previousPageNum = lastPageNum;
+        lastPageNum = *hashBucketOverflow(last);
+        last = getPage(pager, lastPageNum);
+    }
+
+    uint32_t lastCellNum = *hashBucketNumCells(last) - 1;
+    if (pageNum != lastPageNum || cellNum != lastCellNum) {
+        void *node = getPage(pager, pageNum);
+        *hashBucketKey(node, cellNum) = *hashBucketKey(last, lastCellNum);
+        memcpy(hashBucketValue(node, pager->pageSize, cellNum), hashBucketValue(last, pager->pageSize, lastCellNum),
+            ROW_SIZE);
+    }
+    *hashBucketNumCells(last) = lastCellNum;
+    if (lastCellNum == 0 && previousPageNum != 0) {
+        *hashBucketOverflow(getPage(pager, previousPageNum)) = 0;
+        freePage(pager, lastPageNum);
+    }
+
+    (*hashHeaderNumRows(getPage(pager, table->rootPageNum)))--;
+    return true;
+}
+
+// Ids are scattered over every bucket, so a range wider than the table is cheaper as one pass over
+// all of them than as a point delete per id
+uint32_t hashDeleteRange(Table *table, uint64_t lowerId, uint64_t upperId) {
+    Pager *pager = table->pager;
+    void *header = getPage(pager, table->rootPageNum);
+    uint32_t numDeleted = 0;
+
+    if (upperId - lowerId < *hashHeaderNumRows(header)) {
+        for (uint64_t i = 0; i <= upperId - lowerId; i++) {
+            numDeleted += hashDelete(table, lowerId + i);
+        }
+        return numDeleted;
+    }
+
+    uint32_t numBuckets = hashNumBuckets(header);
+    for (uint32_t bucketNum = 0; bucketNum < numBuckets; bucketNum++) {
+        uint32_t pageNum = table->hashBuckets[bucketNum];
+        uint32_t numCells;
+        uint8_t *cells = hashBucketTake(pager, pageNum, &numCells);
+        for (uint32_t i = 0; i < numCells; i++) {
+            uint8_t *cell = cells + (size_t)i * HASH_CELL_SIZE;
+            uint64_t key;
+            memcpy(&key, cell, sizeof(uint64_t));
+            if (key >= lowerId && key <= upperId) {
+                numDeleted++;
+            } else {
+                hashBucketAppend(pager, pageNum, key, cell + sizeof(uint64_t));
+            }
+        }
+        free(cells);
+    }
+
+    *hashHeaderNumRows(header) -= numDeleted;
+    return numDeleted;
+}
+
+// Keys come sorted from the caller, rows are returned in the same order
+uint32_t hashMultiGet(Table *table, uint64_t *keys, uint32_t numKeys, Row *rows) {
+    uint32_t numFound = 0;
+
+    for (uint32_t k = 0; k < numKeys; k++) {
+        uint32_t bucketPageNum, pageNum, cellNum;
+        if (hashFind(table, keys[k], &bucketPageNum, &pageNum, &cellNum)) {
+            deserialiseRow(hashBucketValue(getPage(table->pager, pageNum), table->pager->pageSize, cellNum),
+                &rows[numFound++]);
+        }
+    }
+
+    return numFound;
+}
+
+// Scans bucket by bucket, rows come out in no particular order
+Cursor *hashTableStart(Table *table) {
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->lsm = NULL;
+    cursor->bucketNum = 0;
+    cursor->pageNum = table->hashBuckets[0];
+    cursor->cellNum = 0;
+    cursor->endOfTable = false;
+    hashCursorSettle(cursor);
+
+    return cursor;
+}
+
+// Moves a cursor past the end of its page on to the next row in the chain or the following buckets
+void hashCursorSettle(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    void *node = getPage(pager, cursor->pageNum);
+
+    while (cursor->cellNum >= *hashBucketNumCells(node)) {
+        if (*hashBucketOverflow(node) != 0) {
+            cursor->pageNum = *hashBucketOverflow(node);
+        } else {
+            Table *table = cursor->table;
+            if (cursor->bucketNum + 1 >= (1u << table->hashLevel) + table->hashSplit) {
+                cursor->endOfTable = true;
+                return;
+            }
+            cursor->bucketNum++;
+            cursor->pageNum = table->hashBuckets[cursor->bucketNum];
+        }
+        cursor->cellNum = 0;
+        node = getPage(pager, cursor->pageNum);
+    }
+}
+
+void printHashTable(Pager *pager, void *header, uint32_t indentationLevel) {
+    uint32_t numBuckets = hashNumBuckets(header);
+    indent(indentationLevel);
+    printf("- hash (level %d, split %d, rows %d)\n", *hashHeaderLevel(header), *hashHeaderSplit(header),
+        *hashHeaderNumRows(header));
+
+    for (uint32_t bucketNum = 0; bucketNum < numBuckets; bucketNum++) {
+        indent(indentationLevel + 1);
+        printf("- bucket %d\n", bucketNum);
+        for (uint32_t pageNum = *hashBucketPage(pager, header, bucketNum); pageNum != 0;) {
+            void *node = getPage(pager, pageNum);
+            uint32_t numCells = *hashBucketNumCells(node);
+            indent(indentationLevel + 2);
+            printf("- page %d (size %d)\n", pageNum, numCells);
+            for (uint32_t i = 0; i < numCells; i++) {
+                indent(indentationLevel + 3);
+                printf("- %llu\n", (unsigned long long)*hashBucketKey(node, i));
+            }
+            pageNum = *hashBucketOverflow(node);
+        }
+    }
+}
+
+LsmMemtable *lsmMemtableNew(void) {
+    LsmMemtable *memtable = malloc(sizeof(LsmMemtable));
+    memtable->head = calloc(1, sizeof(LsmNode) + LSM_MAX_HEIGHT * sizeof(LsmNode *) + ROW_SIZE);
+    memtable->head->height = LSM_MAX_HEIGHT;
+    memtable->height = 1;
+    memtable->numEntries = 0;
+    memtable->size = 0;
+    memtable->random = 0x9e3779b97f4a7c15ull;
+    return memtable;
+}
+
+static uint8_t *lsmNodeRow(LsmNode *node) {
+    return (uint8_t *)&node->next[node->height];
+}
+
+void lsmMemtableFree(LsmMemtable *memtable) {
+    LsmNode *node = memtable->head;
+    while (node != NULL) {
+        LsmNode *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    free(memtable);
+}
+
+// Returns the first node with a key of at least key
+LsmNode *lsmMemtableSeek(LsmMemtable *memtable, uint64_t key) {
+    LsmNode *node = memtable->head;
+    for (uint32_t level = memtable->height; level > 0; level--) {
+        while (node->next[level - 1] != NULL && node->next[level - 1]->key < key) {
+            node = node->next[level - 1];
+        }
+    }
+    return node->next[0];
+}
+
+// Adds or replaces the entry for key, a tombstone has no row
+void lsmMemtablePut(LsmMemtable *memtable, uint64_t key, bool tombstone, uint8_t *row) {
+    LsmNode *update[LSM_MAX_HEIGHT];
+    LsmNode *node = memtable->head;
+    for (uint32_t level = memtable->height; level > 0; level--) {
+        while (node->next[level - 1] != NULL && node->next[level - 1]->key < key) {
+            node = node->next[level - 1];
+        }
+        update[level - 1] = node;
+    }
+
+    node = node->next[0];
+    if (node == NULL || node->key != key) {
+        // Each level up holds a quarter of the nodes of the one below
+        uint32_t height = 1;
+        memtable->random ^= memtable->random << 13;
+        memtable->random ^= memtable->random >> 7;
+        memtable->random ^= memtable->random << 17;
+        for (uint64_t bits = memtable->random; height < LSM_MAX_HEIGHT && (bits & 3) == 0; bits >>= 2) {
+            height++;
+        }
+        for (uint32_t level = memtable->height; level < height; level++) {
+            update[level] = memtable->head;
+        }
+        if (height > memtable->height) {
+            memtable->height = height;
+        }
+
+        size_t size = sizeof(LsmNode) + height * sizeof(LsmNode *) + ROW_SIZE;
+        node = malloc(size);
+        node->key = key;
+        node->height = height;
+        for (uint32_t level = 0; level < height; level++) {
+            node->next[level] = update[level]->next[level];
+            update[level]->next[level] = node;
+        }
+        memtable->numEntries++;
+        memtable->size += size;
+    }
+
+    node->tombstone = tombstone;
+    if (tombstone) {
+        memset(lsmNodeRow(node), 0, ROW_SIZE);
+    } else {
+        memcpy(lsmNodeRow(node), row, ROW_SIZE);
+    }
+}
+
+static uint32_t lsmHash(uint64_t key, uint32_t seed) {
+    uint64_t hash = key ^ seed;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+// Sets or tests the Bloom filter bits for key. All of a key's bits share one 64 bit word, so a test
+// costs a single cache miss however many hashes there are.
+static bool lsmBloom(uint8_t *bloom, uint32_t bloomBits, uint64_t key, bool add) {
+    uint64_t *word = (uint64_t *)bloom + lsmHash(key, 0) % (bloomBits / 64);
+    uint64_t hash = (uint64_t)lsmHash(key, 0x9e3779b9) << 32 | lsmHash(key, 0x7f4a7c15);
+    uint64_t mask = 0;
+    for (uint32_t i = 0; i < LSM_BLOOM_HASHES; i++) {
+        mask |= 1ull << (hash & 63);
+        hash >>= 6;
+    }
+
+    if (add) {
+        *word |= mask;
+    }
+    return (*word & mask) == mask;
+}
+
+static char *lsmRunFileName(Lsm *lsm, uint64_t id) {
+    char *fileName = malloc(strlen(lsm->prefix) + strlen(LSM_RUN_SUFFIX) + 22);
+    sprintf(fileName, "%s.%llu%s", lsm->prefix, (unsigned long long)id, LSM_RUN_SUFFIX);
+    return fileName;
+}
+
+static void lsmReadAll(int fileDescriptor, void *buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t bytesRead = pread(fileDescriptor, (uint8_t *)buffer + done, length - done, offset + done);
+        if (bytesRead <= 0) {
+            if (bytesRead == -1 && errno == EINTR) continue;
+            printf("Error reading run file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        done += bytesRead;
+    }
+}
+
+LsmRun *lsmRunOpen(Lsm *lsm, uint64_t id, uint32_t level) {
+    char *fileName = lsmRunFileName(lsm, id);
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) {
+        printf("Unable to open run file %s\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+    free(fileName);
+
+    uint8_t header[LSM_RUN_HEADER_SIZE];
+    lsmReadAll(fd, header, LSM_RUN_HEADER_SIZE, 0);
+    if (*(uint32_t *)(header + LSM_RUN_MAGIC_OFFSET) != LSM_RUN_MAGIC) {
+        printf("Run file %llu of %s is corrupt\n", (unsigned long long)id, lsm->prefix);
+        exit(EXIT_FAILURE);
+    }
+
+    LsmRun *run = malloc(sizeof(LsmRun));
+    run->id = id;
+    run->level = level;
+    run->fileDescriptor = fd;
+    run->numEntries = *(uint32_t *)(header + LSM_RUN_NUM_ENTRIES_OFFSET);
+    run->numBlocks = *(uint32_t *)(header + LSM_RUN_NUM_BLOCKS_OFFSET);
+    memcpy(&run->maxKey, header + LSM_RUN_MAX_KEY_OFFSET, sizeof(uint64_t));
+    run->bloomBits = *(uint32_t *)(header + LSM_RUN_BLOOM_BITS_OFFSET);
+    run->blockKeys = malloc(run->numBlocks * sizeof(uint64_t) + 1);
+    run->bloom = malloc(run->bloomBits / 8);
+
+    off_t offset = LSM_RUN_HEADER_SIZE + (off_t)run->numEntries * LSM_ENTRY_SIZE;
+    lsmReadAll(fd, run->blockKeys, run->numBlocks * sizeof(uint64_t), offset);
+    lsmReadAll(fd, run->bloom, run->bloomBits / 8, offset + run->numBlocks * sizeof(uint64_t));
+    return run;
+}
+
+void lsmRunFree(Lsm *lsm, LsmRun *run, bool unlinkFile) {
+    close(run->fileDescriptor);
+    if (unlinkFile) {
+        char *fileName = lsmRunFileName(lsm, run->id);
+        unlink(fileName);
+        free(fileName);
+    }
+    free(run->blockKeys);
+    free(run->bloom);
+    free(run);
+}
+
+// Writes everything the merge produces into a new run file with sequential writes only. Returns NULL
+// when nothing is left, e.g. when the merge held nothing but dropped tombstones.
+LsmRun *lsmRunWrite(Lsm *lsm, LsmMerge *merge, uint64_t id, uint32_t level, uint32_t maxEntries,
+    bool dropTombstones) {
+    char *fileName = lsmRunFileName(lsm, id);
+    int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        printf("Unable to create run file %s\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+
+    LsmRun *run = malloc(sizeof(LsmRun));
+    run->id = id;
+    run->level = level;
+    run->fileDescriptor = fd;
+    run->numEntries = 0;
+    run->numBlocks = 0;
+    run->maxKey = 0;
+    run->blockKeys = malloc((maxEntries / LSM_BLOCK_ENTRIES + 1) * sizeof(uint64_t));
+    // Sized for every entry the merge could produce, duplicates only make it sparser
+    run->bloomBits = ((uint64_t)maxEntries * LSM_BLOOM_BITS_PER_KEY + 63) / 64 * 64;
+    if (run->bloomBits == 0) {
+        run->bloomBits = 64;
+    }
+    run->bloom = calloc(run->bloomBits / 8, 1);
+
+    OutputBuffer *outputBuffer = NewOutputBuffer(fd);
+    uint8_t entry[LSM_ENTRY_SIZE];
+    memset(entry, 0, LSM_RUN_HEADER_SIZE);
+    outputWrite(outputBuffer, entry, LSM_RUN_HEADER_SIZE);
+
+    while (lsmMergeNext(merge)) {
+        if (merge->tombstone && dropTombstones) {
+            continue;
+        }
+        if (run->numEntries % LSM_BLOCK_ENTRIES == 0) {
+            run->blockKeys[run->numBlocks++] = merge->key;
+        }
+        memcpy(entry + LSM_ENTRY_KEY_OFFSET, &merge->key, sizeof(uint64_t));
+        *(uint32_t *)(entry + LSM_ENTRY_FLAGS_OFFSET) = merge->tombstone ? LSM_ENTRY_TOMBSTONE : 0;
+        memcpy(entry + LSM_ENTRY_ROW_OFFSET, merge->row, ROW_SIZE);
+        outputWrite(outputBuffer, entry, LSM_ENTRY_SIZE);
+        lsmBloom(run->bloom, run->bloomBits, merge->key, true);
+        run->maxKey = merge->key;
+        run->numEntries++;
+    }
+
+    outputWrite(outputBuffer, run->blockKeys, run->numBlocks * sizeof(uint64_t));
+    outputWrite(outputBuffer, run->bloom, run->bloomBits / 8);
+    closeOutput(outputBuffer);
+
+    uint8_t header[LSM_RUN_HEADER_SIZE];
+    *(uint32_t *)(header + LSM_RUN_MAGIC_OFFSET) = LSM_RUN_MAGIC;
+    *(uint32_t *)(header + LSM_RUN_NUM_ENTRIES_OFFSET) = run->numEntries;
+    *(uint32_t *)(header + LSM_RUN_NUM_BLOCKS_OFFSET) = run->numBlocks;
+    memcpy(header + LSM_RUN_MAX_KEY_OFFSET, &run->maxKey, sizeof(uint64_t));
+    *(uint32_t *)(header + LSM_RUN_BLOOM_BITS_OFFSET) = run->bloomBits;
+    if (pwrite(fd, header, LSM_RUN_HEADER_SIZE, 0) != LSM_RUN_HEADER_SIZE || fsync(fd) == -1) {
+        printf("Error writing run file %s: %d\n", fileName, errno);
+        exit(EXIT_FAILURE);
+    }
+
+    if (run->numEntries == 0) {
+        unlink(fileName);
+        lsmRunFree(lsm, run, false);
+        run = NULL;
+    }
+    free(fileName);
+    return run;
+}
+
+// Looks key up in one run, copying its entry out when the run has one
+bool lsmRunFind(Lsm *lsm, LsmRun *run, uint64_t key, uint8_t *entry) {
+    if (key < run->blockKeys[0] || key > run->maxKey || !lsmBloom(run->bloom, run->bloomBits, key, false)) {
+        return false;
+    }
+
+    // The last block starting at or before key
+    uint32_t low = 0;
+    uint32_t high = run->numBlocks - 1;
+    while (low < high) {
+        uint32_t middle = low + (high - low + 1) / 2;
+        if (run->blockKeys[middle] <= key) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    uint32_t numEntries = run->numEntries - low * LSM_BLOCK_ENTRIES;
+    if (numEntries > LSM_BLOCK_ENTRIES) {
+        numEntries = LSM_BLOCK_ENTRIES;
+    }
+    lsmReadAll(run->fileDescriptor, lsm->block, numEntries * LSM_ENTRY_SIZE,
+        LSM_RUN_HEADER_SIZE + (off_t)low * LSM_BLOCK_SIZE);
+
+    uint32_t minIndex = 0;
+    uint32_t onePastMaxIndex = numEntries;
+    while (minIndex != onePastMaxIndex) {
+        uint32_t index = minIndex + (onePastMaxIndex - minIndex) / 2;
+        uint8_t *candidate = lsm->block + index * LSM_ENTRY_SIZE;
+        uint64_t keyAtIndex;
+        memcpy(&keyAtIndex, candidate + LSM_ENTRY_KEY_OFFSET, sizeof(uint64_t));
+        if (key == keyAtIndex) {
+            memcpy(entry, candidate, LSM_ENTRY_SIZE);
+            return true;
+        }
+        if (key < keyAtIndex) {
+            onePastMaxIndex = index;
+        } else {
+            minIndex = index + 1;
+        }
+    }
+    return false;
+}
+
+void lsmMergeInit(LsmMerge *merge, uint32_t maxSources) {
+    merge->sources = malloc((maxSources > 0 ? maxSources : 1) * sizeof(LsmSource));
+    merge->numSources = 0;
+    merge->started = false;
+}
+
+void lsmMergeFree(LsmMerge *merge) {
+    for (uint32_t i = 0; i < merge->numSources; i++) {
+        free(merge->sources[i].buffer);
+    }
+    free(merge->sources);
+}
+
+static bool lsmSourceValid(LsmSource *source) {
+    return source->run == NULL ? source->node != NULL : source->position < source->numBuffered;
+}
+
+static uint64_t lsmSourceKey(LsmSource *source) {
+    if (source->run == NULL) {
+        return source->node->key;
+    }
+    uint64_t key;
+    memcpy(&key, source->buffer + source->position * LSM_ENTRY_SIZE + LSM_ENTRY_KEY_OFFSET, sizeof(uint64_t));
+    return key;
+}
+
+static void lsmSourceFill(LsmSource *source) {
+    LsmRun *run = source->run;
+    source->position = 0;
+    source->numBuffered = 0;
+    if (source->nextBlock >= run->numBlocks) {
+        return;
+    }
+
+    uint32_t numEntries = run->numEntries - source->nextBlock * LSM_BLOCK_ENTRIES;
+    if (numEntries > LSM_BLOCK_ENTRIES) {
+        numEntries = LSM_BLOCK_ENTRIES;
+    }
+    lsmReadAll(run->fileDescriptor, source->buffer, numEntries * LSM_ENTRY_SIZE,
+        LSM_RUN_HEADER_SIZE + (off_t)source->nextBlock * LSM_BLOCK_SIZE);
+    source->numBuffered = numEntries;
+    source->nextBlock++;
+}
+
+static void lsmSourceAdvance(LsmSource *source) {
+    if (source->run == NULL) {
+        source->node = source->node->next[0];
+    } else if (++source->position == source->numBuffered) {
+        lsmSourceFill(source);
+    }
+}
+
+void lsmMergeAddMemtable(LsmMerge *merge, LsmMemtable *memtable, uint64_t lowerKey) {
+    LsmSource *source = &merge->sources[merge->numSources++];
+    memset(source, 0, sizeof(LsmSource));
+    source->node = lsmMemtableSeek(memtable, lowerKey);
+}
+
+void lsmMergeAddRun(LsmMerge *merge, LsmRun *run, uint64_t lowerKey) {
+    LsmSource *source = &merge->sources[merge->numSources++];
+    memset(source, 0, sizeof(LsmSource));
+    source->run = run;
+    source->buffer = malloc(LSM_BLOCK_SIZE);
+
+    // Start from the block that could hold lowerKey
+    while (source->nextBlock + 1 < run->numBlocks && run->blockKeys[source->nextBlock + 1] <= lowerKey) {
+        source->nextBlock++;
+    }
+    lsmSourceFill(source);
+    while (lsmSourceValid(source) && lsmSourceKey(source) < lowerKey) {
+        lsmSourceAdvance(source);
+    }
+}
+
+// Moves to the next key. Every source at the previous key moves past it first, so the row of the
+// previous key stays readable until this is called.
+bool lsmMergeNext(LsmMerge *merge) {
+    if (merge->started) {
+        for (uint32_t i = 0; i < merge->numSources; i++) {
+            LsmSource *source = &merge->sources[i];
+            if (lsmSourceValid(source) && lsmSourceKey(source) == merge->key) {
+                lsmSourceAdvance(source);
+            }
+        }
+    }
+    merge->started = true;
+
+    LsmSource *winner = NULL;
+    for (uint32_t i = 0; i < merge->numSources; i++) {
+        LsmSource *source = &merge->sources[i];
+        if (lsmSourceValid(source) && (winner == NULL || lsmSourceKey(source) < lsmSourceKey(winner))) {
+            winner = source;
+        }
+    }
+    if (winner == NULL) {
+        return false;
+    }
+
+    merge->key = lsmSourceKey(winner);
+    if (winner->run == NULL) {
+        merge->tombstone = winner->node->tombstone;
+        merge->row = lsmNodeRow(winner->node);
+    } else {
+        uint8_t *entry = winner->buffer + winner->position * LSM_ENTRY_SIZE;
+        merge->tombstone = (*(uint32_t *)(entry + LSM_ENTRY_FLAGS_OFFSET) & LSM_ENTRY_TOMBSTONE) != 0;
+        merge->row = entry + LSM_ENTRY_ROW_OFFSET;
+    }
+    return true;
+}
+
+// Starts a merge over everything the table holds, newest first. Needs the lock.
+static void lsmMergeAll(Lsm *lsm, LsmMerge *merge, uint64_t lowerKey) {
+    lsmMergeInit(merge, lsm->numRuns + 2);
+    lsmMergeAddMemtable(merge, lsm->memtable, lowerKey);
+    if (lsm->immutable != NULL) {
+        lsmMergeAddMemtable(merge, lsm->immutable, lowerKey);
+    }
+    for (uint32_t i = 0; i < lsm->numRuns; i++) {
+        lsmMergeAddRun(merge, lsm->runs[i], lowerKey);
+    }
+}
+
+static void lsmAddRun(Lsm *lsm, LsmRun *run) {
+    if (lsm->numRuns == lsm->runsCapacity) {
+        lsm->runsCapacity = lsm->runsCapacity == 0 ? 16 : lsm->runsCapacity * 2;
+        lsm->runs = realloc(lsm->runs, lsm->runsCapacity * sizeof(LsmRun *));
+    }
+
+    uint32_t index = 0;
+    while (index < lsm->numRuns && (lsm->runs[index]->level < run->level ||
+        (lsm->runs[index]->level == run->level && lsm->runs[index]->id > run->id))) {
+        index++;
+    }
+    memmove(&lsm->runs[index + 1], &lsm->runs[index], (lsm->numRuns - index) * sizeof(LsmRun *));
+    lsm->runs[index] = run;
+    lsm->numRuns++;
+}
+
+static uint32_t lsmLevelRuns(Lsm *lsm, uint32_t level) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < lsm->numRuns; i++) {
+        count += lsm->runs[i]->level == level;
+    }
+    return count;
+}
+
+// Records the live runs, written aside and renamed over the old manifest so a crash leaves one or the other
+void lsmManifestWrite(Lsm *lsm) {
+    size_t length = LSM_MANIFEST_HEADER_SIZE + lsm->numRuns * LSM_MANIFEST_RUN_SIZE;
+    uint8_t *manifest = malloc(length);
+    *(uint32_t *)(manifest + LSM_MANIFEST_MAGIC_OFFSET) = LSM_MANIFEST_MAGIC;
+    *(uint32_t *)(manifest + LSM_MANIFEST_NUM_RUNS_OFFSET) = lsm->numRuns;
+    memcpy(manifest + LSM_MANIFEST_NEXT_RUN_OFFSET, &lsm->nextRunId, sizeof(uint64_t));
+    for (uint32_t i = 0; i < lsm->numRuns; i++) {
+        uint8_t *entry = manifest + LSM_MANIFEST_HEADER_SIZE + i * LSM_MANIFEST_RUN_SIZE;
+        memcpy(entry + LSM_MANIFEST_RUN_ID_OFFSET, &lsm->runs[i]->id, sizeof(uint64_t));
+        memcpy(entry + LSM_MANIFEST_RUN_LEVEL_OFFSET, &lsm->runs[i]->level, sizeof(uint32_t));
+    }
+
+    char *fileName = malloc(strlen(lsm->prefix) + strlen(LSM_MANIFEST_SUFFIX) + 1);
+    strcpy(fileName, lsm->prefix);
+    strcat(fileName, LSM_MANIFEST_SUFFIX);
+    char *tempFileName = malloc(strlen(fileName) + strlen(BACKUP_TEMP_SUFFIX) + 1);
+    strcpy(tempFileName, fileName);
+    strcat(tempFileName, BACKUP_TEMP_SUFFIX);
+
+    int fd = open(tempFileName, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1 || write(fd, manifest, length) != (ssize_t)length || fsync(fd) == -1 || close(fd) == -1 ||
+        rename(tempFileName, fileName) == -1) {
+        printf("Error writing manifest %s: %d\n", fileName, errno);
+        exit(EXIT_FAILURE);
+    }
+
+    free(tempFileName);
+    free(fileName);
+    free(manifest);
+}
+
+// Writes full memtables out as level 0 runs and merges any level holding LSM_LEVEL_RUNS runs into one
+// run of the next level. File I/O happens without the lock, which is only taken to swap runs in and out.
+static void *lsmWorker(void *arg) {
+    Lsm *lsm = arg;
+    pthread_mutex_lock(&lsm->lock);
+
+    while (true) {
+        if (lsm->immutable != NULL) {
+            LsmMemtable *memtable = lsm->immutable;
+            uint64_t id = lsm->nextRunId++;
+            // Nothing older exists for a tombstone to hide
+            bool dropTombstones = lsm->numRuns == 0;
+            pthread_mutex_unlock(&lsm->lock);
+
+            LsmMerge merge;
+            lsmMergeInit(&merge, 1);
+            lsmMergeAddMemtable(&merge, memtable, 0);
+            LsmRun *run = lsmRunWrite(lsm, &merge, id, 0, memtable->numEntries, dropTombstones);
+            lsmMergeFree(&merge);
+
+            pthread_mutex_lock(&lsm->lock);
+            if (run != NULL) {
+                lsmAddRun(lsm, run);
+            }
+            lsm->immutable = NULL;
+            lsmManifestWrite(lsm);
+            lsmMemtableFree(memtable);
+            pthread_cond_broadcast(&lsm->changed);
+            continue;
+        }
+        if (lsm->stop) {
+            break;
+        }
+
+        uint32_t level = 0;
+        uint32_t deepestLevel = lsm->numRuns > 0 ? lsm->runs[lsm->numRuns - 1]->level : 0;
+        while (level <= deepestLevel && lsmLevelRuns(lsm, level) < LSM_LEVEL_RUNS) {
+            level++;
+        }
+        if (level > deepestLevel) {
+            pthread_cond_wait(&lsm->changed, &lsm->lock);
+            continue;
+        }
+
+        // Runs of one level are next to each other, newest first, just as the merge wants them
+        uint32_t first = 0;
+        while (lsm->runs[first]->level != level) {
+            first++;
+        }
+        uint32_t numInputs = lsmLevelRuns(lsm, level);
+        LsmRun **inputs = malloc(numInputs * sizeof(LsmRun *));
+        memcpy(inputs, &lsm->runs[first], numInputs * sizeof(LsmRun *));
+        uint64_t id = lsm->nextRunId++;
+        bool dropTombstones = first + numInputs == lsm->numRuns;
+        pthread_mutex_unlock(&lsm->lock);
+
+        LsmMerge merge;
+        uint32_t maxEntries = 0;
+        lsmMergeInit(&merge, numInputs);
+        for (uint32_t i = 0; i < numInputs; i++) {
+            lsmMergeAddRun(&merge, inputs[i], 0);
+            maxEntries += inputs[i]->numEntries;
+        }
+        LsmRun *run = lsmRunWrite(lsm, &merge, id, level + 1, maxEntries, dropTombstones);
+        lsmMergeFree(&merge);
+
+        pthread_mutex_lock(&lsm->lock);
+        // Flushes only ever add to level 0 at the front, so the inputs are still in one block
+        first = 0;
+        while (lsm->runs[first] != inputs[0]) {
+            first++;
+        }
+        memmove(&lsm->runs[first], &lsm->runs[first + numInputs],
+            (lsm->numRuns - first - numInputs) * sizeof(LsmRun *));
+        lsm->numRuns -= numInputs;
+        if (run != NULL) {
+            lsmAddRun(lsm, run);
+        }
+        lsmManifestWrite(lsm);
+        for (uint32_t i = 0; i < numInputs; i++) {
+            lsmRunFree(lsm, inputs[i], true);
+        }
+        free(inputs);
+        pthread_cond_broadcast(&lsm->changed);
+    }
+
+    pthread_mutex_unlock(&lsm->lock);
+    return NULL;
+}
+
+// Opens the table whose files start with prefix, creating nothing until the first memtable is written
+// The run files the manifest of the table at prefix lists, then the manifest itself. None if the table
+// has never been written out.
+char **lsmFileNames(char *prefix, uint32_t *numFileNames) {
+    char *manifestFileName = malloc(strlen(prefix) + strlen(LSM_MANIFEST_SUFFIX) + 1);
+    sprintf(manifestFileName, "%s%s", prefix, LSM_MANIFEST_SUFFIX);
+    *numFileNames = 0;
+    int fd = open(manifestFileName, O_RDONLY);
+    if (fd == -1) {
+        free(manifestFileName);
+        return NULL;
+    }
+
+    uint8_t header[LSM_MANIFEST_HEADER_SIZE];
+    lsmReadAll(fd, header, LSM_MANIFEST_HEADER_SIZE, 0);
+    uint32_t numRuns = *(uint32_t *)(header + LSM_MANIFEST_NUM_RUNS_OFFSET);
+    if (*(uint32_t *)(header + LSM_MANIFEST_MAGIC_OFFSET) != LSM_MANIFEST_MAGIC) {
+        numRuns = 0;
+    }
+    char **fileNames = malloc((numRuns + 1) * sizeof(char *));
+    for (uint32_t i = 0; i < numRuns; i++) {
+        uint64_t id;
+        lsmReadAll(fd, &id, sizeof(uint64_t),
+            LSM_MANIFEST_HEADER_SIZE + i * LSM_MANIFEST_RUN_SIZE + LSM_MANIFEST_RUN_ID_OFFSET);
+        fileNames[i] = malloc(strlen(prefix) + strlen(LSM_RUN_SUFFIX) + 22);
+        sprintf(fileNames[i], "%s.%llu%s", prefix, (unsigned long long)id, LSM_RUN_SUFFIX);
+    }
+    close(fd);
+
+    fileNames[numRuns] = manifestFileName;
+    *numFileNames = numRuns + 1;
+    return fileNames;
+}
+
+Lsm *lsmOpen(char *prefix) {
+    Lsm *lsm = malloc(sizeof(Lsm));
+    lsm->prefix = malloc(strlen(prefix) + 1);
+    strcpy(lsm->prefix, prefix);
+    lsm->memtable = lsmMemtableNew();
+    lsm->immutable = NULL;
+    lsm->runs = NULL;
+    lsm->numRuns = 0;
+    lsm->runsCapacity = 0;
+    lsm->nextRunId = 1;
+    lsm->block = malloc(LSM_BLOCK_SIZE);
+    lsm->stop = false;
+
+    char *fileName = malloc(strlen(prefix) + strlen(LSM_MANIFEST_SUFFIX) + 1);
+    strcpy(fileName, prefix);
+    strcat(fileName, LSM_MANIFEST_SUFFIX);
+    int fd = open(fileName, O_RDONLY);
+    if (fd != -1) {
+        uint8_t header[LSM_MANIFEST_HEADER_SIZE];
+        lsmReadAll(fd, header, LSM_MANIFEST_HEADER_SIZE, 0);
+        if (*(uint32_t *)(header + LSM_MANIFEST_MAGIC_OFFSET) != LSM_MANIFEST_MAGIC) {
+            printf("Manifest %s is corrupt\n", fileName);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t numRuns = *(uint32_t *)(header + LSM_MANIFEST_NUM_RUNS_OFFSET);
+        memcpy(&lsm->nextRunId, header + LSM_MANIFEST_NEXT_RUN_OFFSET, sizeof(uint64_t));
+
+        uint8_t *entries = malloc(numRuns * LSM_MANIFEST_RUN_SIZE + 1);
+        lsmReadAll(fd, entries, numRuns * LSM_MANIFEST_RUN_SIZE, LSM_MANIFEST_HEADER_SIZE);
+        for (uint32_t i = 0; i < numRuns; i++) {
+            uint64_t id;
+            uint32_t level;
+            memcpy(&id, entries + i * LSM_MANIFEST_RUN_SIZE + LSM_MANIFEST_RUN_ID_OFFSET, sizeof(uint64_t));
+            memcpy(&level, entries + i * LSM_MANIFEST_RUN_SIZE + LSM_MANIFEST_RUN_LEVEL_OFFSET, sizeof(uint32_t));
+            lsmAddRun(lsm, lsmRunOpen(lsm, id, level));
+        }
+        free(entries);
+        close(fd);
+    }
+    free(fileName);
+
+    pthread_mutex_init(&lsm->lock, NULL);
+    pthread_cond_init(&lsm->changed, NULL);
+    pthread_create(&lsm->worker, NULL, lsmWorker, lsm);
+    return lsm;
+}
+
+// Writes out the memtable and stops the worker. With discard the memtable is dropped instead and every
+// file of the table is deleted.
+void lsmClose(Lsm *lsm, bool discard) {
+    pthread_mutex_lock(&lsm->lock);
+    if (!discard && lsm->memtable->numEntries > 0) {
+        while (lsm->immutable != NULL) {
+            pthread_cond_wait(&lsm->changed, &lsm->lock);
+        }
+        lsm->immutable = lsm->memtable;
+        lsm->memtable = lsmMemtableNew();
+        pthread_cond_broadcast(&lsm->changed);
+        while (lsm->immutable != NULL) {
+            pthread_cond_wait(&lsm->changed, &lsm->lock);
+        }
+    }
+    lsm->stop = true;
+    pthread_cond_broadcast(&lsm->changed);
+    pthread_mutex_unlock(&lsm->lock);
+    pthread_join(lsm->worker, NULL);
+
+    for (uint32_t i = 0; i < lsm->numRuns; i++) {
+        lsmRunFree(lsm, lsm->runs[i], discard);
+    }
+    if (lsm->immutable != NULL) {
+        lsmMemtableFree(lsm->immutable);
+    }
+    if (discard) {
+        char *fileName = malloc(strlen(lsm->prefix) + strlen(LSM_MANIFEST_SUFFIX) + 1);
+        strcpy(fileName, lsm->prefix);
+        strcat(fileName, LSM_MANIFEST_SUFFIX);
+        unlink(fileName);
+        free(fileName);
+    }
+
+    pthread_mutex_destroy(&lsm->lock);
+    pthread_cond_destroy(&lsm->changed);
+    lsmMemtableFree(lsm->memtable);
+    free(lsm->runs);
+    free(lsm->block);
+    free(lsm->prefix);
+    free(lsm);
+}
+
+// Finds the newest entry for key: -1 when there is none, 0 for a tombstone, 1 for a row. Needs the lock.
+static int lsmLookup(Lsm *lsm, uint64_t key, uint8_t *row) {
+    LsmMemtable *memtables[2] = { lsm->memtable, lsm->immutable };
+    for (int i = 0; i < 2; i++) {
+        if (memtables[i] == NULL) {
+            continue;
+        }
+        LsmNode *node = lsmMemtableSeek(memtables[i], key);
+        if (node != NULL && node->key == key) {
+            if (!node->tombstone && row != NULL) {
+                memcpy(row, lsmNodeRow(node), ROW_SIZE);
+            }
+            return node->tombstone ? 0 : 1;
+        }
+    }
+
+    uint8_t entry[LSM_ENTRY_SIZE];
+    for (uint32_t i = 0; i < lsm->numRuns; i++) {
+        if (lsmRunFind(lsm, lsm->runs[i], key, entry)) {
+            if (*(uint32_t *)(entry + LSM_ENTRY_FLAGS_OFFSET) & LSM_ENTRY_TOMBSTONE) {
+                return 0;
+            }
+            if (row != NULL) {
+                memcpy(row, entry + LSM_ENTRY_ROW_OFFSET, ROW_SIZE);
+            }
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Hands a full memtable to the worker, waiting while the last one is still being written or level 0
+// is backed up. Needs the lock.
+static void lsmMakeRoom(Lsm *lsm) {
+    if (lsm->memtable->size < LSM_MEMTABLE_SIZE) {
+        return;
+    }
+    while (lsm->immutable != NULL || lsmLevelRuns(lsm, 0) >= LSM_MAX_LEVEL0_RUNS) {
+        pthread_cond_wait(&lsm->changed, &lsm->lock);
+    }
+    lsm->immutable = lsm->memtable;
+    lsm->memtable = lsmMemtableNew();
+    pthread_cond_broadcast(&lsm->changed);
+}
+
+// Returns false if the id is already present
+bool lsmInsert(Lsm *lsm, Row *row) {
+    uint8_t cell[ROW_SIZE];
+    serialiseRow(row, cell);
+
+    pthread_mutex_lock(&lsm->lock);
+    bool inserted = lsmLookup(lsm, row->id, NULL) != 1;
+    if (inserted) {
+        lsmMakeRoom(lsm);
+        lsmMemtablePut(lsm->memtable, row->id, false, cell);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return inserted;
+}
+
+// Returns false if there was no row to delete
+bool lsmDelete(Lsm *lsm, uint64_t key) {
+    pthread_mutex_lock(&lsm->lock);
+    bool deleted = lsmLookup(lsm, key, NULL) == 1;
+    if (deleted) {
+        lsmMakeRoom(lsm);
+        lsmMemtablePut(lsm->memtable, key, true, NULL);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return deleted;
+}
+
+uint32_t lsmDeleteRange(Lsm *lsm, uint64_t lowerKey, uint64_t upperKey) {
+    uint32_t capacity = 64;
+    uint32_t numKeys = 0;
+    uint64_t *keys = malloc(capacity * sizeof(uint64_t));
+
+    pthread_mutex_lock(&lsm->lock);
+    LsmMerge merge;
+    lsmMergeAll(lsm, &merge, lowerKey);
+    while (lsmMergeNext(&merge) && merge.key <= upperKey) {
+        if (merge.tombstone) {
+            continue;
+        }
+        if (numKeys == capacity) {
+            capacity *= 2;
+            keys = realloc(keys, capacity * sizeof(uint64_t));
+        }
+        keys[numKeys++] = merge.key;
+    }
+    lsmMergeFree(&merge);
+
+    for (uint32_t i = 0; i < numKeys; i++) {
+        lsmMakeRoom(lsm);
+        lsmMemtablePut(lsm->memtable, keys[i], true, NULL);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+
+    free(keys);
+    return numKeys;
+}
+
+// Looks up sorted keys, filling rows with those found in key order and returning how many there were
+uint32_t lsmMultiGet(Lsm *lsm, uint64_t *keys, uint32_t numKeys, Row *rows) {
+    uint32_t numFound = 0;
+    uint8_t cell[ROW_SIZE];
+
+    pthread_mutex_lock(&lsm->lock);
+    for (uint32_t i = 0; i < numKeys; i++) {
+        if (lsmLookup(lsm, keys[i], cell) == 1) {
+            deserialiseRow(cell, &rows[numFound++]);
+        }
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return numFound;
+}
+
+bool lsmGet(Lsm *lsm, uint64_t key, uint8_t *row) {
+    pthread_mutex_lock(&lsm->lock);
+    bool found = (lsmLookup(lsm, key, row) == 1);
+    pthread_mutex_unlock(&lsm->lock);
+    return found;
+}
+
+// Copies out up to maxRows live rows from lowerKey on, in key order. Returns how many.
+uint32_t lsmScan(Lsm *lsm, uint64_t lowerKey, uint8_t *rows, uint32_t maxRows) {
+    uint32_t numRows = 0;
+
+    pthread_mutex_lock(&lsm->lock);
+    LsmMerge merge;
+    lsmMergeAll(lsm, &merge, lowerKey);
+    while (numRows < maxRows && lsmMergeNext(&merge)) {
+        if (!merge.tombstone) {
+            memcpy(rows + numRows * ROW_SIZE, merge.row, ROW_SIZE);
+            numRows++;
+        }
+    }
+    lsmMergeFree(&merge);
+    pthread_mutex_unlock(&lsm->lock);
+    return numRows;
+}
+
+// Scans the table a batch at a time, so the lock is not held while the caller works through the rows
+Cursor *lsmTableStart(Table *table) {
+    Cursor *cursor = malloc(sizeof(Cursor) + LSM_SCAN_BATCH_ROWS * ROW_SIZE);
+    cursor->table = table;
+    cursor->lsm = table->lsm;
+    cursor->pageNum = INVALID_PAGE_NUM;
+    cursor->nextKey = 0;
+    cursor->exhausted = false;
+    lsmCursorFill(cursor);
+    return cursor;
+}
+
+// Replaces the cursor's rows with the next batch, ending the table when there are none
+void lsmCursorFill(Cursor *cursor) {
+    cursor->cellNum = 0;
+    cursor->numRows = 0;
+    if (!cursor->exhausted) {
+        cursor->numRows = lsmScan(cursor->lsm, cursor->nextKey, cursor->rows, LSM_SCAN_BATCH_ROWS);
+    }
+    cursor->endOfTable = (cursor->numRows == 0);
+    if (cursor->numRows == 0) {
+        cursor->exhausted = true;
+        return;
+    }
+
+    uint64_t lastKey;
+    memcpy(&lastKey, cursor->rows + (size_t)(cursor->numRows - 1) * ROW_SIZE + ID_OFFSET, ID_SIZE);
+    cursor->exhausted = (cursor->numRows < LSM_SCAN_BATCH_ROWS || lastKey == UINT64_MAX);
+    cursor->nextKey = lastKey + 1;
+}
+
+void lsmPrint(Lsm *lsm, OutputBuffer *outputBuffer) {
+    Row row;
+
+    pthread_mutex_lock(&lsm->lock);
+    LsmMerge merge;
+    lsmMergeAll(lsm, &merge, 0);
+    while (lsmMergeNext(&merge)) {
+        if (!merge.tombstone) {
+            deserialiseRow(merge.row, &row);
+            printRow(outputBuffer, &row);
+        }
+    }
+    lsmMergeFree(&merge);
+    pthread_mutex_unlock(&lsm->lock);
+}
+
+void lsmPrintLevels(Lsm *lsm) {
+    pthread_mutex_lock(&lsm->lock);
+    printf("memtable: %u entries, %zu KB\n", lsm->memtable->numEntries, lsm->memtable->size >> 10);
+    if (lsm->immutable != NULL) {
+        printf("flushing memtable: %u entries\n", lsm->immutable->numEntries);
+    }
+    for (uint32_t i = 0; i < lsm->numRuns; i++) {
+        LsmRun *run = lsm->runs[i];
+        printf("level %u run %llu: %u entries, keys %llu to %llu\n", run->level, (unsigned long long)run->id,
+            run->numEntries, (unsigned long long)run->blockKeys[0], (unsigned long long)run->maxKey);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+}
+
+// Spans from every thread land in one ring. A writer claims a slot with an atomic add and marks it
+// complete with its sequence number, so readers can skip slots that are being overwritten.
+static SpanRecord spanRing[SPAN_RING_SIZE];
+static uint64_t spanHead;
+static bool spansEnabled;
+static uint32_t spanThreads;
+static __thread uint32_t spanThreadId;
+
+static uint64_t spanNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+Span spanBegin(const char *name, const char *argName, uint64_t arg) {
+    Span span;
+    span.name = name;
+    span.argName = argName;
+    span.arg = arg;
+    span.start = __atomic_load_n(&spansEnabled, __ATOMIC_RELAXED) ? spanNow() : 0;
+    span.detail[0] = '\0';
+#ifdef SPAN_USDT
+    DTRACE_PROBE2(simpledb, span__begin, name, arg);
+#endif
+    return span;
+}
+
+void spanEnd(Span *span) {
+#ifdef SPAN_USDT
+    DTRACE_PROBE2(simpledb, span__end, span->name, span->arg);
+#endif
+    if (span->start == 0) {
+        return;
+    }
+    uint64_t end = spanNow();
+
+    if (spanThreadId == 0) {
+        spanThreadId = __atomic_add_fetch(&spanThreads, 1, __ATOMIC_RELAXED);
+    }
+    uint64_t sequence = __atomic_fetch_add(&spanHead, 1, __ATOMIC_RELAXED);
+    SpanRecord *record = &spanRing[sequence & (SPAN_RING_SIZE - 1)];
+
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->name = span->name;
+    record->argName = span->argName;
+    record->arg = span->arg;
+    record->threadId = spanThreadId;
+    record->start = span->start;
+    record->duration = end - span->start;
+    memcpy(record->detail, span->detail, SPAN_DETAIL_SIZE);
+    __atomic_store_n(&record->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Labels a span with the first word of text
+void spanDetail(Span *span, const char *text) {
+    if (span->start == 0) {
+        return;
+    }
+    uint32_t length = 0;
+    while (length < SPAN_DETAIL_SIZE - 1 && text[length] != '\0' && text[length] != ' ') {
+        span->detail[length] = text[length];
+        length++;
+    }
+    span->detail[length] = '\0';
+}
+
+void spansEnable(bool enabled) {
+    __atomic_store_n(&spansEnabled, enabled, __ATOMIC_RELAXED);
+}
+
+// Quotes a span string for the trace. Details hold command text, so anything may be in them.
+static char *spanJsonString(char *position, const char *text) {
+    position = outputJsonString(position, text, strnlen(text, SPAN_JSON_MAX_LENGTH));
+    *position = '\0';
+    return position;
+}
+
+// Writes the spans still in the ring as Chrome trace events, oldest first
+bool spansExport(char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        return false;
+    }
 
-    NodeType type = getNodeType(node);
-    printf("Debug: pageNum=%d, node type=", pageNum);
-    if (type == LEAF_NODE) {
-        printf("Leaf\n");
-    } else {
-        printf("Internal\n");
+    OutputBuffer *outputBuffer = NewOutputBuffer(fd);
+    char line[256 + 3 * SPAN_JSON_SIZE];
+    char name[SPAN_JSON_SIZE], category[SPAN_JSON_SIZE], argName[SPAN_JSON_SIZE];
+    int length = snprintf(line, sizeof(line), "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    outputWrite(outputBuffer, line, length);
+
+    uint64_t head = __atomic_load_n(&spanHead, __ATOMIC_ACQUIRE);
+    uint64_t first = head > SPAN_RING_SIZE ? head - SPAN_RING_SIZE : 0;
+    bool firstEvent = true;
+    pid_t pid = getpid();
+    for (uint64_t sequence = first; sequence < head; sequence++) {
+        SpanRecord *slot = &spanRing[sequence & (SPAN_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != sequence + 1) {
+            continue;
+        }
+        SpanRecord record = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence + 1) {
+            continue;
+        }
+        record.detail[SPAN_DETAIL_SIZE - 1] = '\0';
+        spanJsonString(name, record.detail[0] != '\0' ? record.detail : record.name);
+        spanJsonString(category, record.name);
+        spanJsonString(argName, record.argName);
+
+        length = snprintf(line, sizeof(line),
+            "%s\n{\"name\":%s,\"cat\":%s,\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+            "\"args\":{%s:%llu}}",
+            firstEvent ? "" : ",", name, category, record.start / 1e3, record.duration / 1e3, (int)pid,
+            record.threadId, argName, (unsigned long long)record.arg);
+        outputWrite(outputBuffer, line, length);
+        firstEvent = false;
     }
 
-    if (type == LEAF_NODE) {
-        numKeys = *leafNodenumCells(node);
-        indent(indentationLevel);
-        printf("- leaf (size %d)\n", numKeys);
+    outputWrite(outputBuffer, "\n]}\n", 4);
+    closeOutput(outputBuffer);
+    return close(fd) == 0;
+}
 
-        for (uint32_t i = 0; i < numKeys; i++) {
-            indent(indentationLevel + 1);
-            printf("- %d\n", *leafNodeKey(node, i));
+void doSpans(void) {
+#if ENABLE_SPANS
+    char *action = strtok(NULL, " ");
+    if (action != NULL && strcmp(action, "on") == 0) {
+        spansEnable(true);
+    } else if (action != NULL && strcmp(action, "off") == 0) {
+        spansEnable(false);
+    } else if (action != NULL && strcmp(action, "export") == 0) {
+        char *path = strtok(NULL, " ");
+        if (path == NULL) {
+            printf("Spans path missing\n");
+        } else if (!spansExport(path)) {
+            printf("Unable to write spans to %s\n", path);
         }
-    } else if (type == INTERNAL_NODE) {
-        numKeys = *internalNodeNumKeys(node);
-        indent(indentationLevel);
-        printf("- internal (size %d)\n", numKeys);
-        if (numKeys > 0) {
-            for (uint32_t i = 0; i < numKeys; i++) {
-                child = *internalNodeChild(node, i);
-                printTree(pager, child, indentationLevel + 1);
-    
-                indent(indentationLevel + 1);
-                printf("- key %d\n", *internalNodeKey(node, i));
-            }
-        }
-        child = *internalNodeRightChild(node);
-        printTree(pager, child, indentationLevel + 1);
+    } else {
+        printf("Spans command must be 'spans on', 'spans off' or 'spans export <path>'\n");
     }
+#else
+    printf("Spans were compiled out of this build\n");
+#endif
 }
 
-void printConstants() {
-    printf("Row Size: %d\n", ROW_SIZE);
-    printf("Common Node Header Size: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("Leaf NodeHeader Size: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("Leaf Node Cell Size: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("Leaf Node Space for Cells: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("Leaf Node Max Cells: %d\n", LEAF_NODE_MAX_CELLS);
+// Starts writing every command to traceFileName with when it started and how long it took
+void captureStart(Database *database, char *traceFileName) {
+    int fd = open(traceFileName, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        printf("Unable to open trace file %s\n", traceFileName);
+        exit(EXIT_FAILURE);
+    }
+
+    database->capture = NewOutputBuffer(fd);
+    clock_gettime(CLOCK_MONOTONIC, &database->captureStart);
+
+    uint8_t header[TRACE_HEADER_SIZE];
+    *(uint32_t *)(header + TRACE_MAGIC_OFFSET) = TRACE_MAGIC;
+    *(uint32_t *)(header + TRACE_VERSION_OFFSET) = TRACE_VERSION;
+    outputWrite(database->capture, header, TRACE_HEADER_SIZE);
 }
 
-NodeType getNodeType(void *node) {
-    uint8_t value = *((uint8_t *)((uint8_t *)node + NODE_TYPE_OFFSET));
-    return (NodeType)value;
+static uint64_t elapsedNanoseconds(struct timespec *start, struct timespec *end) {
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ull + end->tv_nsec - start->tv_nsec;
 }
 
-void setNodeType(void *node, NodeType type) {
-    uint8_t value = type;
-    *((uint8_t *)((uint8_t *)node + NODE_TYPE_OFFSET)) = value;
+void captureCommand(Database *database, char *command, uint32_t length, struct timespec *start, struct timespec *end) {
+    uint8_t header[TRACE_RECORD_HEADER_SIZE];
+    *(uint64_t *)(header + TRACE_RECORD_TIMESTAMP_OFFSET) = elapsedNanoseconds(&database->captureStart, start);
+    *(uint64_t *)(header + TRACE_RECORD_LATENCY_OFFSET) = elapsedNanoseconds(start, end);
+    *(uint32_t *)(header + TRACE_RECORD_LENGTH_OFFSET) = length;
+    outputWrite(database->capture, header, TRACE_RECORD_HEADER_SIZE);
+    outputWrite(database->capture, command, length);
 }
 
-uint32_t getUnusedPageNum(Pager *pager) {
-    return pager->numPages;
+static int compareLatencies(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return (left > right) - (left < right);
 }
 
-void createNewRoot(Table *table, uint32_t rightChildPageNum) {
-    void *root = getPage(table->pager, table->rootPageNum);
-    void *rightChild = getPage(table->pager, rightChildPageNum);
-    uint32_t leftChildPageNum = getUnusedPageNum(table->pager);
-    void *leftChild = getPage(table->pager, leftChildPageNum);
+static void *replaySession(void *arg) {
+    ReplaySession *session = arg;
+    OutputBuffer *outputBuffer = NewOutputBuffer(session->outputFileDescriptor);
+    uint32_t lineCapacity = 256;
+    char *line = malloc(lineCapacity);
 
-    if (getNodeType(root) == INTERNAL_NODE) {
-        initialiseInternalNode(rightChild);
-        initialiseInternalNode(leftChild);
-    }
+    for (uint32_t i = session->sessionNum; i < session->numCommands; i += session->numSessions) {
+        TraceCommand *command = &session->commands[i];
+        if (command->length == 4 && memcmp(command->command, "exit", 4) == 0) {
+            continue;
+        }
 
-    memcpy(leftChild, root, PAGE_SIZE);
-    setNodeRoot(leftChild, false);
+        if (!session->fullSpeed) {
+            struct timespec due = session->start;
+            due.tv_sec += command->timestamp / 1000000000ull;
+            due.tv_nsec += command->timestamp % 1000000000ull;
+            if (due.tv_nsec >= 1000000000) {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000;
+            }
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+        }
 
-    if (getNodeType(leftChild) == INTERNAL_NODE) {
-        void *child;
-        for (int i = 0; i < *internalNodeNumKeys(leftChild); i ++) {
-            child = getPage(table->pager, *internalNodeChild(leftChild, i));
-            *nodeParent(child) = leftChildPageNum;
+        if (command->length + 1 > lineCapacity) {
+            lineCapacity = command->length + 1;
+            line = realloc(line, lineCapacity);
         }
-        child = getPage(table->pager, *internalNodeRightChild(leftChild));
-        *nodeParent(child) = leftChildPageNum;
+        memcpy(line, command->command, command->length);
+        line[command->length] = '\0';
+
+        InputBuffer inputBuffer;
+        memset(&inputBuffer, 0, sizeof(InputBuffer));
+        inputBuffer.input = line;
+        inputBuffer.length = command->length;
+
+        // Sessions share one database, so time spent waiting for it counts towards latency
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_mutex_lock(session->lock);
+        doCommand(&inputBuffer, outputBuffer, session->database);
+        outputBuffer->length = 0;
+        pthread_mutex_unlock(session->lock);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        command->replayLatency = elapsedNanoseconds(&start, &end);
     }
 
-    initialiseInternalNode(root);
-    setNodeRoot(root, true);
-    *internalNodeNumKeys(root) = 1;
-    *internalNodeChild(root, 0) = leftChildPageNum;
-    uint32_t leftChildMaxKey = getNodeMaxKey(table->pager, leftChild);
-    *internalNodeKey(root, 0) = leftChildMaxKey;
-    *internalNodeRightChild(root) = rightChildPageNum; 
-    *nodeParent(leftChild) = table->rootPageNum;
-    *nodeParent(rightChild) = table->rootPageNum;
+    free(line);
+    closeOutput(outputBuffer);
+    return NULL;
 }
 
-void initialiseInternalNode(void *node) {
-    setNodeType(node, INTERNAL_NODE);
-    setNodeRoot(node, false);
-    *internalNodeNumKeys(node) = 0;
+// Copies the file at source to destination, leaving no destination if there is no source
+static void duplicateFile(char *source, char *destination) {
+    unlink(destination);
+    int sourceFd = open(source, O_RDONLY);
+    if (sourceFd == -1) {
+        return;
+    }
+    int destinationFd = open(destination, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (destinationFd == -1) {
+        printf("Unable to create %s\n", destination);
+        exit(EXIT_FAILURE);
+    }
 
-    *internalNodeRightChild(node) = INVALID_PAGE_NUM;
+    char *buffer = malloc(OUTPUT_BUFFER_SIZE);
+    ssize_t bytesRead;
+    while ((bytesRead = read(sourceFd, buffer, OUTPUT_BUFFER_SIZE)) > 0) {
+        outputWriteAll(destinationFd, buffer, bytesRead);
+    }
+    free(buffer);
+    close(sourceFd);
+    close(destinationFd);
 }
 
-uint32_t *internalNodeNumKeys(void *node) {
-    return (uint32_t *)((uint8_t *)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+// The file name prefix of every lsm table in the catalog, as tableOpen builds them for the db at fileName
+static char **lsmTablePrefixes(Pager *pager, char *fileName, uint32_t *numPrefixes) {
+    void *catalog = getPage(pager, CATALOG_PAGE_NUM);
+    uint32_t numTables = *catalogNumTables(catalog);
+    char **prefixes = malloc((numTables > 0 ? numTables : 1) * sizeof(char *));
+    *numPrefixes = 0;
+    for (uint32_t i = 0; i < numTables; i++) {
+        if (*catalogTableRoot(catalog, i) == INVALID_PAGE_NUM) {
+            char *prefix = malloc(strlen(fileName) + CATALOG_TABLE_NAME_SIZE + 2);
+            sprintf(prefix, "%s.%.*s", fileName, CATALOG_TABLE_NAME_SIZE, catalogTableName(catalog, i));
+            prefixes[(*numPrefixes)++] = prefix;
+        }
+    }
+    return prefixes;
 }
 
-uint32_t *internalNodeRightChild(void *node) {
-    return (uint32_t *)((uint8_t *)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
-}
+// Copies the run files and manifest of every lsm table next to the copy of the db. The current table is
+// closed meanwhile, it may be one of them and already open on the copy's missing files.
+static void replayCopyLsmTables(Database *database, char *fileName, char *copyFileName) {
+    uint32_t numPrefixes;
+    char **prefixes = lsmTablePrefixes(database->pager, fileName, &numPrefixes);
+    if (numPrefixes > 0) {
+        tableClose(database->currentTable);
+        database->currentTable = NULL;
+    }
 
-uint32_t *internalNodeCell(void *node, uint32_t cellNum) {
-    return (uint32_t *)((uint8_t *)node + INTERNAL_NODE_HEADER_SIZE + cellNum * INTERNAL_NODE_CELL_SIZE);
+    for (uint32_t i = 0; i < numPrefixes; i++) {
+        uint32_t numFileNames;
+        char **fileNames = lsmFileNames(prefixes[i], &numFileNames);
+        for (uint32_t j = 0; j < numFileNames; j++) {
+            char *destination = malloc(strlen(copyFileName) + strlen(fileNames[j]) - strlen(fileName) + 1);
+            sprintf(destination, "%s%s", copyFileName, fileNames[j] + strlen(fileName));
+            duplicateFile(fileNames[j], destination);
+            free(destination);
+            free(fileNames[j]);
+        }
+        free(fileNames);
+        free(prefixes[i]);
+    }
+    free(prefixes);
+
+    if (numPrefixes > 0) {
+        reopenCurrentTable(database);
+    }
 }
 
-uint32_t *internalNodeChild(void *node, uint32_t childNum) {
-    uint32_t numKeys = *internalNodeNumKeys(node);
-    if (childNum > numKeys) {
-        printf("Tried to access childNum %d > numKeys %d\n", childNum, numKeys);
+// Re-runs a captured trace against a copy of fileName, either at the pace it was captured or as fast
+// as possible, with the commands dealt round robin to numSessions threads. Reports throughput and
+// latency percentiles per command next to the latencies recorded at capture time.
+void runReplay(char *traceFileName, char *fileName, uint32_t pageSize, int ioFlags, uint32_t numSessions,
+    bool fullSpeed) {
+    int traceFd = open(traceFileName, O_RDONLY);
+    off_t traceLength = traceFd == -1 ? 0 : lseek(traceFd, 0, SEEK_END);
+    uint8_t *trace = traceLength > 0 ? malloc(traceLength) : NULL;
+    if (trace == NULL || pread(traceFd, trace, traceLength, 0) != traceLength || traceLength < (off_t)TRACE_HEADER_SIZE ||
+        *(uint32_t *)(trace + TRACE_MAGIC_OFFSET) != TRACE_MAGIC ||
+        *(uint32_t *)(trace + TRACE_VERSION_OFFSET) != TRACE_VERSION) {
+        printf("Unable to read trace file %s\n", traceFileName);
         exit(EXIT_FAILURE);
-    } else if (childNum == numKeys) {
-        uint32_t *rightChild = internalNodeRightChild(node);
-        if (*rightChild == INVALID_PAGE_NUM) {
-            printf("Tried to access right child of node, but was invalid page\n");
-            exit(EXIT_FAILURE);
+    }
+    close(traceFd);
+
+    uint32_t numCommands = 0;
+    uint32_t commandsCapacity = 1024;
+    TraceCommand *commands = malloc(commandsCapacity * sizeof(TraceCommand));
+    for (off_t offset = TRACE_HEADER_SIZE; offset + (off_t)TRACE_RECORD_HEADER_SIZE <= traceLength;) {
+        uint8_t *record = trace + offset;
+        uint32_t length = *(uint32_t *)(record + TRACE_RECORD_LENGTH_OFFSET);
+        if (offset + (off_t)TRACE_RECORD_HEADER_SIZE + length > traceLength) {
+            break;
         }
-        return rightChild;
-    } else {
-        return internalNodeCell(node, childNum);
-        uint32_t *child = internalNodeCell(node, childNum);
-        if (*child == INVALID_PAGE_NUM) {
-            printf("Tried to access child %d of node, but was invalid page\n", childNum);
-            exit(EXIT_FAILURE);
+        if (numCommands == commandsCapacity) {
+            commandsCapacity *= 2;
+            commands = realloc(commands, commandsCapacity * sizeof(TraceCommand));
         }
-        return child;
+        TraceCommand *command = &commands[numCommands++];
+        command->timestamp = *(uint64_t *)(record + TRACE_RECORD_TIMESTAMP_OFFSET);
+        command->latency = *(uint64_t *)(record + TRACE_RECORD_LATENCY_OFFSET);
+        command->replayLatency = 0;
+        command->command = (char *)record + TRACE_RECORD_HEADER_SIZE;
+        command->length = length;
+        offset += TRACE_RECORD_HEADER_SIZE + length;
+    }
+
+    char *copyFileName = malloc(strlen(fileName) + strlen(REPLAY_COPY_SUFFIX) + 1);
+    strcpy(copyFileName, fileName);
+    strcat(copyFileName, REPLAY_COPY_SUFFIX);
+    char *copyHotPagesFileName = malloc(strlen(copyFileName) + strlen(HOT_PAGES_SUFFIX) + 1);
+    strcpy(copyHotPagesFileName, copyFileName);
+    strcat(copyHotPagesFileName, HOT_PAGES_SUFFIX);
+    duplicateFile(fileName, copyFileName);
+    Database *database = databaseOpen(copyFileName, pageSize, ioFlags);
+    replayCopyLsmTables(database, fileName, copyFileName);
+
+    // Command output is not part of the measurement
+    int devNull = open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    dup2(devNull, STDOUT_FILENO);
+
+    ReplaySession sessions[REPLAY_MAX_SESSIONS];
+    pthread_t threads[REPLAY_MAX_SESSIONS];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < numSessions; i++) {
+        sessions[i].database = database;
+        sessions[i].lock = &database->lock;
+        sessions[i].commands = commands;
+        sessions[i].numCommands = numCommands;
+        sessions[i].sessionNum = i;
+        sessions[i].numSessions = numSessions;
+        sessions[i].fullSpeed = fullSpeed;
+        sessions[i].start = start;
+        sessions[i].outputFileDescriptor = devNull;
+        pthread_create(&threads[i], NULL, replaySession, &sessions[i]);
+    }
+    for (uint32_t i = 0; i < numSessions; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsedNanoseconds(&start, &end) / 1e9;
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    close(devNull);
+
+    // Commands are grouped by their first word
+    char types[REPLAY_MAX_COMMAND_TYPES][REPLAY_COMMAND_TYPE_SIZE];
+    uint32_t numTypes = 0;
+    uint32_t *commandTypes = malloc((numCommands > 0 ? numCommands : 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < numCommands; i++) {
+        char type[REPLAY_COMMAND_TYPE_SIZE];
+        uint32_t length = 0;
+        while (length < commands[i].length && length < REPLAY_COMMAND_TYPE_SIZE - 1 &&
+            commands[i].command[length] != ' ') {
+            type[length] = commands[i].command[length];
+            length++;
+        }
+        type[length] = '\0';
+        if (strcmp(type, "exit") == 0 || length == 0) {
+            commandTypes[i] = REPLAY_MAX_COMMAND_TYPES;
+            continue;
+        }
+
+        uint32_t typeNum = 0;
+        while (typeNum < numTypes && strcmp(types[typeNum], type) != 0) {
+            typeNum++;
+        }
+        if (typeNum == numTypes) {
+            if (numTypes == REPLAY_MAX_COMMAND_TYPES - 1) {
+                strcpy(type, "other");
+                typeNum = 0;
+                while (typeNum < numTypes && strcmp(types[typeNum], type) != 0) {
+                    typeNum++;
+                }
+            }
+            if (typeNum == numTypes) {
+                strcpy(types[numTypes++], type);
+            }
+        }
+        commandTypes[i] = typeNum;
+    }
+
+    printf("%u commands in %.3f s, %u sessions, %s\n", numCommands, seconds, numSessions,
+        fullSpeed ? "full speed" : "original pacing");
+    printf("command         | count    | ops/s     | p50 us   | p90 us   | p99 us   | max us   | "
+        "captured p50 us | captured p99 us\n");
+
+    uint64_t *latencies = malloc((numCommands > 0 ? numCommands : 1) * sizeof(uint64_t));
+    uint64_t *capturedLatencies = malloc((numCommands > 0 ? numCommands : 1) * sizeof(uint64_t));
+    for (uint32_t typeNum = 0; typeNum < numTypes; typeNum++) {
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < numCommands; i++) {
+            if (commandTypes[i] == typeNum) {
+                latencies[count] = commands[i].replayLatency;
+                capturedLatencies[count] = commands[i].latency;
+                count++;
+            }
+        }
+        qsort(latencies, count, sizeof(uint64_t), compareLatencies);
+        qsort(capturedLatencies, count, sizeof(uint64_t), compareLatencies);
+
+        printf("%-15s | %-8u | %-9.0f | %-8.1f | %-8.1f | %-8.1f | %-8.1f | %-15.1f | %.1f\n", types[typeNum], count,
+            count / seconds, latencies[count / 2] / 1e3, latencies[count * 9 / 10] / 1e3,
+            latencies[count * 99 / 100] / 1e3, latencies[count - 1] / 1e3, capturedLatencies[count / 2] / 1e3,
+            capturedLatencies[count * 99 / 100] / 1e3);
+    }
+
+    free(latencies);
+    free(capturedLatencies);
+    free(commandTypes);
+    free(commands);
+    free(trace);
+    // Lsm tables of the copy, including any the trace created, only list their files once closed
+    uint32_t numPrefixes;
+    char **prefixes = lsmTablePrefixes(database->pager, copyFileName, &numPrefixes);
+    databaseClose(database);
+    for (uint32_t i = 0; i < numPrefixes; i++) {
+        uint32_t numFileNames;
+        char **fileNames = lsmFileNames(prefixes[i], &numFileNames);
+        for (uint32_t j = 0; j < numFileNames; j++) {
+            unlink(fileNames[j]);
+            free(fileNames[j]);
+        }
+        free(fileNames);
+        free(prefixes[i]);
     }
+    free(prefixes);
+    unlink(copyFileName);
+    unlink(copyHotPagesFileName);
+    free(copyFileName);
+    free(copyHotPagesFileName);
 }
 
-uint32_t *internalNodeKey(void *node, uint32_t keyNum) {
-    return (uint32_t *)((uint8_t *)internalNodeCell(node, keyNum) + INTERNAL_NODE_CHILD_SIZE);
+static double benchmarkSeconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
-uint32_t getNodeMaxKey(Pager *pager, void *node) {
-    if (getNodeType(node) == LEAF_NODE) {
-        return (*leafNodeKey(node, *leafNodenumCells(node) - 1));
+// Resident set of this process in bytes
+static double benchmarkRssBytes() {
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
     }
-
-    void *rightChild = getPage(pager, *internalNodeRightChild(node));
-    return getNodeMaxKey(pager, rightChild);
+    return (double)pages * sysconf(_SC_PAGESIZE);
 }
 
-bool isNodeRoot(void *node) {
-    uint8_t value = *((uint8_t *)node + IS_ROOT_OFFSET);
-    return (value != 0);
+// Bytes of fileName the kernel is holding in its page cache
+static double benchmarkFileCachedBytes(char *fileName) {
+    int fd = open(fileName, O_RDONLY);
+    off_t length = fd == -1 ? 0 : lseek(fd, 0, SEEK_END);
+    double cached = 0;
+
+    if (length > 0) {
+        long systemPageSize = sysconf(_SC_PAGESIZE);
+        size_t numSystemPages = (length + systemPageSize - 1) / systemPageSize;
+        void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        unsigned char *residency = malloc(numSystemPages);
+        if (map != MAP_FAILED && mincore(map, length, residency) == 0) {
+            for (size_t i = 0; i < numSystemPages; i++) {
+                cached += (residency[i] & 1) ? systemPageSize : 0;
+            }
+        }
+        free(residency);
+        if (map != MAP_FAILED) {
+            munmap(map, length);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return cached;
 }
 
-void setNodeRoot(void *node, bool isRoot) {
-    uint8_t value = isRoot;
-    *((uint8_t *)node + IS_ROOT_OFFSET) = value;
+static void benchmarkDropFileCache(char *fileName) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd != -1) {
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+    }
 }
 
-Table *doDelete(InputBuffer *input, Table *table, char *fileName) {
-    char *arg = strtok(NULL, " ");
-    if (arg == NULL) {
-        printf("Id missing\n");
-        return table;
+// Loads numRows rows at every supported page size, first through the kernel page cache and then with
+// O_DIRECT, and times inserts, full scans and point lookups
+void runBenchmark(uint32_t numRows) {
+    if (numRows == 0) {
+        printf("Benchmark needs at least one row\n");
+        return;
     }
 
-    if (!isNumber(arg)) {
-        printf("Id not a number\n");
-        return table;
+    // Stepping by a prime coprime to numRows visits every id once in a scattered order
+    uint32_t step = 2654435761u % numRows;
+    while (step == 0 || numRows % step == 0 || step % 2 == 0) {
+        step++;
     }
 
-    uint32_t id = atoi(arg);
+    printf("%u rows, %u lookups\n", numRows, numRows);
+    printf("io       | page size | pages   | insert rows/s | cold scan rows/s | warm scan rows/s | lookups/s | "
+        "multi-get/s | restart scan rows/s | rss MB | os cache MB\n");
+
+    for (int ioFlags = 0; ioFlags <= PAGER_DIRECT_IO; ioFlags += PAGER_DIRECT_IO) {
+#ifdef O_DIRECT
+        if (ioFlags & PAGER_DIRECT_IO) {
+            int fd = open(BENCHMARK_FILE_NAME, O_RDWR | O_CREAT | O_DIRECT, S_IWUSR | S_IRUSR);
+            if (fd == -1) {
+                printf("Direct I/O is not supported here, skipping it\n");
+                break;
+            }
+            close(fd);
+        }
+#else
+        if (ioFlags & PAGER_DIRECT_IO) {
+            break;
+        }
+#endif
+        char *ioName = (ioFlags & PAGER_DIRECT_IO) ? "direct" : "buffered";
 
-    Cursor *cursor = tableFind(table, id);
-    void *node = getPage(table->pager, cursor->pageNum);
-    if (*leafNodeKey(node, cursor->cellNum) != id) {
-        printf("Id not in databse\n");
-        return table;
-    }  
+        for (uint32_t pageSize = MIN_PAGE_SIZE; pageSize <= MAX_PAGE_SIZE; pageSize *= 2) {
+            struct timespec start;
+            Row row;
+            memset(&row, 0, sizeof(Row));
+            unlink(BENCHMARK_FILE_NAME);
+
+            Database *database = databaseOpen(BENCHMARK_FILE_NAME, pageSize, ioFlags);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (uint64_t i = 0; i < numRows; i++) {
+                row.id = (uint32_t)((i * step) % numRows) + 1;
+                snprintf(row.userName, sizeof(row.userName), "user%llu", (unsigned long long)row.id);
+                snprintf(row.email, sizeof(row.email), "user%llu@example.com", (unsigned long long)row.id);
+                tableInsert(database->currentTable, &row);
+            }
+            double insertSeconds = benchmarkSeconds(&start);
+            uint32_t numPages = database->pager->numPages;
+            databaseClose(database);
+            unlink(BENCHMARK_FILE_NAME HOT_PAGES_SUFFIX);
+            benchmarkDropFileCache(BENCHMARK_FILE_NAME);
+
+            double scanSeconds[2];
+            database = databaseOpen(BENCHMARK_FILE_NAME, pageSize, ioFlags);
+            for (int pass = 0; pass < 2; pass++) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                Cursor *cursor = tableStart(database->currentTable);
+                uint32_t scanned = 0;
+                while (!cursor->endOfTable) {
+                    deserialiseRow(cursorValue(cursor), &row);
+                    scanned++;
+                    cursorAdvance(cursor);
+                }
+                free(cursor);
+                scanSeconds[pass] = benchmarkSeconds(&start);
+                if (scanned != numRows) {
+                    printf("Scan at page size %u returned %u rows\n", pageSize, scanned);
+                }
+            }
 
-    table = deleteNode(table, id, fileName);
-    printf("Deleted Successfuly\n");
-    return table;
-}
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (uint64_t i = 0; i < numRows; i++) {
+                uint64_t id = ((i + numRows / 2) * step) % numRows + 1;
+                uint8_t key[KEY_MAX_SIZE];
+                keyEncodeUint64(id, key);
+                Cursor *cursor = tableFind(database->currentTable, key);
+                deserialiseRow(cursorValue(cursor), &row);
+                if (row.id != id) {
+                    printf("Lookup of %llu at page size %u found %llu\n", (unsigned long long)id, pageSize,
+                        (unsigned long long)row.id);
+                }
+                free(cursor);
+            }
+            double lookupSeconds = benchmarkSeconds(&start);
+
+            // The same keys again, handed over in batches
+            uint64_t keys[BENCHMARK_MULTI_GET_BATCH];
+            Row *rows = malloc(BENCHMARK_MULTI_GET_BATCH * sizeof(Row));
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (uint64_t i = 0; i < numRows; i += BENCHMARK_MULTI_GET_BATCH) {
+                uint32_t batchSize = 0;
+                for (uint64_t j = i; j < numRows && batchSize < BENCHMARK_MULTI_GET_BATCH; j++) {
+                    keys[batchSize++] = ((j + numRows / 2) * step) % numRows + 1;
+                }
+                batchSize = sortKeys(keys, batchSize);
+                uint32_t numFound = tableMultiGet(database->currentTable, keys, batchSize, rows);
+                if (numFound != batchSize) {
+                    printf("Multi-get at page size %u found %u of %u keys\n", pageSize, numFound, batchSize);
+                }
+            }
+            double multiGetSeconds = benchmarkSeconds(&start);
+            free(rows);
+            // Every page is cached by now, so this is the whole memory cost of the table
+            double rssBytes = benchmarkRssBytes();
+            double fileCachedBytes = benchmarkFileCachedBytes(BENCHMARK_FILE_NAME);
+            databaseClose(database);
+            benchmarkDropFileCache(BENCHMARK_FILE_NAME);
+
+            // Reopening with the hot pages file left behind by the close, open time included
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            database = databaseOpen(BENCHMARK_FILE_NAME, pageSize, ioFlags);
+            Cursor *cursor = tableStart(database->currentTable);
+            while (!cursor->endOfTable) {
+                deserialiseRow(cursorValue(cursor), &row);
+                cursorAdvance(cursor);
+            }
+            free(cursor);
+            double restartSeconds = benchmarkSeconds(&start);
+            databaseClose(database);
 
-Table *deleteNode(Table *table, uint32_t id, char *fileName) {
-    Table *tempTable = databaseOpen("temp");
-    bool *visisted = malloc(TABLE_MAX_PAGES * sizeof(bool));
-    memset(visisted, false, TABLE_MAX_PAGES * sizeof(bool));
-    copyFile(table, tempTable, id, table->rootPageNum, visisted);
-    free(visisted);
+            printf("%-8s | %-9u | %-7u | %-13.0f | %-16.0f | %-16.0f | %-9.0f | %-11.0f | %-19.0f | %-6.1f | %.1f\n",
+                ioName, pageSize, numPages, numRows / insertSeconds, numRows / scanSeconds[0],
+                numRows / scanSeconds[1], numRows / lookupSeconds, numRows / multiGetSeconds,
+                numRows / restartSeconds, rssBytes / (1 << 20), fileCachedBytes / (1 << 20));
+        }
+    }
 
-    databaseClose(tempTable);
-    databaseClose(table);
+    // Random inserts into each engine, timed up to the close so everything has reached the file
+    printf("\nengine | insert rows/s | lookups/s\n");
+    for (TableEngine engine = ENGINE_BTREE; engine <= ENGINE_HASH; engine++) {
+        struct timespec start;
+        Row row;
+        memset(&row, 0, sizeof(Row));
+        unlink(BENCHMARK_FILE_NAME);
+
+        Database *database = databaseOpen(BENCHMARK_FILE_NAME, DEFAULT_PAGE_SIZE, 0);
+        createTable(database->pager, BENCHMARK_TABLE_NAME, engine, NULL, 0);
+        tableClose(database->currentTable);
+        database->currentTable = tableOpen(database->pager, BENCHMARK_TABLE_NAME);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint64_t i = 0; i < numRows; i++) {
+            row.id = (uint32_t)((i * step) % numRows) + 1;
+            snprintf(row.userName, sizeof(row.userName), "user%llu", (unsigned long long)row.id);
+            snprintf(row.email, sizeof(row.email), "user%llu@example.com", (unsigned long long)row.id);
+            tableInsert(database->currentTable, &row);
+        }
+        databaseClose(database);
+        double insertSeconds = benchmarkSeconds(&start);
+
+        database = databaseOpen(BENCHMARK_FILE_NAME, DEFAULT_PAGE_SIZE, 0);
+        tableClose(database->currentTable);
+        database->currentTable = tableOpen(database->pager, BENCHMARK_TABLE_NAME);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint64_t i = 0; i < numRows; i++) {
+            uint64_t key = ((i + numRows / 2) * step) % numRows + 1;
+            if (tableMultiGet(database->currentTable, &key, 1, &row) != 1 || row.id != key) {
+                printf("Lookup of %llu in the %s table failed\n", (unsigned long long)key, tableEngineName(engine));
+            }
+        }
+        double lookupSeconds = benchmarkSeconds(&start);
+        if (database->currentTable->lsm != NULL) {
+            lsmClose(database->currentTable->lsm, true);
+            database->currentTable->lsm = NULL;
+        }
+        databaseClose(database);
 
-    int tempFd = open("temp", O_RDONLY);
-    if (tempFd == -1) {
-        perror("open temp failed");
-        exit(EXIT_FAILURE);
+        printf("%-6s | %-13.0f | %.0f\n", tableEngineName(engine), numRows / insertSeconds,
+            numRows / lookupSeconds);
     }
 
-    int outFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (outFd == -1) {
-        perror("open output failed");
-        exit(EXIT_FAILURE);
+    unlink(BENCHMARK_FILE_NAME);
+    unlink(BENCHMARK_FILE_NAME HOT_PAGES_SUFFIX);
+}
+
+static void removeReplicationTestFiles() {
+    unlink(REPLICATION_TEST_LEADER_FILE_NAME);
+    unlink(REPLICATION_TEST_LEADER_FILE_NAME HOT_PAGES_SUFFIX);
+    unlink(REPLICATION_TEST_LEADER_FILE_NAME REPLICATION_LOG_SUFFIX);
+    unlink(REPLICATION_TEST_FOLLOWER_FILE_NAME);
+    unlink(REPLICATION_TEST_FOLLOWER_FILE_NAME HOT_PAGES_SUFFIX);
+}
+
+// Runs a leader and a follower in one process, inserts numRows rows on the leader in batches and
+// measures how long each batch takes to show up on the follower, then checks the follower has every row
+void runReplicationTest(uint32_t numRows) {
+    if (numRows == 0) {
+        printf("Replication test needs at least one row\n");
+        return;
     }
 
-    char buffer[PAGE_SIZE];
-    ssize_t bytesRead;
-    while ((bytesRead = read(tempFd, buffer, PAGE_SIZE)) > 0) {
-        if (write(outFd, buffer, bytesRead) != bytesRead) {
-            perror("write failed");
-            exit(EXIT_FAILURE);
+    uint32_t step = 2654435761u % numRows;
+    while (step == 0 || numRows % step == 0 || step % 2 == 0) {
+        step++;
+    }
+
+    removeReplicationTestFiles();
+    Database *leader = databaseOpen(REPLICATION_TEST_LEADER_FILE_NAME, DEFAULT_PAGE_SIZE, 0);
+    replicationLeaderStart(leader, REPLICATION_TEST_LEADER_FILE_NAME REPLICATION_LOG_SUFFIX);
+    Database *follower = databaseOpen(REPLICATION_TEST_FOLLOWER_FILE_NAME, DEFAULT_PAGE_SIZE, 0);
+    replicationFollowerStart(follower, REPLICATION_TEST_LEADER_FILE_NAME REPLICATION_LOG_SUFFIX);
+
+    Row row;
+    memset(&row, 0, sizeof(Row));
+    struct timespec start;
+    double insertSeconds = 0;
+    double totalLagSeconds = 0;
+    double maxLagSeconds = 0;
+    uint32_t numBatches = 0;
+
+    for (uint64_t i = 0; i < numRows; i += REPLICATION_TEST_BATCH) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint64_t j = i; j < numRows && j < i + REPLICATION_TEST_BATCH; j++) {
+            row.id = (uint32_t)((j * step) % numRows) + 1;
+            snprintf(row.userName, sizeof(row.userName), "user%llu", (unsigned long long)row.id);
+            snprintf(row.email, sizeof(row.email), "user%llu@example.com", (unsigned long long)row.id);
+            tableInsert(leader->currentTable, &row);
+            replicationCommit(leader);
+        }
+        insertSeconds += benchmarkSeconds(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        replicationIdle(leader);
+        while (__atomic_load_n(&follower->replication->lsn, __ATOMIC_RELAXED) < leader->replication->lsn) {
+            usleep(100);
         }
+        double lagSeconds = benchmarkSeconds(&start);
+        totalLagSeconds += lagSeconds;
+        if (lagSeconds > maxLagSeconds) {
+            maxLagSeconds = lagSeconds;
+        }
+        numBatches++;
+    }
+
+    uint64_t *keys = malloc(numRows * sizeof(uint64_t));
+    Row *rows = malloc(numRows * sizeof(Row));
+    for (uint32_t i = 0; i < numRows; i++) {
+        keys[i] = i + 1;
     }
+    pthread_mutex_lock(&follower->replication->lock);
+    uint32_t numFound = tableMultiGet(follower->currentTable, keys, numRows, rows);
+    pthread_mutex_unlock(&follower->replication->lock);
+    free(keys);
+    free(rows);
+
+    printf("%u rows in %u batches of %u, leader at %.0f rows/s\n", numRows, numBatches, REPLICATION_TEST_BATCH,
+        numRows / insertSeconds);
+    printf("Follower lag after each batch: mean %.2f ms, max %.2f ms\n", totalLagSeconds * 1000 / numBatches,
+        maxLagSeconds * 1000);
+    printf("Follower has %u of %u rows: %s\n", numFound, numRows, numFound == numRows ? "ok" : "MISMATCH");
+
+    databaseClose(follower);
+    databaseClose(leader);
+    removeReplicationTestFiles();
+}
 
-    close(tempFd);
-    close(outFd);
+/*
+* Library API, see simpledb.h
+*/
+struct SimpleDbTable {
+    SimpleDb *db;
+    Table *table;
+    // Lsm rows are copied out rather than pointed at
+    uint8_t row[ROW_SIZE];
+    struct SimpleDbTable *next;
+};
+
+struct SimpleDb {
+    Database *database;
+    // One handle per table, a second Table would open a second lsm over the same files
+    SimpleDbTable *tables;
+};
+
+struct SimpleDbStatement {
+    SimpleDbTable *table;
+    SimpleDbOperation operation;
+};
+
+struct SimpleDbCursor {
+    SimpleDbTable *table;
+    Cursor *cursor;
+    // The row handed out last is only stepped past on the next call, an lsm cursor may refill its batch
+    // over it
+    bool advance;
+};
+
+static void simpledbRowView(const uint8_t *value, SimpleDbRow *row) {
+    memcpy(&row->id, value + ID_OFFSET, ID_SIZE);
+    row->userName = (const char *)value + USERNAME_OFFSET;
+    row->userNameLength = strnlen(row->userName, USERNAME_SIZE);
+    row->email = (const char *)value + EMAIL_OFFSET;
+    row->emailLength = strnlen(row->email, EMAIL_SIZE);
+}
 
-    deleteFile("temp");
+SimpleDb *simpledbOpen(const char *fileName) {
+    char *name = strdup(fileName);
+    const char *error;
+    Database *database = databaseTryOpen(name, DEFAULT_PAGE_SIZE, 0, &error);
+    free(name);
+    if (database == NULL) {
+        return NULL;
+    }
 
-    return databaseOpen(fileName);
+    SimpleDb *db = malloc(sizeof(SimpleDb));
+    db->database = database;
+    db->tables = NULL;
+    return db;
 }
 
-void copyFile(Table *table, Table *tempTable, uint32_t id, uint32_t pageNum, bool *visited) {
-    if (visited[pageNum]) {
-        return;
+void simpledbClose(SimpleDb *db) {
+    Table *currentTable = db->database->currentTable;
+    while (db->tables != NULL) {
+        SimpleDbTable *table = db->tables;
+        db->tables = table->next;
+        if (table->table != currentTable) {
+            tableClose(table->table);
+        }
+        free(table);
     }
-    visited[pageNum] = true;
-    void *node = getPage(table->pager, pageNum);
-    NodeType type = getNodeType(node);
-    if (type == LEAF_NODE) {
-        uint32_t numCells = *leafNodenumCells(node);
-        for (uint32_t i = 0; i < numCells; i++) {
-            Row row;
-            Row *rowToInsert = malloc(sizeof(Row));
-            void *value = leafNodeValue(node, i);
-            deserialiseRow(value, &row);
-            if (row.id == id) {
-                free(rowToInsert);
-                continue; 
-            };
-            
-            rowToInsert->id = row.id;
-            strncpy(rowToInsert->userName, row.userName, MAX_USERNAME_SIZE);
-            strncpy(rowToInsert->email, row.email, MAX_EMAIL_SIZE);
-            uint32_t keyToInsert = rowToInsert->id;
-            Cursor *cursor = tableFind(tempTable, keyToInsert);
-            leafNodeInsert(cursor, keyToInsert, rowToInsert);
-            free(rowToInsert);
-            free(cursor);
+    databaseClose(db->database);
+    free(db);
+}
+
+SimpleDbTable *simpledbTable(SimpleDb *db, const char *name) {
+    for (SimpleDbTable *table = db->tables; table != NULL; table = table->next) {
+        if (strncmp(table->table->name, name, CATALOG_TABLE_NAME_SIZE) == 0) {
+            return table;
         }
-    } else if (type == INTERNAL_NODE) {
-        uint32_t numKeys = *internalNodeNumKeys(node);
+    }
 
-        if (numKeys > 0) {
-            for (uint32_t i = 0; i < numKeys; i++) {
-                uint32_t leftChildPageNum = *internalNodeChild(node, i);
-                copyFile(table, tempTable, id, leftChildPageNum, visited);
-            }
+    // The database already holds the table it opened on, reuse that one
+    Table *opened = db->database->currentTable;
+    if (opened == NULL || strncmp(opened->name, name, CATALOG_TABLE_NAME_SIZE) != 0) {
+        char tableName[CATALOG_TABLE_NAME_SIZE + 1] = {0};
+        strncpy(tableName, name, CATALOG_TABLE_NAME_SIZE);
+        opened = tableOpen(db->database->pager, tableName);
+        if (opened == NULL) {
+            return NULL;
         }
-        uint32_t rightChildPageNum = *internalNodeRightChild(node);
-        copyFile(table, tempTable, id, rightChildPageNum, visited);
     }
+
+    SimpleDbTable *table = malloc(sizeof(SimpleDbTable));
+    table->db = db;
+    table->table = opened;
+    table->next = db->tables;
+    db->tables = table;
+    return table;
 }
 
-void deleteFile(char *path) {
-    pid_t pid;
-    char *args[] = {
-        "/usr/bin/rm",
-        path,
-        NULL
-    };
+SimpleDbStatement *simpledbPrepare(SimpleDbTable *table, SimpleDbOperation operation) {
+    SimpleDbStatement *statement = malloc(sizeof(SimpleDbStatement));
+    statement->table = table;
+    statement->operation = operation;
+    return statement;
+}
 
-    int res = posix_spawn(&pid, args[0], NULL, NULL, args, environ);
+SimpleDbStatus simpledbExecute(SimpleDbStatement *statement, const SimpleDbRow *row) {
+    Table *table = statement->table->table;
+    if (statement->operation == SIMPLEDB_DELETE) {
+        return tableDelete(table, row->id) ? SIMPLEDB_OK : SIMPLEDB_NOT_FOUND;
+    }
 
-    if (res != 0) {
-        printf("Could not delete temp\n");
-        return;
+    if (row->userNameLength > MAX_USERNAME_SIZE || row->emailLength > MAX_EMAIL_SIZE) {
+        return SIMPLEDB_INVALID;
+    }
+    Row rowToInsert;
+    memset(&rowToInsert, 0, sizeof(Row));
+    rowToInsert.id = row->id;
+    memcpy(rowToInsert.userName, row->userName, row->userNameLength);
+    memcpy(rowToInsert.email, row->email, row->emailLength);
+    if (!isUserName(rowToInsert.userName) || !isEmail(rowToInsert.email)) {
+        return SIMPLEDB_INVALID;
     }
+    return tableInsert(table, &rowToInsert) ? SIMPLEDB_OK : SIMPLEDB_DUPLICATE;
+}
+
+void simpledbFinalize(SimpleDbStatement *statement) {
+    free(statement);
+}
 
-    int exit_status;
+SimpleDbStatus simpledbGet(SimpleDbTable *table, uint64_t id, SimpleDbRow *row) {
+    uint8_t *value = tableGet(table->table, id, table->row);
+    if (value == NULL) {
+        return SIMPLEDB_NOT_FOUND;
+    }
+    simpledbRowView(value, row);
+    return SIMPLEDB_OK;
+}
 
-    if (waitpid(pid, &exit_status, 0) == -1) {
-        printf("waitpid\n");
-        return;
+SimpleDbCursor *simpledbCursorOpen(SimpleDbTable *table) {
+    SimpleDbCursor *cursor = calloc(1, sizeof(SimpleDbCursor));
+    cursor->table = table;
+    cursor->cursor = tableStart(table->table);
+    return cursor;
+}
+
+SimpleDbStatus simpledbCursorSeek(SimpleDbCursor *cursor, uint64_t id) {
+    Table *table = cursor->table->table;
+    if (table->lsm != NULL) {
+        cursor->advance = false;
+        cursor->cursor->nextKey = id;
+        cursor->cursor->exhausted = false;
+        lsmCursorFill(cursor->cursor);
+        return SIMPLEDB_OK;
+    } else if (table->engine == ENGINE_HASH || !tableKeyedById(table)) {
+        return SIMPLEDB_UNSUPPORTED;
+    }
+
+    uint8_t key[KEY_MAX_SIZE];
+    keyEncodeUint64(id, key);
+    free(cursor->cursor);
+    cursor->cursor = tableFind(table, key);
+    cursor->advance = false;
+    // Past the last cell of a leaf means the start of the next one
+    void *node = getPage(table->pager, cursor->cursor->pageNum);
+    if (cursor->cursor->cellNum >= *leafNodenumCells(node)) {
+        if (*leafNodeNextLeaf(node) == 0) {
+            cursor->cursor->endOfTable = true;
+        } else {
+            cursor->cursor->pageNum = *leafNodeNextLeaf(node);
+            cursor->cursor->cellNum = 0;
+        }
     }
-}
\ No newline at end of file
+    return SIMPLEDB_OK;
+}
+
+SimpleDbStatus simpledbCursorNext(SimpleDbCursor *cursor, SimpleDbRow *row) {
+    if (cursor->advance) {
+        cursorAdvance(cursor->cursor);
+        cursor->advance = false;
+    }
+    if (cursor->cursor->endOfTable) {
+        return SIMPLEDB_DONE;
+    }
+    simpledbRowView(cursorValue(cursor->cursor), row);
+    cursor->advance = true;
+    return SIMPLEDB_OK;
+}
+
+void simpledbCursorClose(SimpleDbCursor *cursor) {
+    free(cursor->cursor);
+    free(cursor);
+}
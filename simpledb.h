@@ -0,0 +1,76 @@
+#ifndef SIMPLEDB_H
+#define SIMPLEDB_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Only these are exported from the shared library, everything else in database.c stays internal
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMPLEDB_API __attribute__((visibility("default")))
+#else
+#define SIMPLEDB_API
+#endif
+
+typedef enum {
+    SIMPLEDB_OK,
+    // The cursor has no more rows
+    SIMPLEDB_DONE,
+    SIMPLEDB_NOT_FOUND,
+    SIMPLEDB_DUPLICATE,
+    // A field is too long, or too short, for its column
+    SIMPLEDB_INVALID,
+    // The table's engine or key cannot do this, e.g. seeking a hash table
+    SIMPLEDB_UNSUPPORTED
+} SimpleDbStatus;
+
+typedef enum { SIMPLEDB_INSERT, SIMPLEDB_DELETE } SimpleDbOperation;
+
+// A row as stored. Strings are not NUL terminated. Rows handed out by the library point into the
+// database and stay valid until the next call that writes to it or moves the same cursor.
+typedef struct {
+    uint64_t id;
+    const char *userName;
+    uint32_t userNameLength;
+    const char *email;
+    uint32_t emailLength;
+} SimpleDbRow;
+
+typedef struct SimpleDb SimpleDb;
+typedef struct SimpleDbTable SimpleDbTable;
+typedef struct SimpleDbStatement SimpleDbStatement;
+typedef struct SimpleDbCursor SimpleDbCursor;
+
+// A handle is used by one thread at a time. Closing it writes every page back to the file, unless
+// fileName is ":memory:", which keeps the whole database in process memory.
+// Returns NULL, printing nothing, if the file cannot be opened, is open in another process, or has a
+// bad catalog (short, invalid page size or checksum mismatch). A page found corrupt after opening
+// still ends the process.
+SIMPLEDB_API SimpleDb *simpledbOpen(const char *fileName);
+SIMPLEDB_API void simpledbClose(SimpleDb *db);
+
+// NULL if there is no such table. Handles belong to the database and go away when it closes.
+SIMPLEDB_API SimpleDbTable *simpledbTable(SimpleDb *db, const char *name);
+
+// Insert uses every field of the row, delete only its id
+SIMPLEDB_API SimpleDbStatement *simpledbPrepare(SimpleDbTable *table, SimpleDbOperation operation);
+SIMPLEDB_API SimpleDbStatus simpledbExecute(SimpleDbStatement *statement, const SimpleDbRow *row);
+SIMPLEDB_API void simpledbFinalize(SimpleDbStatement *statement);
+
+SIMPLEDB_API SimpleDbStatus simpledbGet(SimpleDbTable *table, uint64_t id, SimpleDbRow *row);
+
+// Cursors start at the first row and walk the table in key order, or bucket order for hash tables.
+// Writing to the table while one is open leaves it undefined, except on lsm tables.
+SIMPLEDB_API SimpleDbCursor *simpledbCursorOpen(SimpleDbTable *table);
+// Moves to the first row whose id is at least id, on tables ordered by id
+SIMPLEDB_API SimpleDbStatus simpledbCursorSeek(SimpleDbCursor *cursor, uint64_t id);
+SIMPLEDB_API SimpleDbStatus simpledbCursorNext(SimpleDbCursor *cursor, SimpleDbRow *row);
+SIMPLEDB_API void simpledbCursorClose(SimpleDbCursor *cursor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif